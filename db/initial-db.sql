@@ -44,9 +44,11 @@ DROP TABLE IF EXISTS `KeyPairs`;
 /*!40101 SET @saved_cs_client     = @@character_set_client */;
 /*!40101 SET character_set_client = utf8 */;
 CREATE TABLE `KeyPairs` (
+  `kp_id` int(10) unsigned NOT NULL,
   `pk` binary(32) NOT NULL,
   `sk` binary(32) NOT NULL,
-  PRIMARY KEY (`pk`,`sk`)
+  `kp_created` timestamp NOT NULL DEFAULT current_timestamp(),
+  PRIMARY KEY (`kp_id`)
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_general_ci;
 /*!40101 SET character_set_client = @saved_cs_client */;
 /*!40103 SET TIME_ZONE=@OLD_TIME_ZONE */;
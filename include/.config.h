@@ -15,9 +15,55 @@
   #define TEST_MODE     0
   #define PROD_MODE     0
 
+  #define BENCH_OPCODES 0   // registers the benchmark requests (REQ_BENCH_*), refused in production mode
+
+  #define SESS_KEY_AUDIT 0   // also writes the session keys to the Connection table (audit only, never read back)
+
   #define DISCO_HOURS         1
   #define CLEANUP_HOURS       24
 
+  #define XFER_WINDOW         8U  // chunks a client may send in a chunked transfer before waiting for an ack
+
+  #define SCHED_QUANTUM       2048    // bytes a weight 1 client may process per scheduling round
+  #define SCHED_MAX_FRAMES    16U     // frames a client may process per round whatever its weight
+  #define SCHED_CLASSES       4U      // client classes of the fair scheduler
+  #define SCHED_WEIGHTS       {1, 2, 4, 8}  // quantum multiplier of every client class
+
+  #define OVL_TARGET_US       5000U   // acceptable standing queueing delay of a worker (length of its scheduling rounds)
+  #define OVL_INTERVAL_MS     100U    // window the shortest round is measured over
+  #define OVL_RETRY_MS        250U    // delay suggested to the clients whose requests are shed
+
+  #define REQ_INFLIGHT_MAX    8U      // requests carrying an id a connection may have running at once
+  #define CONN_WINDOW         131072U // request bytes a connection may have sent but not completed yet
+  #define CONN_RCVBUF         65536   // kernel receive buffer of a connection (SO_RCVBUF)
+  #define STREAMS_PER_CONN    8U      // logical streams a connection may have open at once
+
+  #define CRYPTO_QUEUE        256U    // handshakes waiting for the crypto threads (power of 2)
+
+  #define TICKET_LIFETIME_S   3600U   // a resumption ticket is accepted for this long after it is issued
+  #define TICKET_ROTATE_S     3600U   // the ticket key changes this often (the previous one is still accepted)
+  #define TICKET_REPLAY_SLOTS 4096U   // tickets redeemed and not expired yet remembered against replays (power of 2)
+  #define TICKET_REPLAY_PROBE 8U      // slots probed per ticket, a ticket finding none free is refused
+
+  #define REKEY_BYTES         (1ULL << 30) // the server updates the keys of a connection after this many bytes...
+  #define REKEY_INTERVAL_S    900U    // ...or this long after the last update (PROTO_CAP_REKEY, checked every HB_TICK_MS)
+  #define REKEY_OVERLAP       64U     // frames a client may still seal with its old key after announcing an update
+
+  #define KEYPAIR_GENERATIONS 2U      // keypairs of the server kept in memory, handshakes may complete with any of them
+  #define KEYPAIR_ROTATE_S    86400U  // a new keypair every this long (0: only on request / SIGHUP)
+
+  #define HB_INTERVAL_MS      1000U   // an idle client negotiating heartbeats sends one at least this often
+  #define HB_TIMEOUT_MS       5000U   // such a client silent for longer is considered dead and disconnected
+  #define HB_TICK_MS          500U    // period of the liveness check of a worker (all its clients at once)
+  #define STREAM_WINDOW       65536U  // request bytes a stream may have pending before the server gives credit back
+
+  #define COMP_DICT_PATH      "dict/comp-%u.dict"  // compression dictionaries (trained with bin/init/new-dict)
+  #define COMP_DICTS          4U      // number of dictionary ids
+  #define COMP_DICT_MAX       65536U  // LZ4 only uses the last 64KB of a dictionary
+  #define COMP_MIN_SIZE       64U     // payloads under this size are never compressed
+  #define COMP_RATIO_NUM      7U      // payloads are sent raw unless they shrink
+  #define COMP_RATIO_DEN      8U      // to COMP_RATIO_NUM / COMP_RATIO_DEN of their size
+
 //===============================================
 //              ----MODES----
 //===============================================
@@ -32,6 +78,7 @@
   #define SERVER_THREAD_NO    1U // change this base on system limit and testings
   #define SERVER_BACKLOG      16U    // number of clients allowed
   #define CLIENTS_PER_THREAD  (SERVER_BACKLOG / SERVER_THREAD_NO)
+  #define CRYPTO_THREAD_NO    1U // threads opening the handshake boxes (0: the workers open them)
   #define DB_DEFAULT_HOST "127.0.0.1" // only to be ussed during developement phase
   #define DB_DEFAULT_USER "test_user" // only to be ussed during developement phase
   #define DB_DEFAULT_PASS "password" // only to be ussed during developement phase
@@ -49,6 +96,7 @@
   #define SERVER_THREAD_NO    2U // change this base on system limit and testings
   #define SERVER_BACKLOG      1024U    // number of clients allowed
   #define CLIENTS_PER_THREAD  (SERVER_BACKLOG / SERVER_THREAD_NO)
+  #define CRYPTO_THREAD_NO    2U // threads opening the handshake boxes (0: the workers open them)
   #define DB_DEFAULT_PORT 3306U // you can change
 
 ///@brief we go full throttle ipv4 || ipv6 || domain name 
@@ -62,10 +110,23 @@
   #define SERVER_THREAD_NO    4U
   #define SERVER_BACKLOG      4096U    // number of clients allowed
   #define CLIENTS_PER_THREAD  (SERVER_BACKLOG / SERVER_THREAD_NO)
+  #define CRYPTO_THREAD_NO    2U // threads opening the handshake boxes (0: the workers open them)
   #define DB_DEFAULT_PORT 3306U // you can change
 
 #else
   #error "Only one Mode can be chosen out of dev || test || prod\n"
 #endif
 
+#if (KEYPAIR_GENERATIONS < 2)
+  #error "Rotating the keypair needs the previous generation for the handshakes in flight (KEYPAIR_GENERATIONS >= 2)\n"
+#endif
+
+#if (TICKET_LIFETIME_S > TICKET_ROTATE_S)
+  #error "A ticket must expire before its key is rotated out (TICKET_LIFETIME_S <= TICKET_ROTATE_S)\n"
+#endif
+
+#if (BENCH_OPCODES && PROD_MODE)
+  #error "The benchmark requests cannot be enabled in production mode\n"
+#endif
+
 #endif
\ No newline at end of file
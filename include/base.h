@@ -13,6 +13,9 @@
 #include <fcntl.h>
 #include <strings.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <mysql/mysql.h>
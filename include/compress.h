@@ -0,0 +1,102 @@
+
+
+#ifndef COMPRESS_H
+#define COMPRESS_H    1
+#include "threads.h"
+#define LZ4_STATIC_LINKING_ONLY   // LZ4_attach_dictionary()
+#include <lz4.h>
+/*==========================================================================================
+|Per connection payload compression                                                         |
+|                                                                                           |
+|The codec is negotiated in the hello of REQ_SEND_ASYMKEY (PROTO_CAP_COMP, request.h):     |
+|the client asks for a codec and a dictionary, the server answers the ones it picked.       |
+|Clients that do not ask keep the uncompressed format.                                      |
+|                                                                                           |
+|When a codec is negotiated every plaintext starts with a one byte header, compression     |
+|happens before encryption and decompression after decryption:                             |
+|             [COMP_RAW][data]                                                              |
+|             [COMP_LZ4 | COMP_LZ4_DICT][original len 4][lz4 block]                          |
+|Small payloads and payloads that do not shrink enough are sent raw.                        |
+|                                                                                           |
+|Dictionaries are trained offline from captured payloads (bin/init/new-dict) and loaded at  |
+|startup from COMP_DICT_PATH, client and server must share the same files.                  |
+|==========================================================================================*/
+
+//---CODECS---|
+#define COMP_NONE           0  // no header at all (legacy clients)
+#define COMP_LZ4            1
+#define COMP_LZ4_DICT       2
+
+//---PAYLOAD HEADER---|
+#define COMP_RAW            0  // header value of a payload sent as is
+#define COMP_HDR_LEN        1U
+#define COMP_LEN_LEN        4U
+
+/// @brief compression counters, every thread only writes its own row
+typedef struct CompStats
+{
+  uint64_t packed;          // payloads sent compressed
+  uint64_t skipped_small;   // payloads under COMP_MIN_SIZE
+  uint64_t skipped_ratio;   // payloads that did not shrink enough
+  uint64_t bytes_in;        // plaintext bytes of the compressed payloads
+  uint64_t bytes_out;       // compressed bytes (bytes saved = bytes_in - bytes_out)
+  uint64_t ns_pack;         // time spent compressing
+  uint64_t unpacked;        // payloads received compressed
+  uint64_t ns_unpack;       // time spent decompressing
+}comp_stats_t;
+
+
+/**
+ * @brief Loads the compression dictionaries and initializes the per thread compression states.
+ *
+ * Missing dictionary files are not an error, clients asking for them fall back to plain LZ4.
+ *
+ * @return __SUCCESS__, or an error code if a dictionary cannot be read.
+ */
+errcode_t comp_init(void);
+
+/**
+ * @brief Picks the codec of a connection from what the client asked for.
+ *
+ * @param codec Codec asked by the client, set to the codec chosen.
+ * @param dict Dictionary asked by the client, set to the dictionary chosen.
+ */
+void comp_negotiate(uint32_t *codec, uint32_t *dict);
+
+/**
+ * @brief Compresses a payload before encryption.
+ *
+ * @param ctx State of the client (codec and dictionary).
+ * @param thread_index Index of the thread.
+ * @param m Plaintext payload.
+ * @param mlen Length of the payload.
+ * @param out Buffer of at least mlen + COMP_HDR_LEN bytes.
+ * @return Length written in out.
+ */
+size_t comp_pack(const cli_ctx_t *ctx, size_t thread_index, const uint8_t *m, size_t mlen, uint8_t *out);
+
+/**
+ * @brief Decompresses a payload after decryption.
+ *
+ * @param ctx State of the client (codec and dictionary).
+ * @param thread_index Index of the thread.
+ * @param in Decrypted payload (header included).
+ * @param inlen Length of the decrypted payload.
+ * @param out Buffer receiving the decompressed payload.
+ * @param out_cap Capacity of out.
+ * @param res Set to the plaintext (inside in for raw payloads, out otherwise).
+ * @param reslen Set to the length of the plaintext.
+ * @return __SUCCESS__, or ECOMP_DATA if the payload is malformed.
+ */
+errcode_t comp_unpack(const cli_ctx_t *ctx, size_t thread_index, const uint8_t *in, size_t inlen,
+  uint8_t *out, size_t out_cap, const uint8_t **res, size_t *reslen);
+
+/**
+ * @brief Sums the compression counters of all the threads (approximate snapshot).
+ *
+ * @param stats Output counters.
+ */
+void comp_stats_get(comp_stats_t *stats);
+
+
+#endif
@@ -52,9 +52,11 @@ errcode_t db_init(MYSQL **db_connect);
 
 /// used by the new-db module
 #define QUERY_CREATE_KEYPAIR "CREATE TABLE `KeyPairs` (\
+  `kp_id` int(10) unsigned NOT NULL,\
   `pk` binary(32) NOT NULL,\
   `sk` binary(32) NOT NULL,\
-  PRIMARY KEY (`pk`,`sk`)\
+  `kp_created` timestamp NOT NULL DEFAULT current_timestamp(),\
+  PRIMARY KEY (`kp_id`)\
 );"
 
 #define MAX_QUERY_LENGTHX 64
@@ -67,16 +69,19 @@ errcode_t db_init(MYSQL **db_connect);
 ///@brief QUERIES TO THE DATABASE
 #define QUERY_KEY_DELETE    "DELETE FROM KeyPairs;"
 
-#define QUERY_KEY_INSERT    "INSERT INTO KeyPairs (pk, sk) VALUES (?, ?);"
+#define QUERY_KEY_RETIRE    "DELETE FROM KeyPairs WHERE kp_id <= %u;"
+#define QUERY_KEY_RETIRE_LEN (__builtin_strlen(QUERY_KEY_RETIRE))
+
+#define QUERY_KEY_INSERT    "INSERT INTO KeyPairs (kp_id, pk, sk) VALUES (?, ?, ?);"
 #define QUERY_KEY_INSERT_LEN (__builtin_strlen(QUERY_KEY_INSERT))
 
-#define QUERY_SELECT_PK     "SELECT pk FROM KeyPairs;"
+#define QUERY_SELECT_PK     "SELECT pk FROM KeyPairs ORDER BY kp_id DESC LIMIT 1;"
 #define QUERY_SELECT_PK_LEN (__builtin_strlen(QUERY_SELECT_PK))
 
-#define QUERY_SELECT_SK     "SELECT sk FROM KeyPairs;"
+#define QUERY_SELECT_SK     "SELECT sk FROM KeyPairs ORDER BY kp_id DESC LIMIT 1;"
 #define QUERY_SELECT_SK_LEN (__builtin_strlen(QUERY_SELECT_SK))
 
-#define QUERY_SELECT_PK_SK  "SELECT pk, sk FROM KeyPairs;"
+#define QUERY_SELECT_PK_SK  "SELECT pk, sk FROM KeyPairs ORDER BY kp_id DESC LIMIT 1;"
 #define QUERY_SELECT_PK_SK_LEN (__builtin_strlen(QUERY_SELECT_PK_SK))
 
 /// @brief get (public key) from database
@@ -117,6 +117,13 @@ typedef unsigned int errcode_t;
 #define EMALLOC_FAIL_M3 "Error: memory allocation failed for co in db_co_get_all_by_auth_stat()"
 #define EMALLOC_FAIL_M4 "Error: memory allocation failed for co in db_co_get_all_by_ip()"
 #define EMALLOC_FAIL_M5 "Error: memory allocation failed for co in db_co_get_all_by_id()"
+#define EMALLOC_FAIL_M6 "Error: memory allocation failed for the state of a chunked transfer"
+#define EMALLOC_FAIL_M7 "Error: memory allocation failed for a compression dictionary"
+#define EMALLOC_FAIL_M8 "Error: memory allocation failed for the response buffer pools"
+#define EMALLOC_FAIL_M9 "Error: memory allocation failed for the session key store"
+#define EMALLOC_FAIL_M10 "Error: memory allocation failed for the crypto offload queues"
+#define EMALLOC_FAIL_M11 "Error: memory allocation failed for the ticket keys"
+#define EMALLOC_FAIL_M12 "Error: memory allocation failed for the server keypair"
 
 //=========================================================================
 
@@ -125,8 +132,42 @@ typedef unsigned int errcode_t;
 #define EREQ_FAIL           401
 #define EREQ_LEN            402
 
+#define EREQ_AUTH_STATE     300
+#define EREQ_REGISTER       301
+#define EREQ_NSEG           302
+#define EREQ_BATCH          303
+#define EREQ_XFER           304
+#define ECOMP_DATA          305
+#define ECOMP_DICT          306
+#define EREQ_SHED           307 // not logged, shedding must stay cheap
+#define EREQ_HELLO          308
+#define EREQ_CAPS           309
+#define ERESP_POOL          310
+#define EREQ_FLAGS          311
+#define EREQ_INFLIGHT       312
+#define EREQ_DEFER          313
+#define EREQ_STREAM         314
+#define EREQ_WINDOW         315
+#define EREQ_DEADLINE       316 // not logged, dropping must stay cheap
+
 #define EUNDEF_REQ_CODE_M   "Undefined request code"
 #define EREQ_LEN_M          "ERROR wrong request length"
+#define EREQ_AUTH_STATE_M   "ERROR request not allowed in the client's authentication state"
+#define EREQ_REGISTER_M     "ERROR invalid or duplicate request handler registration"
+#define EREQ_NSEG_M         "ERROR wrong number of segments in request"
+#define EREQ_BATCH_M        "ERROR malformed request envelope"
+#define EREQ_XFER_M         "ERROR chunked transfer protocol violation"
+#define ECOMP_DATA_M        "ERROR malformed compressed payload"
+#define ECOMP_DICT_M        "ERROR reading compression dictionary"
+#define EREQ_HELLO_M        "ERROR malformed hello (version or size limits)"
+#define EREQ_CAPS_M         "ERROR request needs a capability the client did not negotiate"
+#define ERESP_POOL_M        "ERROR every response buffer of the worker is in use"
+#define EREQ_FLAGS_M        "ERROR unknown flag in the request header"
+#define EREQ_INFLIGHT_M     "ERROR too many requests in flight on the connection"
+#define EREQ_DEFER_M        "ERROR only requests carrying an id can complete later"
+#define EREQ_STREAM_M       "ERROR invalid or closed stream, or too many streams open"
+#define EREQ_WINDOW_M       "ERROR request exceeds the window of its stream"
+#define EREQ_DEADLINE_M     "WARNING request dropped past its deadline"
 
 //=========================================================================
 // network errors 400->500
@@ -146,6 +187,13 @@ typedef unsigned int errcode_t;
 #define E_SEND_PING         412
 #define E_MULTIPLE_VALS     413
 #define E_INVALID_PING      414
+#define E_HB_DEAD           415
+#define E_SESS_KEY          416
+#define E_CRYPTO_POOL       417
+#define E_TICKET            418
+#define E_REKEY             419
+#define E_KEYPAIR_GONE      420
+#define E_KEYPAIR_ROTATE    421
 
 
 
@@ -177,10 +225,18 @@ protocol and has not been connected"
 #define ENOTSOCK_M2         "ERROR in send() fd is not a socket"
 #define EINVAL_M2           "ERROR in send() invalid argument"
 #define E_ALTER_CO_FLAG_M   "ERROR when altering client authentication status in database"
+#define E_KEY_EXCHANGE_M    "ERROR ephemeral key exchange failed (invalid client key)"
 #define E_PHASE2_AUTH_M     "ERROR could be CRITICAL in net_recv_key()"
 #define E_SEND_PING_M       "ERROR pinging client"
 #define E_MULTIPLE_VALS_M   "ERROR Query function returned multiple rows when it should be only one"
 #define E_INVALID_PING_M    "ERROR ping that was received is different that the one expected"
+#define E_HB_DEAD_M         "WARNING client missed its heartbeats, disconnected"
+#define E_SESS_KEY_M        "ERROR no session key in memory for the client"
+#define E_CRYPTO_POOL_M     "ERROR could not start the crypto offload threads"
+#define E_TICKET_M          "WARNING resumption ticket refused (unknown key, forged, expired or replayed)"
+#define E_REKEY_M           "WARNING key update refused (wrong epoch or switch point)"
+#define E_KEYPAIR_GONE_M    "WARNING handshake refused, the keypair generation the client was sent is retired"
+#define E_KEYPAIR_ROTATE_M  "ERROR could not start the keypair rotation thread"
 
 
 
@@ -0,0 +1,79 @@
+
+
+#ifndef FRAME_H
+#define FRAME_H       1
+#include "base.h"
+/*==========================================================================================
+|Parsing of the frames received from the clients                                            |
+|                                                                                           |
+| GENERAL FORMAT:                                                                           |
+|             [req code 4 bytes][seglen1 4 bytes][seg1][seglen2 4 bytes][seg2]...           |
+|                                                                                           |
+|The high byte of the req code holds flags, every flag set adds a 4 bytes header field      |
+|right after the req code (in the order of the flags below):                                |
+|             [req code | REQ_FLAG_ID][request id 4 bytes][seglen1][seg1]...                 |
+|             [req code | REQ_FLAG_ID | REQ_FLAG_STREAM][request id][stream id 4][seglen1]... |
+|             [req code | REQ_FLAG_DEADLINE][budget ms 4][seglen1]...                         |
+|Clients that set no flag keep the original format.                                        |
+|                                                                                           |
+|A frame is walked once, every segment is validated against the frame bounds and exposed   |
+|as a view {ptr, len} pointing inside the receive buffer: nothing is copied.                |
+|The views are only valid as long as the receive buffer is.                                 |
+|Sealed segments are decrypted in place inside the views (req_open), the plaintext is       |
+|wiped by the handler before the receive buffer is released.                               |
+|==========================================================================================*/
+
+#define REQ_CODE_LEN        4U   // size of the req code at the head of every request
+#define REQ_SEGLEN_LEN      4U   // size of the seglen preceding every segment
+#define REQ_MAX_SEGS        16U  // maximum number of segments in one frame
+
+//---HEADER FLAGS------------|
+#define REQ_FLAGS           0xFF000000U  // bits of the req code holding flags
+#define REQ_FLAG_ID         (1U << 31)   // a request id follows: the reply carries it back
+#define REQ_FLAG_STREAM     (1U << 30)   // a stream id follows: the request belongs to a logical stream
+#define REQ_FLAG_DEADLINE   (1U << 29)   // a time budget follows: the request is dropped once it is spent
+#define REQ_FLAGS_KNOWN     (REQ_FLAG_ID | REQ_FLAG_STREAM | REQ_FLAG_DEADLINE)
+#define REQ_ID_LEN          4U
+#define REQ_STREAM_LEN      4U
+#define REQ_DEADLINE_LEN    4U
+
+/// @brief view on a segment of a frame (points inside the receive buffer)
+typedef struct ReqSeg
+{
+  uint8_t  *ptr;
+  uint32_t  len;
+}req_seg_t;
+
+/// @brief parsed frame
+typedef struct ReqFrame
+{
+  uint8_t   *raw;                 // start of the frame (req code)
+  size_t     len;                 // length of the whole frame
+  uint32_t   reqcode;             // request code (flags stripped)
+  uint32_t   flags;               // REQ_FLAG_* set in the req code
+  uint32_t   id;                  // request id (REQ_FLAG_ID)
+  uint32_t   stream;              // stream id (REQ_FLAG_STREAM), 0 if none
+  uint32_t   budget_ms;           // time budget from the reception (REQ_FLAG_DEADLINE), 0 if none
+  uint32_t   hdr_len;             // req code + header fields
+  uint32_t   nseg;                // number of segments
+  req_seg_t  seg[REQ_MAX_SEGS];   // segment views
+}req_frame_t;
+
+
+/**
+ * @brief Parses a frame into segment views.
+ *
+ * This function walks the frame once, checking that every seglen fits in the frame, that no bytes
+ * are left after the last segment and that the frame carries at most REQ_MAX_SEGS segments.
+ * It does not log: malformed frames are reported by the caller.
+ *
+ * @param req Frame received from the network.
+ * @param len_req Length of the frame.
+ * @param frame Parsed frame (views point inside req).
+ * @return __SUCCESS__ if the frame is well formed, EREQ_LEN if a length is out of bounds,
+ *         EREQ_NSEG if the frame carries more than REQ_MAX_SEGS segments, EREQ_FLAGS if an unknown flag is set.
+ */
+errcode_t req_parse(void *req, size_t len_req, req_frame_t *frame);
+
+
+#endif
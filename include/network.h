@@ -64,6 +64,22 @@ extern int32_t __KEEPCNTR;  // 5 repetitions
 
 #define CONN_POLL_TIMEOUT -1  // poll untill new connection received
 #define COMM_POLL_TIMEOUT 100  // 100 milliseconds
+#define CRYPTO_POLL_TIMEOUT 1  // while handshakes of the worker are in the crypto pool
+
+/// @brief crypto offload counters, every worker only writes its own row
+typedef struct NetCryptoStats
+{
+  uint64_t submitted;       // key frames handed to the crypto threads
+  uint64_t inlined;         // key frames opened by the worker itself (queue full or no crypto thread)
+  uint64_t completed;       // results applied by the worker
+  uint64_t dropped;         // results of clients gone meanwhile
+  uint64_t failed;          // boxes that did not open
+  uint64_t depth;           // key frames queued right now (snapshot only)
+  uint64_t depth_max;       // deepest queue seen by a submission
+  uint64_t ns_wait;         // time spent in the queue
+  uint64_t ns_run;          // time spent opening the boxes
+  uint64_t lat_hist[REQ_LAT_BUCKETS]; // submission -> result applied, log2 microseconds
+}net_crypto_stats_t;
 
 /**
  * @brief Initializes pollfd structures for incoming data.
@@ -94,6 +110,21 @@ errcode_t net_server_setup(sockaddr_t *server_addr, sockfd_t *server_fd);
 errcode_t net_connection_handler(thread_arg_t *thread_arg);
 
 
+/**
+ * @brief Allocates the crypto offload queues and starts the crypto threads (called once at startup).
+ *
+ * @return __SUCCESS__, or an error code if the queues cannot be allocated or a thread cannot start.
+ */
+errcode_t net_crypto_init(void);
+
+/**
+ * @brief Sums the crypto offload counters of all the workers (approximate snapshot).
+ *
+ * @param stats Output counters.
+ */
+void net_crypto_stats_get(net_crypto_stats_t *stats);
+
+
 /**
  * @brief Handler for incoming client data (called by the additionally created threads).
  * 
@@ -105,6 +136,30 @@ errcode_t net_connection_handler(thread_arg_t *thread_arg);
  */
 void *net_communication_handler(void *args);
 
+/**
+ * @brief Reads the fair scheduler counters of a client.
+ * 
+ * @param thread_arg Pointer to a thread_arg_t structure containing thread-specific information.
+ * @param thread_index Index of the thread in the thread pool.
+ * @param client_index Index of the client file descriptor.
+ * @param stats Output counters (approximate snapshot, the owning thread writes them without locks).
+ */
+void net_sched_stats_get(const thread_arg_t *thread_arg, size_t thread_index, size_t client_index, sched_stats_t *stats);
+
+/**
+ * @brief Moves a client to another weight class of the fair scheduler (class 0 on connection).
+ * 
+ * Meant for the request handlers once they know who the client is: it must run on the worker
+ * thread of the client, the weight applies from its next round.
+ * 
+ * @param thread_arg Pointer to a thread_arg_t structure containing thread-specific information.
+ * @param thread_index Index of the thread in the thread pool.
+ * @param client_index Index of the client file descriptor.
+ * @param sched_class Class of the client, index in SCHED_WEIGHTS.
+ * @return __SUCCESS__, or __FAILURE__ if the class does not exist.
+ */
+errcode_t net_sched_class_set(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint8_t sched_class);
+
 
 
 #endif
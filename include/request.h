@@ -3,10 +3,10 @@
 
 #ifndef REQUEST_H
 #define REQUEST_H     1
-#include "database.h"
+#include "response.h"
 /*==========================================================================================
 |Requests are gona be sent from the client to the server                                    |
-|we will define elssewhere messages that are going to be sent from the server to the client |
+|messages sent from the server to the client are built with the response module (response.h)|
 |.                                                                                          |  
 |In this header we will discuss:                                                            |
 |                 - the formatting of the incoming requests                                 |
@@ -15,9 +15,124 @@
 |                                                                                           |
 | GENERAL FORMAT:                                                                           |
 |             [req code 4 bytes][seglen1 4 bytes][seg1][seglen2 4 bytes][seg2]...         |
-|  |
-|  |
-|  |
+|                                                                                           |
+| ENVELOPE (REQ_BATCH):                                                                     |
+|             [REQ_BATCH][seglen][secretbox(inner frame)]                                   |
+|   the inner frame is [REQ_BATCH][sublen1][subreq1][sublen2][subreq2]... where every       |
+|   subreq is a complete request in the general format. The envelope is the only seal: a   |
+|   segment a subreq would send sealed comes as [16 unused bytes][plaintext] instead.       |
+|   The replies produced by the sub-requests, REQ_ERROR of the refused ones included, are   |
+|   gathered into a response envelope with the same layout.                                 |
+|                                                                                           |
+| CHUNKED TRANSFER (payloads larger than a receive buffer):                                 |
+|             [REQ_XFER_OPEN][4][type][8][total size]                                       |
+|             [REQ_XFER_CHUNK][4][seq][seglen][secretbox(chunk)]   seq = 0, 1, 2...        |
+|             [REQ_XFER_END]                                                                |
+|   the server acks with a REQ_XFER_CHUNK reply carrying the seq of every XFER_WINDOW-th    |
+|   chunk, a client never has more than XFER_WINDOW unacknowledged chunks in flight.        |
+|   chunks are handed to the consumer registered for the type as soon as they are          |
+|   decrypted so the memory used does not depend on the size of the payload.              |
+|                                                                                           |
+| REQUEST IDS (PROTO_CAP_REQID):                                                            |
+|   a request sent with REQ_FLAG_ID (frame.h) gets its replies tagged with the same id and  |
+|   may complete out of order: a handler that waits on something slow calls req_defer()    |
+|   and answers later with req_complete(), the requests behind it are not blocked.          |
+|   at most REQ_INFLIGHT_MAX such requests run at once per connection.                      |
+|                                                                                           |
+| STREAMS (PROTO_CAP_STREAMS):                                                              |
+|   a request sent with REQ_FLAG_STREAM belongs to a logical stream of the connection,      |
+|   opened by its first request and closed by [REQ_STREAM_CLOSE | REQ_FLAG_STREAM][stream].|
+|   replies carry the stream id. A stream may have STREAM_WINDOW request bytes not         |
+|   completed yet, the server gives the bytes back once completed with                      |
+|             [REQ_STREAM_WINDOW | REQ_FLAG_STREAM][stream][seglen][secretbox(increment 4)] |
+|   a stream waiting on slow requests does not hold back the other streams.                |
+|                                                                                           |
+| CREDITS (PROTO_CAP_CREDIT):                                                               |
+|   a connection may have CONN_WINDOW request bytes sent but not completed yet, whatever    |
+|   their stream. The hello answer of a client asking for the capability carries           |
+|   [conn window][stream window] after the codec and dict, credit is given back with        |
+|             [REQ_STREAM_WINDOW][seglen][secretbox(increment 4)]     (no stream flag)     |
+|   once half a window is completed. Requests over a window are refused.                   |
+|                                                                                           |
+| DEADLINES (PROTO_CAP_DEADLINE):                                                           |
+|   a request sent with REQ_FLAG_DEADLINE (frame.h) carries a time budget in milliseconds  |
+|   from its reception, sub-requests of an envelope inherit the deadline of the envelope.   |
+|   past its deadline a request is dropped without an answer before its handler runs, and  |
+|   its reply before the session key is fetched and the payload encrypted. Deferred work    |
+|   checks req_pending_dropped() before it runs: the deadline, and the disconnection of the |
+|   client (cancellation). Dropped work is counted per opcode (expired, cancelled).         |
+|                                                                                           |
+| HEARTBEAT (PROTO_CAP_HEARTBEAT):                                                          |
+|             [REQ_HEARTBEAT]                  answered [REQ_HEARTBEAT][0]  never encrypted  |
+|   an idle client sends one every HB_INTERVAL_MS, any frame counts as a sign of life.      |
+|   the worker checks all its clients at once every HB_TICK_MS against the in memory time  |
+|   of their last frame, a client silent for HB_TIMEOUT_MS is disconnected.                |
+|                                                                                           |
+| BENCHMARK (registered only with BENCH_OPCODES, no application logic in the way):         |
+|             [REQ_BENCH_ECHO][seglen][secretbox(payload)]   answered with the payload       |
+|             [REQ_BENCH_SINK][seglen][secretbox(payload)]   decrypted and dropped          |
+|             [REQ_BENCH_SOURCE][4][n]                       answered with n random bytes   |
+|   the source sends as many sealed REQ_BENCH_SOURCE messages of the max frame as needed,   |
+|   as much as the credit of the client allows every scheduling round, never waiting on a   |
+|   full socket buffer. They carry the id and stream of the request, one source at a time. |
+|                                                                                           |
+| COUNTER NONCES (PROTO_CAP_SEQNONCE):                                                      |
+|   no nonce is ever sent: every sealed message gets its own nonce derived from the one     |
+|   exchanged with the key, both ends count the messages (security.h, SECU_DIR_*).         |
+|   client to server: seq = number of the frame since the key frame (every frame counts,   |
+|   refused ones included), sub = 0 (sub-requests of an envelope are not sealed alone).     |
+|   server to client: seq = number of the sealed message since the key frame, the ping      |
+|   first (REQ_RETRY, REQ_ERROR and REQ_HEARTBEAT are never sealed and do not count).        |
+|   without the capability every message reuses the nonce exchanged with the key.          |
+|                                                                                           |
+| CIPHER SUITES (PROTO_CAP_XCHACHA, PROTO_CAP_AESGCM, counter nonces only):                 |
+|   the client sets the suites it runs (AESGCM only if crypto_aead_aes256gcm_is_available), |
+|   the server answers at most one of them: AES-256-GCM if it has AES-NI too,              |
+|   XChaCha20-Poly1305-IETF otherwise. Without either the data channel stays a secretbox.  |
+|   Every suite keeps the [MAC 16 bytes][cipher] layout of a sealed segment.                |
+|                                                                                           |
+| HELLO (optional segment of REQ_SEND_ASYMKEY, answered right after the public key):      |
+|             [REQ_SEND_ASYMKEY][20][version][caps][max frame][codec][dict]   4 bytes each  |
+|   the server answers [version][caps][max frame][codec][dict]: the highest version and    |
+|   the capabilities both ends support, the largest frame the server accepts and the       |
+|   codec picked (PROTO_CAP_COMP only). The server never sends the client a frame larger  |
+|   than the max frame of its hello. Clients sending no hello speak version 0: no          |
+|   capability, every message in the original format.                                      |
+|                                                                                           |
+| ONE ROUND TRIP HANDSHAKE (replaces REQ_SEND_ASYMKEY -> REQ_RECV_PING):                   |
+|             [REQ_KX][32][client ephemeral kx pk][20][hello]                                |
+|   answered [server ephemeral kx pk 32][hello answer][MAC][sealed PING_HELLO]: the client  |
+|   is authenticated as soon as the answer is sent, its requests may follow right away.    |
+|   session keys come from crypto_kx (one per direction), nonces always from the counters |
+|   (PROTO_CAP_SEQNONCE is implied), the sealed ping is message 0 of the server and proves |
+|   it derived the same keys. The four step handshake stays available.                     |
+|                                                                                           |
+| KEY UPDATES (PROTO_CAP_REKEY, counter nonces only):                                       |
+|             [REQ_MODIF_SYMKEY][seglen][secretbox(epoch 4, from 8, flags 4)]                |
+|   either end moves the key of what it sends to crypto_kdf(key, epoch, direction),        |
+|   no asymmetric crypto and no reconnect. The message is sealed with the old key, the      |
+|   counters go on. from = first message sealed with the new key: the server switches      |
+|   right after its message, a client may keep its old key for up to REKEY_OVERLAP more    |
+|   frames while the ones it already sealed drain. REKEY_FLAG_REQUEST asks the other end  |
+|   to update its own key too. The server does so after REKEY_BYTES on the connection or  |
+|   REKEY_INTERVAL_S.                                                                       |
+|                                                                                           |
+| RESUMPTION TICKETS (reconnect without the handshake, counter nonces only):               |
+|             [REQ_TICKET]                     answered sealed [lifetime s 4][ticket][secret]|
+|   an authenticated client asks for a ticket: the caps, suite, codec and max frame of its  |
+|   connection and a fresh 32 bytes secret, sealed under a ticket key only the server has.  |
+|             [REQ_RESUME][ticket len][ticket][32][client random]                           |
+|   answered [server random 32][MAC][sealed PING_HELLO]: both keys come from the secret     |
+|   and the two randoms (security.h), no asymmetric crypto and no database read. A ticket  |
+|   is accepted once, until its lifetime ends, or until its key is rotated out            |
+|   (TICKET_ROTATE_S, the previous key still opens). A refused client does a handshake.   |
+|                                                                                           |
+| RETRY LATER (sent instead of running a request while the worker is overloaded):          |
+|             [REQ_RETRY][8][opcode 4][retry after ms 4]        never encrypted            |
+| ERROR (sent when the dispatcher refuses a request, only to clients that sent a hello):   |
+|             [REQ_ERROR][8][opcode 4][error code 4]             never encrypted            |
+|   both carry back the id and the stream of a request that has them:                      |
+|             [REQ_ERROR | flags][id][stream][8][opcode 4][error code 4]                    |
 |==========================================================================================*/
 
 #define PING_HELLO          (const char*)"Hello"
@@ -32,7 +147,297 @@
 #define REQ_RECV_K          1  // client sends encrypted symmetric key & salt
 #define REQ_SEND_PING       2
 #define REQ_RECV_PING       3
-#define REQ_MODIF_SYMKEY    4  // client requests to repete key exchange
+#define REQ_MODIF_SYMKEY    4  // key update of one direction, either end sends it (PROTO_CAP_REKEY)
+#define REQ_KX              5  // one round trip handshake: ephemeral key exchange + hello
+#define REQ_RESUME          6  // reconnect with a resumption ticket
+
+//---FRAMEWORK REQUEST NUMBERS|
+#define REQ_BATCH           16 // envelope carrying up to REQ_MAX_SEGS encrypted sub-requests
+#define REQ_XFER_OPEN       17 // start of a chunked transfer
+#define REQ_XFER_CHUNK      18 // encrypted chunk of a chunked transfer
+#define REQ_XFER_END        19 // end of a chunked transfer
+#define REQ_RETRY           20 // reply only: the request was shed, send it again later
+#define REQ_ERROR           21 // reply only: the request was refused (length, segments, state, capabilities)
+#define REQ_STREAM_CLOSE    22 // closes the stream of the header
+#define REQ_STREAM_WINDOW   23 // reply only: window given back to a stream (to the connection without REQ_FLAG_STREAM)
+#define REQ_HEARTBEAT       24 // sign of life of an idle client
+#define REQ_TICKET          25 // issues a resumption ticket for the next connection
+
+//---BENCHMARK REQUEST NUMBERS| (32 -> 39 reserved, registered only with BENCH_OPCODES)
+#define REQ_BENCH_ECHO      32 // encrypted echo: per message overhead of the authenticated data path
+#define REQ_BENCH_SINK      33 // decrypts and discards: crypto throughput
+#define REQ_BENCH_SOURCE    34 // streams n encrypted bytes: network throughput
+#define REQ_BENCH_SOURCE_MAX (16U << 20)  // largest n of a REQ_BENCH_SOURCE
+
+//---PROTOCOL VERSION--------|
+#define PROTO_VERSION       1U
+#define PROTO_HELLO_LEN     20U
+#define PROTO_ANSWER_MAX    (PROTO_HELLO_LEN + 8U)  // hello answer with the windows (PROTO_CAP_CREDIT)
+#define PROTO_CAP_BATCH     (1U << 0)  // request envelopes (REQ_BATCH)
+#define PROTO_CAP_XFER      (1U << 1)  // chunked transfers (REQ_XFER_*)
+#define PROTO_CAP_COMP      (1U << 2)  // payload compression (codec and dict of the hello)
+#define PROTO_CAP_REQID     (1U << 3)  // request ids (REQ_FLAG_ID) and out of order replies
+#define PROTO_CAP_STREAMS   (1U << 4)  // logical streams (REQ_FLAG_STREAM, REQ_STREAM_*)
+#define PROTO_CAP_CREDIT    (1U << 5)  // connection credits announced and given back to the client
+#define PROTO_CAP_DEADLINE  (1U << 6)  // request deadlines (REQ_FLAG_DEADLINE)
+#define PROTO_CAP_HEARTBEAT (1U << 7)  // heartbeats (REQ_HEARTBEAT), silent clients are disconnected
+#define PROTO_CAP_SEQNONCE  (1U << 8)  // counter nonces per direction, no nonce is ever reused
+#define PROTO_CAP_XCHACHA   (1U << 9)  // XChaCha20-Poly1305-IETF data channel (with PROTO_CAP_SEQNONCE)
+#define PROTO_CAP_AESGCM    (1U << 10) // AES-256-GCM data channel (with PROTO_CAP_SEQNONCE, AES-NI on both ends)
+#define PROTO_CAP_REKEY     (1U << 11) // in band key updates (REQ_MODIF_SYMKEY, with PROTO_CAP_SEQNONCE)
+#define PROTO_CAPS          (PROTO_CAP_BATCH | PROTO_CAP_XFER | PROTO_CAP_COMP | PROTO_CAP_REQID | PROTO_CAP_STREAMS | \
+                             PROTO_CAP_CREDIT | PROTO_CAP_DEADLINE | PROTO_CAP_HEARTBEAT | PROTO_CAP_SEQNONCE | \
+                             PROTO_CAP_XCHACHA | PROTO_CAP_AESGCM | PROTO_CAP_REKEY)  // supported by the server
+#define PROTO_FRAME_MIN     128U       // smallest max frame a client may announce
+
+//---KEY UPDATES-------| (PROTO_CAP_REKEY)
+#define REKEY_MSG_LEN       16U        // [epoch 4][first message under the new key 8][flags 4]
+#define REKEY_FLAG_REQUEST  (1U << 0)  // the other end is asked to update its own key as well
+
+#define REQ_SEALED_OVERHEAD (REQ_CODE_LEN + REQ_SEGLEN_LEN + crypto_secretbox_MACBYTES + COMP_HDR_LEN)
+#define REQ_BATCH_OUT_MAX   RESP_PLAIN_MAX  // size of the plaintext response envelope gathered per thread
+#define REQ_REPLY_MAX       1024U  // maximum payload of a single reply
+
+#define REQ_XFER_TYPES      16U    // number of transfer types consumers can register
+#define REQ_XFER_CHUNK_MAX  (RECV_VAL1 - REQ_CODE_LEN - 2 * REQ_SEGLEN_LEN - 4U - crypto_secretbox_MACBYTES)
+#define REQ_PLAIN_MAX       4096U  // maximum size of a decompressed envelope or chunk
+
+#define REQ_COMPLETE_QUEUE  64U    // completions other threads can post to a worker before it drains them
+#define REQ_CANCEL_SLOTS    1024U  // connections of a worker remembered as gone for the deferred work
+
+
+//===========================|
+//-----DISPATCH TABLE--------|
+//===========================|
+
+#define REQ_TABLE_SIZE      64U  // opcodes are dense: every opcode must be < REQ_TABLE_SIZE
+#define REQ_LAT_BUCKETS     16U  // log2 latency buckets in microseconds: [0] < 1us ... [15] >= 16ms
+
+//---SHEDDING CLASSES--------| (also the overload levels: level L sheds every class <= L)
+#define REQ_SHED_NEVER      0  // always served (requests continuing work already accepted)
+#define REQ_SHED_HANDSHAKE  1  // new handshakes, shed first
+#define REQ_SHED_LOW        2  // low priority requests
+
+
+/// @brief prototype shared by every request handler, the frame is already parsed and validated
+typedef errcode_t (*req_handler_t)(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
+
+/// @brief registration entry of a request, length and authentication checks are
+/// done once by the dispatcher before the handler is ever called
+typedef struct ReqEntry
+{
+  uint32_t      opcode;       // request code
+  uint32_t      min_len;      // minimum length of the whole request (req code included)
+  uint32_t      max_len;      // maximum length of the whole request (req code included)
+  uint32_t      min_segs;     // minimum number of segments
+  uint32_t      max_segs;     // maximum number of segments (<= REQ_MAX_SEGS)
+  flag_t        auth_state;   // co_auth_status the client must be in (CO_FLAG_*)
+  req_handler_t handler;      // function running the request
+  uint8_t       shed_at;      // overload level from which the request is shed (REQ_SHED_*)
+  uint32_t      caps;         // capabilities the client must have negotiated (PROTO_CAP_*)
+}req_entry_t;
+
+/// @brief statistics gathered by the dispatcher for every opcode
+typedef struct ReqStats
+{
+  uint64_t count;                     // requests dispatched to the handler
+  uint64_t errors;                    // handler returned an error
+  uint64_t rejected;                  // refused by the length or authentication checks
+  uint64_t shed;                      // answered with REQ_RETRY because the worker was overloaded
+  uint64_t expired;                   // request or reply dropped past its deadline
+  uint64_t cancelled;                 // deferred work dropped because the client left
+  uint64_t bytes;                     // request bytes handed to the handler
+  uint64_t lat_hist[REQ_LAT_BUCKETS]; // handler latency histogram
+}req_stats_t;
+
+
+/// @brief request completing later (req_defer), valid until req_complete is called with it
+typedef struct ReqPending
+{
+  uint32_t id;              // id of the request
+  uint32_t opcode;
+  uint32_t stream;          // stream of the request, 0 if none
+  uint32_t len;             // bytes the request holds in the window of its stream
+  uint32_t conn_len;        // bytes the request holds in the window of the connection (0 for a sub-request)
+  size_t   thread_index;
+  size_t   client_index;
+  sockfd_t fd;              // finds the client (disconnections move clients to other slots)
+  uint32_t gen;             // connection number, detects that the client left
+  uint64_t deadline_ns;     // CLOCK_MONOTONIC deadline of the request, 0 if none
+}req_pending_t;
+
+
+/**
+ * @brief Registers a request handler in the dispatch table.
+ * 
+ * @param entry Registration entry (copied into the table).
+ * @return __SUCCESS__ if the entry is registered, EREQ_REGISTER if the opcode is out of range,
+ *         already taken or the entry is malformed.
+ */
+errcode_t req_register(const req_entry_t *entry);
+
+/**
+ * @brief Registers every request handler of the server (called once at startup before the threads run).
+ * 
+ * @return __SUCCESS__ if all the handlers are registered, or an error code otherwise.
+ */
+errcode_t req_init(void);
+
+/**
+ * @brief Sums the statistics of an opcode across all the threads.
+ * 
+ * The counters are written without locks by their owning thread so the snapshot is approximate.
+ * 
+ * @param opcode Request code.
+ * @param stats Output statistics.
+ * @return __SUCCESS__, or EUNDEF_REQ_CODE if the opcode is out of range.
+ */
+errcode_t req_stats_get(uint32_t opcode, req_stats_t *stats);
+
+/**
+ * @brief Marks the running request as completing later, out of order.
+ *
+ * Called by a handler that cannot answer right away: the request stays in flight and the
+ * next requests of the connection run without waiting for it.
+ *
+ * @param frame Request being run.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param pending Filled with what req_complete needs.
+ * @return __SUCCESS__, or EREQ_DEFER if the request carries no id.
+ */
+errcode_t req_defer(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index, req_pending_t *pending);
+
+/**
+ * @brief Sends the reply of a deferred request tagged with its id (worker thread of the client only).
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param pending Request completed.
+ * @param code Code of the reply, 0 to complete the request without a reply.
+ * @param data Payload of the reply.
+ * @param len Length of the payload.
+ * @return __SUCCESS__ if the reply is sent or the client left, or an error code otherwise.
+ */
+errcode_t req_complete(thread_arg_t *thread_arg, const req_pending_t *pending, uint32_t code, const void *data, uint32_t len);
+
+/**
+ * @brief Hands the reply of a deferred request to its worker thread (callable from any thread).
+ *
+ * @param pending Request completed.
+ * @param code Code of the reply.
+ * @param data Payload of the reply.
+ * @param len Length of the payload (<= REQ_REPLY_MAX).
+ * @return __SUCCESS__, or EREQ_INFLIGHT if the completion queue of the worker is full.
+ */
+errcode_t req_complete_post(const req_pending_t *pending, uint32_t code, const void *data, uint32_t len);
+
+/**
+ * @brief Sends the replies posted to the worker by other threads (called by the worker loop).
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ */
+void req_complete_drain(thread_arg_t *thread_arg, size_t thread_index);
+
+/**
+ * @brief Tells deferred work whether it is still worth running (callable from any thread).
+ *
+ * Work found dropped is completed without a reply: req_complete_post(pending, 0, NULL, 0).
+ *
+ * @param pending Deferred request.
+ * @return 1 if the request is past its deadline or its client left, 0 otherwise.
+ */
+flag_t req_pending_dropped(const req_pending_t *pending);
+
+/**
+ * @brief Cancels the deferred work of a client (called on disconnection, worker thread of the client).
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ */
+void req_cancel(thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
+
+/**
+ * @brief Sets the overload level of a thread (called by the network module once per interval).
+ * 
+ * @param thread_index Index of the thread.
+ * @param level REQ_SHED_NEVER when the thread keeps up, otherwise the highest class to shed.
+ */
+void req_overload_set(size_t thread_index, uint8_t level);
+
+/**
+ * @brief Sends a reply to an authenticated client.
+ * 
+ * While a request envelope is being processed the reply [code][len][data] is appended to the
+ * response envelope of the thread (flushed when full and once all the sub-requests ran),
+ * otherwise it is encrypted with the session key and sent as [code][len][secretbox(data)].
+ * 
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param code Code of the reply.
+ * @param data Payload of the reply.
+ * @param len Length of the payload (<= REQ_REPLY_MAX and within the max frame the client announced).
+ * @return __SUCCESS__ if the reply is queued or sent, or an error code otherwise.
+ */
+errcode_t req_reply(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint32_t code, const void *data, uint32_t len);
+
+/**
+ * @brief Decrypts in place a sealed segment of the request being run with the session key of the client.
+ *
+ * The plaintext overwrites the cipher inside the receive buffer, right after the MAC
+ * (seg + crypto_secretbox_MACBYTES, len - crypto_secretbox_MACBYTES bytes): the handler wipes it once done.
+ * The nonce is the one of the frame when the client negotiated PROTO_CAP_SEQNONCE. The segments of a
+ * sub-request are not sealed on their own, the envelope is: they come as [unused MAC slot][plaintext].
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param seg Sealed segment [MAC][cipher].
+ * @param len Length of the segment (>= crypto_secretbox_MACBYTES).
+ * @return __SUCCESS__, EREQ_FAIL if the client has no session key, or E_SYMM_DECRYPT.
+ */
+errcode_t req_open(size_t thread_index, size_t client_index, uint8_t *seg, size_t len);
+
+
+/// @brief consumer of a chunked transfer type, chunks are pushed to it as they arrive
+typedef struct ReqXferOps
+{
+  /// @brief a transfer starts, *priv can be set to the consumer's own state
+  errcode_t (*on_open)(void **priv, uint64_t size, thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
+  /// @brief a decrypted chunk (only valid during the call)
+  errcode_t (*on_chunk)(void *priv, const uint8_t *data, uint32_t len);
+  /// @brief the transfer is over, complete is 0 if it was aborted (error or disconnection)
+  void      (*on_end)(void *priv, flag_t complete);
+}req_xfer_ops_t;
+
+/**
+ * @brief Registers the consumer of a chunked transfer type (called at startup before the threads run).
+ * 
+ * @param type Transfer type sent by the client in REQ_XFER_OPEN.
+ * @param ops Consumer callbacks (must stay valid while the server runs).
+ * @return __SUCCESS__, or EREQ_REGISTER if the type is out of range or already taken.
+ */
+errcode_t req_xfer_register(uint32_t type, const req_xfer_ops_t *ops);
+
+/**
+ * @brief Aborts the chunked transfer of a client if one is in progress (called on disconnection).
+ * 
+ * @param ctx State of the client.
+ */
+void req_xfer_abort(cli_ctx_t *ctx);
+
+/**
+ * @brief Sends what the requests of a client still owe it, out of its credit of the round (called by the scheduler).
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param budget Bytes the client may still use in the round.
+ * @return Bytes sent.
+ */
+size_t req_out_pump(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, int32_t budget);
 
 
 /**
@@ -62,17 +467,23 @@ errcode_t req_handle(void *req, ssize_t len_req, thread_arg_t *thread_arg, size_
 errcode_t req_pri_handle(void *req, ssize_t len_req, thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
 
 
+
 /**
- * @brief Sends the public key to the client.
+ * @brief Sends the public key to the client. (First step of authentication)
  * 
- * This function retrieves the public key from the database and sends it to the client identified by the thread and client indices.
+ * This function sends the public key of the newest generation held in guarded memory (secu_keypair_pk) to the client identified
+ * by the thread and client indices, followed by the hello answer if any, and updates the client co_auth_status from the database.
+ * The generation is remembered: the key frame of the client is opened with it even if the keypair rotates meanwhile.
+ * No key is read from the database.
  * 
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
  * @param client_index Index of the client.
- * @return __SUCCESS__ if the public key is sent successfully, or an error code if sending fails or retrieving the public key from the database fails.
+ * @param ext Hello answer appended to the key (NULL if none).
+ * @param ext_len Length of the hello answer.
+ * @return __SUCCESS__ if the public key is sent successfully, or an error code if sending it or recording the new status fails.
  */
-errcode_t net_send_pk(thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
+errcode_t net_send_pk(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const void *ext, size_t ext_len);
 
 
 /**
@@ -80,17 +491,20 @@ errcode_t net_send_pk(thread_arg_t *thread_arg, size_t thread_index, size_t clie
  * 
  * This function:
  *  1. Retrieves the symmetric key from the client socket.
- *  2. Decrypts it with the (pk, sk) key pair retrieved from the database.
+ *  2. Decrypts it with the generation of the (pk, sk) key pair the client was sent (secu_keypair_open), on a crypto thread
+ *     (net_crypto_submit) or right here if the pool is full or disabled.
  *  3. Updates the connection authentication status flag in the database.
- *  4. Updates the key in the database.
+ *  4. Stores the key in the session key store of the worker (and in the database if SESS_KEY_AUDIT is set).
  * 
- * @param req Binary stream of data coming from the network.
+ * Steps 3 and 4 run on the worker (net_key_apply), when the result of a crypto thread is drained.
+ * 
+ * @param frame Parsed request: seg[0] encrypted key, seg[1] encrypted nonce.
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
  * @param client_index Index of the client.
  * @return Error code indicating success or failure.
  */
-errcode_t net_recv_key(void *req, thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
+errcode_t net_recv_key(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
 
 
 
@@ -98,8 +512,8 @@ errcode_t net_recv_key(void *req, thread_arg_t *thread_arg, size_t thread_index,
  * @brief Sends an encrypted ping message to the client.
  * 
  * This function:
- *  1. Retrieves the connection object including the symmetric key from the database.
- *  2. Encrypts the ping message using the retrieved symmetric key.
+ *  1. Looks up the symmetric key in the session key store.
+ *  2. Encrypts the ping message using the symmetric key.
  *  3. Sends the encrypted ping message to the client.
  *  4. Updates the connection status in the database to indicate that the ping was sent.
  * 
@@ -110,23 +524,61 @@ errcode_t net_recv_key(void *req, thread_arg_t *thread_arg, size_t thread_index,
  */
 errcode_t net_send_auth_ping(thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
 
+/**
+ * @brief One round trip handshake (REQ_KX): derives the session keys from the ephemeral key of the client
+ * and answers with the ephemeral key of the server, the hello answer and the first sealed message.
+ *
+ * @param frame Parsed request: seg[0] ephemeral public key of the client.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param answer Hello answer sent after the key.
+ * @param answer_len Length of the hello answer.
+ * @return Error code indicating success or failure.
+ */
+errcode_t net_kx(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index,
+  const void *answer, size_t answer_len);
+
+/**
+ * @brief Resumes a session from a ticket (REQ_RESUME): restores what the connection of the ticket
+ * agreed, derives fresh keys and answers with the random of the server and the first sealed message.
+ *
+ * @param frame Parsed request: seg[0] ticket, seg[1] random of the client.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return Error code indicating success or failure.
+ */
+errcode_t net_resume(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
+
+/**
+ * @brief Updates the key of the messages sent to the client (REQ_MODIF_SYMKEY), the announce is the
+ * last message sealed with the old key.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param flags REKEY_FLAG_REQUEST to have the client update its key too.
+ * @return Error code indicating success or failure.
+ */
+errcode_t net_rekey(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint32_t flags);
+
 
 /**
  * @brief Receives and processes an encrypted ping message.
  * 
  * This function:
  *  1. Receives a ping message from the network.
- *  2. Decrypts the message using the key retrieved from the connection table in the database.
+ *  2. Decrypts the message using the key of the session key store.
  *  3. Updates the connection authentication status flag in the database.
- *  4. Frees the data.
  * 
- * @param req Binary stream of data coming from the network.
+ * @param frame Parsed request: seg[0] encrypted ping (seglen covers the MAC).
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
  * @param client_index Index of the client.
  * @return Error code indicating success or failure.
  */
-errcode_t net_recv_auth_ping(void *req, thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
+errcode_t net_recv_auth_ping(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index);
 
 
 
@@ -0,0 +1,176 @@
+
+
+
+#ifndef RESPONSE_H
+#define RESPONSE_H    1
+#include "database.h"
+#include "frame.h"
+#include "compress.h"
+/*==========================================================================================
+|Messages sent from the server to the client                                               |
+|                                                                                           |
+|They use the same general format as the requests:                                         |
+|             [code 4 bytes][seglen 4 bytes][seg]                                           |
+|replies to requests carrying an id carry it back: [code | REQ_FLAG_ID][id][seglen][seg]   |
+|and so do replies on a stream: [code | REQ_FLAG_STREAM][stream id][seglen][seg]            |
+|sealed messages carry one segment, the secretbox of the payload (compressed first if the  |
+|connection negotiated a codec). Inside the payload the builder appends either raw bytes   |
+|or [len 4 bytes][seg] segments.                                                           |
+|                                                                                           |
+|A message is built in a buffer of the worker's pool: the header, the MAC and the          |
+|compression header are reserved in front of the payload so that finalize encrypts in      |
+|place and sends the whole frame with one sendall(). Constant messages are serialized      |
+|once into templates and sent as they are.                                                 |
+|==========================================================================================*/
+
+#define RESP_PLAIN_MAX      4096U  // largest payload of a message
+#define RESP_HDR_LEN        (REQ_CODE_LEN + REQ_ID_LEN + REQ_STREAM_LEN + REQ_SEGLEN_LEN + crypto_secretbox_MACBYTES + COMP_HDR_LEN)
+#define RESP_BUF_SIZE       (RESP_HDR_LEN + RESP_PLAIN_MAX)
+#define RESP_POOL_SIZE      4U     // buffers per worker (a response envelope + the replies sent besides it)
+#define RESP_TMPL_MAX       32U    // largest template
+
+/// @brief message being built, the buffer belongs to the worker's pool until finalize or abort
+typedef struct Resp
+{
+  uint8_t      *buf;          // RESP_HDR_LEN reserved bytes then the payload
+  size_t        len;          // payload length
+  size_t        limit;        // largest payload the client accepts
+  uint32_t      code;
+  uint32_t      flags;        // REQ_FLAG_ID / REQ_FLAG_STREAM header fields carried
+  uint32_t      id;
+  uint32_t      stream;
+  thread_arg_t *thread_arg;
+  size_t        thread_index;
+  size_t        client_index;
+}resp_t;
+
+/// @brief pre-serialized frame sent as is
+typedef struct RespTmpl
+{
+  uint8_t  buf[RESP_TMPL_MAX];
+  uint32_t len;
+}resp_tmpl_t;
+
+
+/**
+ * @brief Allocates the buffer pools of the workers (called once at startup before the threads run).
+ *
+ * @return __SUCCESS__, or an error code if the allocation fails.
+ */
+errcode_t resp_init(void);
+
+/**
+ * @brief Starts a message, its buffer is taken from the pool of the worker.
+ *
+ * @param resp Message to start.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param code Code of the message.
+ * @return __SUCCESS__, or ERESP_POOL if every buffer of the worker is in use.
+ */
+errcode_t resp_begin(resp_t *resp, thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint32_t code);
+
+/**
+ * @brief Tags the message with the id of the request it answers.
+ *
+ * @param resp Message being built.
+ * @param id Request id.
+ */
+void resp_tag(resp_t *resp, uint32_t id);
+
+/**
+ * @brief Sends the message on a logical stream.
+ *
+ * @param resp Message being built.
+ * @param stream Stream id.
+ */
+void resp_stream(resp_t *resp, uint32_t stream);
+
+/**
+ * @brief Appends raw bytes to the payload.
+ *
+ * @param resp Message being built.
+ * @param data Bytes to append.
+ * @param len Number of bytes.
+ * @return __SUCCESS__, or EREQ_LEN if the payload would exceed what the client accepts.
+ */
+errcode_t resp_append_raw(resp_t *resp, const void *data, uint32_t len);
+
+/**
+ * @brief Appends a [len][seg] segment to the payload.
+ *
+ * @param resp Message being built.
+ * @param seg Segment to append.
+ * @param len Length of the segment.
+ * @return __SUCCESS__, or EREQ_LEN if the payload would exceed what the client accepts.
+ */
+errcode_t resp_append(resp_t *resp, const void *seg, uint32_t len);
+
+/**
+ * @brief Compresses, encrypts in place and sends the message, then gives its buffer back to the pool.
+ *
+ * @param resp Message to send.
+ * @return __SUCCESS__ if the message is sent, or an error code otherwise.
+ */
+errcode_t resp_finalize(resp_t *resp);
+
+/**
+ * @brief Gives the buffer of a message back to the pool without sending it.
+ *
+ * @param resp Message to drop.
+ */
+void resp_abort(resp_t *resp);
+
+/**
+ * @brief Serializes a constant plain message [code][len][payload] into a template.
+ *
+ * @param tmpl Template to fill.
+ * @param code Code of the message.
+ * @param payload Payload of the message.
+ * @param len Length of the payload (<= RESP_TMPL_MAX - 8).
+ * @return __SUCCESS__, or EREQ_LEN if the message does not fit in a template.
+ */
+errcode_t resp_tmpl_build(resp_tmpl_t *tmpl, uint32_t code, const void *payload, uint32_t len);
+
+/**
+ * @brief Sends a template.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param tmpl Template to send.
+ * @return __SUCCESS__ if the message is sent, or an error code otherwise.
+ */
+errcode_t resp_tmpl_send(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const resp_tmpl_t *tmpl);
+
+/**
+ * @brief Sends a template carrying the id and the stream of the request it answers, [code | flags][id][stream][len][payload].
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param tmpl Template to send.
+ * @param flags REQ_FLAG_ID / REQ_FLAG_STREAM header fields to carry (others are ignored).
+ * @param id Request id.
+ * @param stream Stream id.
+ * @return __SUCCESS__ if the message is sent, or an error code otherwise.
+ */
+errcode_t resp_tmpl_send_tagged(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const resp_tmpl_t *tmpl,
+  uint32_t flags, uint32_t id, uint32_t stream);
+
+
+/**
+ * @brief Send all data to a client.
+ *
+ * @param thread_arg Pointer to a thread_arg_t structure containing thread-specific information.
+ * @param thread_index Index of the thread in the thread pool.
+ * @param client_index Index of the client file descriptor.
+ * @param buf Pointer to the buffer containing the data to send.
+ * @param n Length of the data buffer.
+ * @return __SUCCESS__ if all data is sent successfully, otherwise E_SEND_FAILED.
+ */
+errcode_t sendall(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const void *buf, size_t n);
+
+
+#endif
@@ -18,23 +18,101 @@ ENCRYPTED_KEY_SIZE
 
 typedef struct sec_keys
 {
-  uint8_t enc_key[ENCRYPTED_KEY_SIZE]; // size of asymmetrically encrypted symmetric key 
   uint8_t dec_key[crypto_secretbox_KEYBYTES];
-  uint8_t enc_nonce[ENCRYPTED_NONCE_SIZE]; // size of asymmetrically encrypted symmetric key 
   uint8_t dec_nonce[crypto_secretbox_NONCEBYTES];
   uint8_t pk[crypto_box_PUBLICKEYBYTES];
   uint8_t sk[crypto_box_SECRETKEYBYTES];
 }sec_keys_t;
 
+//---CIPHER SUITES-----| (every suite takes a 32 bytes key and has a 16 bytes MAC: [MAC][cipher] on the wire)
+#define SECU_SUITE_SECRETBOX 0  // XSalsa20-Poly1305 (crypto_secretbox), clients without a suite
+#define SECU_SUITE_XCHACHA   1  // XChaCha20-Poly1305-IETF
+#define SECU_SUITE_AESGCM    2  // AES-256-GCM, only on hosts with AES-NI and CLMUL
+#define SECU_SUITES          3
+
+/// @brief detached in place encryption of a cipher suite, resolved once per connection
+typedef struct sec_suite
+{
+  uint32_t id;              // SECU_SUITE_*
+  errcode_t (*seal)(const uint8_t *key, const uint8_t *n, uint8_t *mac, uint8_t *c, const uint8_t *m, size_t mlen);
+  errcode_t (*open)(const uint8_t *key, const uint8_t *n, uint8_t *m, const uint8_t *mac, const uint8_t *c, size_t clen);
+}sec_suite_t;
+
+/// @brief session key of a connection, kept in the guarded store of its worker
+typedef struct sec_sess
+{
+  uint8_t key_rx[crypto_secretbox_KEYBYTES];   // opens what the client sends
+  uint8_t key_tx[crypto_secretbox_KEYBYTES];   // seals what the server sends (the same key but after REQ_KX)
+  uint8_t nonce[crypto_secretbox_NONCEBYTES];  // base nonce, every message gets its own with counters
+  uint8_t key_prev[crypto_secretbox_KEYBYTES]; // key_rx before the last update of the client, opens its frames below rx_from
+  uint64_t rx_from;         // first frame of the client sealed with key_rx (0: no update yet)
+  uint32_t epoch_rx;        // updates of each key since the handshake (PROTO_CAP_REKEY)
+  uint32_t epoch_tx;
+  flag_t  set;
+  flag_t  counters;         // counter nonces per direction (PROTO_CAP_SEQNONCE), else the base nonce as is
+  const sec_suite_t *suite; // cipher suite of the connection
+}sec_sess_t;
+
+//---COUNTER NONCES----|
+// nonce of a message = base nonce ^ [seq 8 bytes LE][sub | direction << 31, 4 bytes LE]
+// (12 bytes, the counters fit the shortest nonce of the suites)
+#define SECU_DIR_RX         0  // client to server: seq = frame number, sub = 0 (an envelope is sealed whole)
+#define SECU_DIR_TX         1  // server to client: seq = sealed message number, sub = 0
+
+//---KEY UPDATES-------| next key = crypto_kdf(current key, subkey id = new epoch, context of the direction)
+#define SECU_KDF_CTX_RX     "C2S_UPDT"  // keys of the client
+#define SECU_KDF_CTX_TX     "S2C_UPDT"  // keys of the server
+
+//---RESUMPTION TICKETS-| (sealed under a ticket key of the server, opaque to the client)
+#define SECU_TICKET_SECRET  32U  // resumption secret, sent to the client sealed with its ticket
+#define SECU_RANDOM_LEN     32U  // fresh random of each end mixed into the keys of a resumed session
+#define SECU_TICKET_ID_LEN  4U   // id of the ticket key, in clear in front of the ticket
+
+/// @brief content of a ticket, only ever read back by the server that sealed it
+typedef struct sec_ticket
+{
+  uint8_t  secret[SECU_TICKET_SECRET];
+  uint64_t expiry;          // CLOCK_MONOTONIC seconds (the ticket keys die with the process)
+  uint32_t caps;            // what the connection of the ticket agreed in its hello
+  uint32_t max_out;
+  uint8_t  proto_version;
+  uint8_t  suite;
+  uint8_t  comp_codec;
+  uint8_t  comp_dict;
+}sec_ticket_t;
+
+// [key id][nonce][MAC][cipher of sec_ticket_t]
+#define SECU_TICKET_LEN     (SECU_TICKET_ID_LEN + crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + sizeof(sec_ticket_t))
+
 
 /// @brief Initialize libsodium 
 /// @return errorcode
 errcode_t secu_init(void);
 
-/// @brief generate asymmetric keypair and write to the database
+/// @brief generate asymmetric keypair (generation 1) into guarded memory and write it to the database
 /// @param db_connect MYSQL db connection
 errcode_t secu_init_keys(MYSQL *db_connect);
 
+/// @brief copies the public key of the newest generation
+/// @param pk buffer of crypto_box_PUBLICKEYBYTES bytes
+/// @return id of the generation
+uint32_t secu_keypair_pk(uint8_t *pk);
+
+/// @brief opens a sealed box of a handshake with the generation the client was sent (the lock only covers a copy of the keys)
+/// @return __SUCCESS__, E_KEYPAIR_GONE if the generation was retired, or the error of the decryption
+errcode_t secu_keypair_open(uint32_t id, void *m, const uint8_t *c, size_t clen);
+
+/// @brief adds a generation, the oldest one in memory is dropped (rotation thread)
+/// @param db_connect MYSQL db connection of the caller
+errcode_t secu_keypair_rotate(MYSQL *db_connect);
+
+/// @brief asks the rotation thread to add a generation now (async signal safe, also SIGHUP)
+void secu_keypair_rotate_request(void);
+
+/// @brief starts the rotation thread (every KEYPAIR_ROTATE_S and on request)
+/// @param db_connect MYSQL db connection owned by the thread
+errcode_t secu_keypair_start(MYSQL *db_connect);
+
 /// @brief checks if password entered is same as in physkey (step 1 authentication)
 /// @param pass command line argument entered password
 errcode_t secu_check_init_cred(const uint8_t *pass);
@@ -42,19 +120,25 @@ errcode_t secu_check_init_cred(const uint8_t *pass);
 /**
  * @brief Write the keys to the database.
  * 
- * This function writes the public key (pk) and secret key (sk) to the database.
+ * This function writes a generation of the public key (pk) and secret key (sk) to the database.
  * 
+ * @param id Generation of the keypair.
  * @param pk Public key.
  * @param sk Secret key.
  * @param db_connect MYSQL database connection.
  * @return Error code indicating success or failure.
  */
-errcode_t secu_key_save(uint8_t *pk, uint8_t *sk, MYSQL *db_connect);
+errcode_t secu_key_save(uint32_t id, uint8_t *pk, uint8_t *sk, MYSQL *db_connect);
 
-/// @brief deletes current key pair present in the db KeyPairs table
+/// @brief deletes every key pair present in the db KeyPairs table
 /// @param db_connect MYSQL db connection
 errcode_t secu_key_del(MYSQL *db_connect);
 
+/// @brief deletes the key pairs of the generations up to id (dropped from memory)
+/// @param id newest generation retired
+/// @param db_connect MYSQL db connection
+errcode_t secu_key_retire(uint32_t id, MYSQL *db_connect);
+
 /**
  * @brief Encrypts a message 'm' of length 'mlen' using the public key 'pk' and stores the cipher in 'c'.
  * 
@@ -105,5 +189,191 @@ errcode_t secu_symmetric_encrypt(const uint8_t *key, const uint8_t *n, uint8_t *
  */
 errcode_t secu_symmetric_decrypt(const uint8_t *key, const uint8_t *n, void *m, const uint8_t *c, size_t clen);
 
+/**
+ * @brief Encrypts a message 'm' of length 'mlen' into 'c' and writes its MAC apart in 'mac'.
+ *
+ * 'c' may be 'm': the message is then encrypted in place, in the buffer it will be sent from.
+ *
+ * @param key Symmetric key specific to this connection.
+ * @param n Nonce of the message.
+ * @param mac Buffer of crypto_secretbox_MACBYTES bytes receiving the MAC.
+ * @param c Buffer to contain the cipher (mlen bytes).
+ * @param m Message to encrypt.
+ * @param mlen Length of the message to encrypt.
+ * @return Error code indicating the success or failure of the encryption process.
+ */
+errcode_t secu_symmetric_encrypt_detached(const uint8_t *key, const uint8_t *n, uint8_t *mac, uint8_t *c, const uint8_t *m, size_t mlen);
+
+/**
+ * @brief Checks the MAC 'mac' of a cipher 'c' of length 'clen' and decrypts it into 'm'.
+ *
+ * 'm' may be 'c': the cipher is then decrypted in place, in the buffer it was received in.
+ *
+ * @param key Symmetric key specific to this connection.
+ * @param n Nonce of the message.
+ * @param m Buffer to store the decrypted message (clen bytes).
+ * @param mac MAC of the cipher.
+ * @param c Cipher to decrypt.
+ * @param clen Length of the cipher to decrypt.
+ * @return Error code indicating the success or failure of the decryption process.
+ */
+errcode_t secu_symmetric_decrypt_detached(const uint8_t *key, const uint8_t *n, uint8_t *m, const uint8_t *mac, const uint8_t *c, size_t clen);
+
+/**
+ * @brief Server side of an ephemeral key exchange (REQ_KX): generates a keypair used for this exchange
+ * only and derives the session keys of both directions from it and the ephemeral key of the client.
+ *
+ * @param pk Receives the ephemeral public key of the server (crypto_kx_PUBLICKEYBYTES).
+ * @param rx Receives the key of the messages from the client (crypto_kx_SESSIONKEYBYTES).
+ * @param tx Receives the key of the messages to the client (crypto_kx_SESSIONKEYBYTES).
+ * @param client_pk Ephemeral public key of the client.
+ * @return __SUCCESS__, or E_KEY_EXCHANGE if the key of the client is not acceptable.
+ */
+errcode_t secu_kx_server(uint8_t *pk, uint8_t *rx, uint8_t *tx, const uint8_t *client_pk);
+
+//===============================================
+//          ----SESSION KEY STORE----
+//===============================================
+
+/**
+ * @brief Allocates the session key store (guarded, locked pages), called once at startup before the threads run.
+ *
+ * @return __SUCCESS__, or an error code if the allocation fails.
+ */
+errcode_t secu_sess_init(void);
+
+/**
+ * @brief Looks up a cipher suite.
+ *
+ * @param id Suite (SECU_SUITE_*).
+ * @return The suite, or NULL if it is unknown or this host cannot run it (AES-256-GCM without AES-NI).
+ */
+const sec_suite_t *secu_suite_get(uint32_t id);
+
+/**
+ * @brief Stores the session key of a client.
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param key_rx Symmetric key of the messages from the client.
+ * @param key_tx Symmetric key of the messages to the client.
+ * @param nonce Base nonce.
+ * @param counters Derive a nonce per message from the base nonce (SECU_DIR_*).
+ * @param suite Cipher suite agreed in the hello (SECU_SUITE_*).
+ */
+void secu_sess_set(size_t thread_index, size_t client_index, const uint8_t *key_rx, const uint8_t *key_tx,
+  const uint8_t *nonce, flag_t counters, uint32_t suite);
+
+/**
+ * @brief Looks up the session key of a client.
+ *
+ * The entry belongs to the worker and stays valid until the client disconnects.
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return The session key, or NULL if the client has not sent one yet.
+ */
+const sec_sess_t *secu_sess_get(size_t thread_index, size_t client_index);
+
+/**
+ * @brief Seals a message sent to the client with the nonce of its sequence number.
+ *
+ * The box has the wire layout of a sealed segment [MAC][cipher]. The message may already sit
+ * right after the MAC (m == box + crypto_secretbox_MACBYTES), it is then encrypted in place.
+ *
+ * @param sess Session key.
+ * @param seq Number of the sealed message since the session key was set.
+ * @param box Buffer of mlen + crypto_secretbox_MACBYTES bytes receiving [MAC][cipher].
+ * @param m Message to encrypt.
+ * @param mlen Length of the message to encrypt.
+ * @return Error code indicating the success or failure of the encryption process.
+ */
+errcode_t secu_sess_seal(const sec_sess_t *sess, uint64_t seq, uint8_t *box, const uint8_t *m, size_t mlen);
+
+/**
+ * @brief Opens in place a sealed segment [MAC][cipher] received from the client with the nonce of its frame.
+ *
+ * The plaintext overwrites the cipher, right after the MAC (box + crypto_secretbox_MACBYTES).
+ *
+ * @param sess Session key.
+ * @param seq Number of the frame since the session key was set.
+ * @param sub Second counter of the nonce, 0 for the frames of the request module (envelopes are sealed whole).
+ * @param box Sealed segment.
+ * @param blen Length of the segment (>= crypto_secretbox_MACBYTES).
+ * @return Error code indicating the success or failure of the decryption process.
+ */
+errcode_t secu_sess_open(const sec_sess_t *sess, uint64_t seq, uint32_t sub, uint8_t *box, size_t blen);
+
+/**
+ * @brief Moves the messages sent to the client to the next key (key update of the server).
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return The epoch of the new key.
+ */
+uint32_t secu_sess_rekey_tx(size_t thread_index, size_t client_index);
+
+/**
+ * @brief Moves the frames of the client to the next key from frame 'from' on (key update of the client),
+ * the current key keeps opening the frames before.
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param epoch Epoch announced by the client, must be the next one.
+ * @param from First frame sealed with the new key.
+ * @return __SUCCESS__, or E_REKEY if the epoch is not the next one.
+ */
+errcode_t secu_sess_rekey_rx(size_t thread_index, size_t client_index, uint32_t epoch, uint64_t from);
+
+/**
+ * @brief Moves the session key of a client to another slot (cli_dc() compaction) and wipes the old slot.
+ *
+ * @param thread_index Index of the thread.
+ * @param dst Slot receiving the key (wiped only if it is src).
+ * @param src Slot of the key.
+ */
+void secu_sess_move(size_t thread_index, size_t dst, size_t src);
+
+//===============================================
+//          ----RESUMPTION TICKETS----
+//===============================================
+
+/**
+ * @brief Allocates the ticket keys (guarded, locked pages) and draws the first one, called once at startup.
+ *
+ * @return __SUCCESS__, or an error code if the allocation fails.
+ */
+errcode_t secu_ticket_init(void);
+
+/**
+ * @brief Draws the resumption secret and the expiry of a ticket and seals it under the current ticket key.
+ *
+ * @param ticket Content of the ticket, the caller fills what the connection agreed.
+ * @param out Buffer of SECU_TICKET_LEN bytes receiving the ticket.
+ * @return __SUCCESS__, or an error code if the ticket cannot be sealed.
+ */
+errcode_t secu_ticket_issue(sec_ticket_t *ticket, uint8_t *out);
+
+/**
+ * @brief Opens a ticket presented by a client, it is accepted once only.
+ *
+ * @param in Ticket (SECU_TICKET_LEN bytes).
+ * @param ticket Receives the content of the ticket.
+ * @return __SUCCESS__, or E_TICKET if the key is gone, the ticket is forged, expired or replayed.
+ */
+errcode_t secu_ticket_redeem(const uint8_t *in, sec_ticket_t *ticket);
+
+/**
+ * @brief Derives the keys of a resumed session from the secret of its ticket and the randoms of both ends.
+ *
+ * @param secret Resumption secret of the ticket.
+ * @param client_random Random sent by the client with its ticket.
+ * @param server_random Random sent back by the server.
+ * @param rx Receives the key of the messages from the client.
+ * @param tx Receives the key of the messages to the client.
+ */
+void secu_ticket_keys(const uint8_t *secret, const uint8_t *client_random, const uint8_t *server_random,
+  uint8_t *rx, uint8_t *tx);
+
 
 #endif
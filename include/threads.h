@@ -7,6 +7,69 @@
 #error "Max number of threads reached"
 #endif
 
+//===============================================
+//              PER CONNECTION STATE
+//===============================================
+
+/// @brief fair scheduler counters of a client (queueing delay = ready in poll -> first frame served)
+typedef struct SchedStats
+{
+  uint64_t    frames;       // frames processed
+  uint64_t    bytes;        // bytes processed
+  uint64_t    rounds;       // rounds the client was served in
+  uint64_t    qdelay_ns;    // total queueing delay
+  uint64_t    qdelay_max_ns;
+}sched_stats_t;
+
+/// @brief logical stream of a connection (request module)
+typedef struct CliStream
+{
+  uint32_t id;              // 0: free slot
+  uint32_t used;            // request bytes of the stream not completed yet
+  uint32_t unacked;         // bytes completed but not given back to the client yet
+  flag_t   closing;         // closed by the client, freed once used drops to 0
+}cli_stream_t;
+
+/// @brief REQ_BENCH_SOURCE being streamed to a client, one quantum per scheduling round (request module)
+typedef struct CliSource
+{
+  uint32_t left;            // bytes still owed to the client, 0: none
+  uint32_t flags;           // REQ_FLAG_ID / REQ_FLAG_STREAM of the request, carried by every message
+  uint32_t id;
+  uint32_t stream;
+  uint64_t deadline_ns;     // deadline of the request, 0 if none
+}cli_source_t;
+
+/// @brief in-memory state of a client slot, indexed exactly like total_cli_fds
+/// so that the request module can gate requests without asking the database
+typedef struct CliCtx
+{
+  flag_t      auth_status;  // mirror of the co_auth_status column
+  void       *xfer;         // chunked transfer in progress (request module), NULL if none
+  uint8_t     comp_codec;   // compression codec negotiated (COMP_*)
+  uint8_t     comp_dict;    // compression dictionary negotiated
+  uint8_t     sched_class;  // weight class in the fair scheduler (SCHED_WEIGHTS, net_sched_class_set)
+  uint8_t     proto_version;// protocol version agreed in the hello (0: client sent none)
+  uint8_t     suite;        // cipher suite agreed in the hello (SECU_SUITE_*, 0: secretbox)
+  uint32_t    kp_id;        // generation of the server keypair sent to the client (REQ_SEND_ASYMKEY)
+  uint32_t    caps;         // capabilities agreed in the hello (PROTO_CAP_*)
+  uint32_t    max_out;      // largest plaintext payload the client accepts in one message
+  uint32_t    gen;          // connection number, tells deferred work its client is gone (never 0)
+  uint32_t    inflight;     // requests carrying an id not completed yet
+  uint32_t    win_used;     // request bytes of the connection not completed yet
+  uint32_t    win_unacked;  // bytes completed but not given back to the client yet (PROTO_CAP_CREDIT)
+  cli_stream_t streams[STREAMS_PER_CONN];
+  cli_source_t source;      // benchmark source in progress (BENCH_OPCODES)
+  int32_t     deficit;      // bytes left to the client in the current round
+  uint64_t    ready_ns;     // when the client started waiting to be served, 0 if not waiting
+  uint64_t    last_seen_ns; // when the last frame of the client was read (heartbeats included)
+  uint64_t    seq_rx;       // frames received since the session key (nonce of their sealed segments)
+  uint64_t    seq_tx;       // sealed messages sent since the session key (nonce of the next one)
+  uint64_t    rekey_bytes;  // bytes of the connection since its last key update (PROTO_CAP_REKEY)
+  uint64_t    rekey_ns;     // time of the last key update, 0 until the first check
+  sched_stats_t sched;
+}cli_ctx_t;
+
 //===============================================
 //                  MUTEX / ATOMIC
 //===============================================
@@ -19,6 +82,7 @@
     sockaddr_t  server_addr;
     sockfd_t    server_fd;
     pollfd_t    total_cli__fds[SERVER_THREAD_NO][SERVER_BACKLOG];
+    cli_ctx_t   total_cli_ctx[SERVER_THREAD_NO][SERVER_BACKLOG];
     MYSQL      *db_connect;
     uint32_t    thread_id;
   }thread_arg_t;
@@ -34,6 +98,7 @@
     sockaddr_t  server_addr;
     sockfd_t    server_fd;
     pollfd_t    total_cli_fds[SERVER_THREAD_NO][SERVER_BACKLOG];
+    cli_ctx_t   total_cli_ctx[SERVER_THREAD_NO][SERVER_BACKLOG];
     MYSQL      *db_connect;
     _Atomic uint32_t    thread_id;
   }thread_arg_t;
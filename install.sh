@@ -58,6 +58,24 @@ install_libsodium() {
     echo "Installed libsodium needed by the security module"
 }
 
+#######################################
+# Function to install liblz4
+# Globals:
+#   PACKAGE_MANAGER
+# Arguments:
+#   None
+# Returns:
+#   None
+#######################################
+install_liblz4() {
+    if [ "$PACKAGE_MANAGER" == "apt" ]; then
+        sudo apt-get install -y liblz4-dev
+    elif [ "$PACKAGE_MANAGER" == "pacman" ]; then
+        sudo pacman -S --noconfirm lz4
+    fi
+    echo "Installed liblz4 needed by the compress module"
+}
+
 #######################################
 # Function to install MySQL or MariaDB
 # Globals:
@@ -112,6 +130,7 @@ main() {
     detect_package_manager
     update_repositories
     install_libsodium
+    install_liblz4
     prompt_mysql_installation
     echo "Dependencies installed successfully."
     echo "Installation complete."
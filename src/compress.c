@@ -0,0 +1,256 @@
+#include "../include/compress.h"
+
+//==========================================================================
+//                        DICTIONARIES & THREAD STATES
+//==========================================================================
+
+/// @brief dictionaries loaded at startup (buffer NULL means missing)
+static uint8_t      *comp_dict_buf[COMP_DICTS];
+static size_t        comp_dict_len[COMP_DICTS];
+static LZ4_stream_t  comp_dict_stream[COMP_DICTS];   // dictionaries hashed once, attached per payload
+
+/// @brief per thread compression state and counters
+static LZ4_stream_t  comp_work[SERVER_THREAD_NO];
+static comp_stats_t  comp_stats[SERVER_THREAD_NO];
+
+
+/**
+ * @brief Reads a dictionary file.
+ *
+ * @param path Path of the dictionary.
+ * @param dict_id Id of the dictionary.
+ * @return __SUCCESS__ if the dictionary is loaded or absent, or an error code otherwise.
+ */
+static errcode_t comp_load_dict(const char *path, size_t dict_id)
+{
+  FILE *dict_f = fopen(path, "rb");
+  uint8_t *buf;
+  size_t len;
+
+  if (!dict_f)
+    return __SUCCESS__; // this dictionary is not deployed
+
+  if (!(buf = (uint8_t *)malloc(COMP_DICT_MAX)))
+  {
+    fclose(dict_f);
+    return LOG(NET_LOG_PATH, EMALLOC_FAIL, EMALLOC_FAIL_M7);
+  }
+
+  len = fread((void*)buf, 1, COMP_DICT_MAX, dict_f);
+  fclose(dict_f);
+  if (!len)
+  {
+    free(buf);
+    return LOG(NET_LOG_PATH, E_FREAD, ECOMP_DICT_M);
+  }
+
+  comp_dict_buf[dict_id] = buf;
+  comp_dict_len[dict_id] = len;
+  LZ4_initStream(&comp_dict_stream[dict_id], sizeof comp_dict_stream[dict_id]);
+  LZ4_loadDict(&comp_dict_stream[dict_id], (const char *)buf, (int)len);
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Loads the compression dictionaries and initializes the per thread compression states.
+ *
+ * Missing dictionary files are not an error, clients asking for them fall back to plain LZ4.
+ *
+ * @return __SUCCESS__, or an error code if a dictionary cannot be read.
+ */
+errcode_t comp_init(void)
+{
+  char path[sizeof COMP_DICT_PATH + 16];
+
+  for (size_t i = 0; i < SERVER_THREAD_NO; i++)
+    LZ4_initStream(&comp_work[i], sizeof comp_work[i]);
+
+  for (size_t i = 0; i < COMP_DICTS; i++)
+  {
+    snprintf(path, sizeof path, COMP_DICT_PATH, (unsigned)i);
+    if (comp_load_dict(path, i))
+      return ECOMP_DICT;
+  }
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Picks the codec of a connection from what the client asked for.
+ *
+ * @param codec Codec asked by the client, set to the codec chosen.
+ * @param dict Dictionary asked by the client, set to the dictionary chosen.
+ */
+void comp_negotiate(uint32_t *codec, uint32_t *dict)
+{
+  switch (*codec)
+  {
+    case COMP_LZ4_DICT:
+      if (*dict < COMP_DICTS && comp_dict_buf[*dict])
+        return;
+      // Unknown dictionary: fall back to plain LZ4
+      *codec = COMP_LZ4;
+      *dict = 0;
+      return;
+    case COMP_LZ4:
+      *dict = 0;
+      return;
+    default:
+      *codec = COMP_NONE;
+      *dict = 0;
+      return;
+  }
+}
+
+
+//==========================================================================
+//                        COMPRESSION / DECOMPRESSION
+//==========================================================================
+
+/// @brief nanoseconds between two instants
+static inline uint64_t comp_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000UL + (uint64_t)(end->tv_nsec - start->tv_nsec);
+}
+
+
+/**
+ * @brief Compresses a payload before encryption.
+ *
+ * @param ctx State of the client (codec and dictionary).
+ * @param thread_index Index of the thread.
+ * @param m Plaintext payload.
+ * @param mlen Length of the payload.
+ * @param out Buffer of at least mlen + COMP_HDR_LEN bytes.
+ * @return Length written in out.
+ */
+size_t comp_pack(const cli_ctx_t *ctx, size_t thread_index, const uint8_t *m, size_t mlen, uint8_t *out)
+{
+  comp_stats_t *stats = &comp_stats[thread_index];
+  LZ4_stream_t *work = &comp_work[thread_index];
+  const uint32_t len = (uint32_t)mlen;
+  struct timespec start, end;
+  int clen, cap;
+
+  if (mlen < COMP_MIN_SIZE)
+  {
+    stats->skipped_small++;
+    goto __raw;
+  }
+
+  // Anything larger than COMP_RATIO_NUM / COMP_RATIO_DEN of the payload is not worth it
+  cap = (int)(mlen * COMP_RATIO_NUM / COMP_RATIO_DEN) - (int)(COMP_HDR_LEN + COMP_LEN_LEN);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (ctx->comp_codec == COMP_LZ4_DICT)
+  {
+    LZ4_resetStream_fast(work);
+    LZ4_attach_dictionary(work, &comp_dict_stream[ctx->comp_dict]);
+    clen = LZ4_compress_fast_continue(work, (const char *)m, (char *)(out + COMP_HDR_LEN + COMP_LEN_LEN), (int)mlen, cap, 1);
+  }
+  else
+    clen = LZ4_compress_fast_extState_fastReset(work, (const char *)m, (char *)(out + COMP_HDR_LEN + COMP_LEN_LEN), (int)mlen, cap, 1);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats->ns_pack += comp_ns(&start, &end);
+
+  if (clen <= 0)
+  {
+    stats->skipped_ratio++;
+    goto __raw;
+  }
+
+  out[0] = ctx->comp_codec;
+  memcpy((void*)(out + COMP_HDR_LEN), &len, COMP_LEN_LEN);
+  stats->packed++;
+  stats->bytes_in += mlen;
+  stats->bytes_out += (size_t)clen + COMP_HDR_LEN + COMP_LEN_LEN;
+  return (size_t)clen + COMP_HDR_LEN + COMP_LEN_LEN;
+
+__raw:
+  out[0] = COMP_RAW;
+  memcpy((void*)(out + COMP_HDR_LEN), m, mlen);
+  return mlen + COMP_HDR_LEN;
+}
+
+
+/**
+ * @brief Decompresses a payload after decryption.
+ *
+ * @param ctx State of the client (codec and dictionary).
+ * @param thread_index Index of the thread.
+ * @param in Decrypted payload (header included).
+ * @param inlen Length of the decrypted payload.
+ * @param out Buffer receiving the decompressed payload.
+ * @param out_cap Capacity of out.
+ * @param res Set to the plaintext (inside in for raw payloads, out otherwise).
+ * @param reslen Set to the length of the plaintext.
+ * @return __SUCCESS__, or ECOMP_DATA if the payload is malformed.
+ */
+errcode_t comp_unpack(const cli_ctx_t *ctx, size_t thread_index, const uint8_t *in, size_t inlen,
+  uint8_t *out, size_t out_cap, const uint8_t **res, size_t *reslen)
+{
+  comp_stats_t *stats = &comp_stats[thread_index];
+  struct timespec start, end;
+  uint32_t len;
+  int dlen;
+
+  if (inlen < COMP_HDR_LEN)
+    return ECOMP_DATA;
+
+  if (in[0] == COMP_RAW)
+  {
+    *res = in + COMP_HDR_LEN;
+    *reslen = inlen - COMP_HDR_LEN;
+    return __SUCCESS__;
+  }
+
+  // The client may only use the codec negotiated for the connection
+  if (in[0] != ctx->comp_codec || inlen < COMP_HDR_LEN + COMP_LEN_LEN)
+    return ECOMP_DATA;
+
+  memcpy((void*)&len, in + COMP_HDR_LEN, COMP_LEN_LEN);
+  if (len > out_cap)
+    return ECOMP_DATA;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (in[0] == COMP_LZ4_DICT)
+    dlen = LZ4_decompress_safe_usingDict((const char *)(in + COMP_HDR_LEN + COMP_LEN_LEN), (char *)out,
+      (int)(inlen - COMP_HDR_LEN - COMP_LEN_LEN), (int)len,
+      (const char *)comp_dict_buf[ctx->comp_dict], (int)comp_dict_len[ctx->comp_dict]);
+  else
+    dlen = LZ4_decompress_safe((const char *)(in + COMP_HDR_LEN + COMP_LEN_LEN), (char *)out,
+      (int)(inlen - COMP_HDR_LEN - COMP_LEN_LEN), (int)len);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats->ns_unpack += comp_ns(&start, &end);
+
+  if (dlen < 0 || (uint32_t)dlen != len)
+    return ECOMP_DATA;
+
+  stats->unpacked++;
+  *res = out;
+  *reslen = len;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Sums the compression counters of all the threads (approximate snapshot).
+ *
+ * @param stats Output counters.
+ */
+void comp_stats_get(comp_stats_t *stats)
+{
+  bzero((void*)stats, sizeof *stats);
+  for (size_t i = 0; i < SERVER_THREAD_NO; i++)
+  {
+    stats->packed        += comp_stats[i].packed;
+    stats->skipped_small += comp_stats[i].skipped_small;
+    stats->skipped_ratio += comp_stats[i].skipped_ratio;
+    stats->bytes_in      += comp_stats[i].bytes_in;
+    stats->bytes_out     += comp_stats[i].bytes_out;
+    stats->ns_pack       += comp_stats[i].ns_pack;
+    stats->unpacked      += comp_stats[i].unpacked;
+    stats->ns_unpack     += comp_stats[i].ns_unpack;
+  }
+}
@@ -151,47 +151,55 @@ errcode_t db_init(MYSQL **db_connect) {
 
 
 //===========================================================================================================
-//ASYMMETRIC QUERIES:QUERY_KEY_INSERT /QUERY_KEY_DELETE /QUERY_SELECT_PK /QUERY_SELECT_SK /QUERY_SELECT_PK_SK
+//ASYMMETRIC QUERIES:QUERY_KEY_INSERT /QUERY_KEY_DELETE /QUERY_KEY_RETIRE /QUERY_SELECT_PK /QUERY_SELECT_SK /QUERY_SELECT_PK_SK
 //===========================================================================================================
 
 
 /**
- * @brief Fill the parameter values for pk and sk.
+ * @brief Fill the parameter values for the generation, pk and sk.
  * 
- * This function initializes the parameters for the public key (pk) and 
+ * This function initializes the parameters for the generation (id), the public key (pk) and 
  * secret key (sk) to be inserted into the database.
  * 
  * @param params Query parameters array.
+ * @param id Generation of the keypair.
  * @param pk Public key buffer.
  * @param sk Secret key buffer.
  */
-static inline void fill_params_KEY_INSERT(MYSQL_BIND *params, uint8_t *pk, uint8_t *sk)
+static inline void fill_params_KEY_INSERT(MYSQL_BIND *params, uint32_t *id, uint8_t *pk, uint8_t *sk)
 {
+    // Parameter for the generation (kp_id)
+    params[0].buffer_type = MYSQL_TYPE_LONG;
+    params[0].buffer = id;
+    params[0].buffer_length = sizeof *id;
+    params[0].is_unsigned = 1;
+
     // Parameter for public key (pk)
-    params[0].buffer_type = MYSQL_TYPE_BLOB;
-    params[0].buffer = pk;
-    params[0].buffer_length = sizeof pk;
+    params[1].buffer_type = MYSQL_TYPE_BLOB;
+    params[1].buffer = pk;
+    params[1].buffer_length = crypto_box_PUBLICKEYBYTES;
 
     // Parameter for secret key (sk)
-    params[1].buffer_type = MYSQL_TYPE_BLOB;
-    params[1].buffer = sk;
-    params[1].buffer_length = sizeof sk;
+    params[2].buffer_type = MYSQL_TYPE_BLOB;
+    params[2].buffer = sk;
+    params[2].buffer_length = crypto_box_SECRETKEYBYTES;
 }
 
 /**
  * @brief Write the keys to the database.
  * 
- * This function writes the public key (pk) and secret key (sk) to the database.
+ * This function writes a generation of the public key (pk) and secret key (sk) to the database.
  * 
+ * @param id Generation of the keypair.
  * @param pk Public key.
  * @param sk Secret key.
  * @param db_connect MYSQL database connection.
  * @return Error code indicating success or failure.
  */
-errcode_t secu_key_save(uint8_t *pk, uint8_t *sk, MYSQL *db_connect)
+errcode_t secu_key_save(uint32_t id, uint8_t *pk, uint8_t *sk, MYSQL *db_connect)
 {
     MYSQL_STMT *stmt = NULL; // Statement handle
-    MYSQL_BIND params[2];    // Array to hold parameter information (pk, sk)
+    MYSQL_BIND params[3];    // Array to hold parameter information (id, pk, sk)
     bzero((void *)params, sizeof(params)); // Initialize the param structs
 
     // Initialize a statement handle
@@ -203,7 +211,7 @@ errcode_t secu_key_save(uint8_t *pk, uint8_t *sk, MYSQL *db_connect)
         return LOG(DB_LOG_PATH, (int32_t)mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
 
     // Fill the parameter values for pk and sk
-    fill_params_KEY_INSERT(params, pk, sk);
+    fill_params_KEY_INSERT(params, &id, pk, sk);
 
     // Bind the parameters to the statement
     if (mysql_stmt_bind_param(stmt, params))
@@ -396,9 +404,9 @@ cleanup:
 
 
 /**
- * @brief Delete the current key pair present in the database KeyPairs table.
+ * @brief Delete every key pair present in the database KeyPairs table.
  * 
- * This function deletes the current key pair present in the KeyPairs table of the database.
+ * This function deletes the key pairs of every generation present in the KeyPairs table of the database.
  * 
  * @param db_connect MYSQL database connection.
  * @return Error code indicating success or failure.
@@ -411,6 +419,26 @@ inline errcode_t secu_key_del(MYSQL *db_connect)
 }
 
 
+/**
+ * @brief Delete the key pairs of the generations up to id from the database KeyPairs table.
+ * 
+ * Called after a rotation for the generation dropped from memory, no handshake can use it anymore.
+ * 
+ * @param id Newest generation retired.
+ * @param db_connect MYSQL database connection.
+ * @return Error code indicating success or failure.
+ */
+errcode_t secu_key_retire(uint32_t id, MYSQL *db_connect)
+{
+    char query[QUERY_KEY_RETIRE_LEN + 12];
+
+    sprintf(query, QUERY_KEY_RETIRE, id);
+    if (mysql_query(db_connect, query))
+        return LOG(DB_LOG_PATH, (int32_t)mysql_errno(db_connect), mysql_error(db_connect));
+    return __SUCCESS__;
+}
+
+
 
 
 //==========================================================================
@@ -1169,8 +1197,9 @@ errcode_t db_co_sel_key_by_fd(MYSQL *db_connect, uint8_t *co_key, uint8_t *co_no
     return LOG(DB_LOG_PATH, WDB_NO_ROWS, WDB_NO_ROWS_M1);
   }
 
-  // Copy the key from the result to the buffer
+  // Copy the key and the nonce from the result to the buffers
   memcpy((void*)co_key, (const void*)row[0], crypto_secretbox_KEYBYTES);
+  memcpy((void*)co_nonce, (const void*)row[1], crypto_secretbox_NONCEBYTES);
 
   // Free the result and return success
   mysql_free_result(result);
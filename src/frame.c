@@ -0,0 +1,90 @@
+#include "../include/frame.h"
+
+//==========================================================================
+//                              FRAME PARSING
+//==========================================================================
+
+/**
+ * @brief Parses a frame into segment views.
+ *
+ * This function walks the frame once, checking that every seglen fits in the frame, that no bytes
+ * are left after the last segment and that the frame carries at most REQ_MAX_SEGS segments.
+ * It does not log: malformed frames are reported by the caller.
+ *
+ * @param req Frame received from the network.
+ * @param len_req Length of the frame.
+ * @param frame Parsed frame (views point inside req).
+ * @return __SUCCESS__ if the frame is well formed, EREQ_LEN if a length is out of bounds,
+ *         EREQ_NSEG if the frame carries more than REQ_MAX_SEGS segments, EREQ_FLAGS if an unknown flag is set.
+ */
+errcode_t req_parse(void *req, size_t len_req, req_frame_t *frame)
+{
+  uint8_t *ptr = (uint8_t *)req;
+  size_t offset = REQ_CODE_LEN;
+  uint32_t seglen;
+
+  if (len_req < REQ_CODE_LEN)
+    return EREQ_LEN;
+
+  frame->raw = ptr;
+  frame->len = len_req;
+  frame->nseg = 0;
+  memcpy((void*)&frame->reqcode, ptr, REQ_CODE_LEN);
+  frame->flags = frame->reqcode & REQ_FLAGS;
+  frame->reqcode &= ~REQ_FLAGS;
+  frame->id = 0;
+  frame->stream = 0;
+  frame->budget_ms = 0;
+
+  // Header fields announced by the flags
+  if (frame->flags & ~REQ_FLAGS_KNOWN)
+    return EREQ_FLAGS;
+
+  if (frame->flags & REQ_FLAG_ID)
+  {
+    if (len_req - offset < REQ_ID_LEN)
+      return EREQ_LEN;
+    memcpy((void*)&frame->id, ptr + offset, REQ_ID_LEN);
+    offset += REQ_ID_LEN;
+  }
+
+  if (frame->flags & REQ_FLAG_STREAM)
+  {
+    if (len_req - offset < REQ_STREAM_LEN)
+      return EREQ_LEN;
+    memcpy((void*)&frame->stream, ptr + offset, REQ_STREAM_LEN);
+    offset += REQ_STREAM_LEN;
+  }
+
+  if (frame->flags & REQ_FLAG_DEADLINE)
+  {
+    if (len_req - offset < REQ_DEADLINE_LEN)
+      return EREQ_LEN;
+    memcpy((void*)&frame->budget_ms, ptr + offset, REQ_DEADLINE_LEN);
+    offset += REQ_DEADLINE_LEN;
+  }
+  frame->hdr_len = (uint32_t)offset;
+
+  while (offset < len_req)
+  {
+    // A seglen must be complete
+    if (len_req - offset < REQ_SEGLEN_LEN)
+      return EREQ_LEN;
+
+    if (frame->nseg == REQ_MAX_SEGS)
+      return EREQ_NSEG;
+
+    memcpy((void*)&seglen, ptr + offset, REQ_SEGLEN_LEN);
+    offset += REQ_SEGLEN_LEN;
+
+    // The segment must fit in what is left of the frame
+    if (seglen > len_req - offset)
+      return EREQ_LEN;
+
+    frame->seg[frame->nseg].ptr = ptr + offset;
+    frame->seg[frame->nseg].len = seglen;
+    frame->nseg++;
+    offset += seglen;
+  }
+  return __SUCCESS__;
+}
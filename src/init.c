@@ -11,6 +11,13 @@
  *   4. Initialize the database connection.
  *   5. Initialize pollfds for polling.
  *   6. Delete old asymmetric keys, generate new ones, and save them.
+ *   7. Register the request handlers.
+ *   8. Load the compression dictionaries.
+ *   9. Allocate the response buffer pools.
+ *  10. Allocate the session key store.
+ *  11. Start the crypto offload threads.
+ *  12. Draw the first key of the resumption tickets.
+ *  13. Start the keypair rotation thread.
  * 
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @return __SUCCESS__ if initialization is successful, or an error code if it fails.
@@ -18,6 +25,7 @@
 errcode_t __init__(thread_arg_t *thread_arg)
 {
   thread_arg->db_connect = NULL;
+  MYSQL *db_rotate = NULL;
   char pass[MAX_AUTH_SIZE];
 
   // Step 1: Get and validate passphrase
@@ -44,10 +52,38 @@ errcode_t __init__(thread_arg_t *thread_arg)
   // Step 4: Initialize pollfds for polling
   net_init_clifd(thread_arg->total_cli_fds);
 
-  // Step 5: Delete old asymmetric keys, generate new ones, and save them
+  // Step 5: Delete old asymmetric keys, generate new ones in guarded memory, and save them
   if (secu_init_keys(thread_arg->db_connect))
     return __FAILURE__;
 
+  // Step 6: Register the request handlers in the dispatch table
+  if (req_init())
+    return __FAILURE__;
+
+  // Step 7: Load the compression dictionaries
+  if (comp_init())
+    return __FAILURE__;
+
+  // Step 8: Allocate the response buffer pools
+  if (resp_init())
+    return __FAILURE__;
+
+  // Step 9: Allocate the session key store
+  if (secu_sess_init())
+    return __FAILURE__;
+
+  // Step 10: Start the crypto offload threads (handshake boxes)
+  if (net_crypto_init())
+    return __FAILURE__;
+
+  // Step 11: Draw the first key of the resumption tickets
+  if (secu_ticket_init())
+    return __FAILURE__;
+
+  // Step 12: Start the keypair rotation thread (on its own database connection, the workers never wait for it)
+  if (db_init(&db_rotate) || secu_keypair_start(db_rotate))
+    return __FAILURE__;
+
   return __SUCCESS__;
 }
 
@@ -0,0 +1,175 @@
+#include "../../include/base.h"
+
+// new-dict <out.dict> <sample> [sample...]
+// Trains a compression dictionary from captured payloads (one payload per file) and writes it
+// to <out.dict>, to be deployed as COMP_DICT_PATH on the server and on the clients.
+//
+// Simplified COVER: every 64 byte segment of the samples is scored by the number of samples
+// sharing each of its 8 byte n-grams, segments are picked greedily (n-grams already covered
+// stop counting) and the best segments end up at the end of the dictionary, where LZ4 matches
+// are the cheapest to reach.
+
+#define DICT_MAX        65536U      // COMP_DICT_MAX
+#define DICT_SAMPLES    (16U << 20) // at most 16MB of samples
+#define DICT_K          8U          // n-gram length
+#define DICT_SEG        64U         // segment length
+#define DICT_STEP       16U         // distance between two candidate segments
+#define DICT_HASH_LOG   20U
+
+typedef struct DictCand
+{
+  uint32_t offset;
+  uint32_t score;
+}dict_cand_t;
+
+static uint8_t  *samples;
+static size_t    samples_len;
+static uint32_t  freq[1U << DICT_HASH_LOG];   // number of samples holding the n-gram
+static uint32_t  seen[1U << DICT_HASH_LOG];   // last sample that counted the n-gram
+
+
+// Function to hash the n-gram starting at p
+static inline uint32_t dict_hash(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof v);
+  return (uint32_t)((v * 0x9E3779B185EBCA87ULL) >> (64 - DICT_HASH_LOG));
+}
+
+// Function to score a segment with the n-grams that are not covered yet
+static inline uint32_t dict_score(uint32_t offset, uint32_t stamp) {
+  uint32_t score = 0;
+
+  for (uint32_t i = 0; i + DICT_K <= DICT_SEG; i++) {
+    uint32_t h = dict_hash(samples + offset + i);
+    if (seen[h] != stamp) {   // count every n-gram once per segment
+      seen[h] = stamp;
+      score += freq[h];
+    }
+  }
+  return score;
+}
+
+// Function to read all the samples into one buffer, returns the number of candidate segments
+static inline size_t dict_load(int argc, const char **argv, dict_cand_t *cand) {
+  size_t ncand = 0;
+
+  for (int s = 2; s < argc; s++) {
+    FILE *f = fopen(argv[s], "rb");
+    size_t start = samples_len, len;
+
+    if (!f) {
+      fprintf(stderr, "Cannot open sample %s\n", argv[s]);
+      continue;
+    }
+    len = fread(samples + samples_len, 1, DICT_SAMPLES - samples_len, f);
+    fclose(f);
+    samples_len += len;
+
+    // Count the n-grams of the sample, once per sample
+    for (size_t i = start; i + DICT_K <= samples_len; i++) {
+      uint32_t h = dict_hash(samples + i);
+      if (seen[h] != (uint32_t)s) {
+        seen[h] = (uint32_t)s;
+        freq[h]++;
+      }
+    }
+
+    for (size_t i = start; i + DICT_SEG <= samples_len; i += DICT_STEP)
+      cand[ncand++].offset = (uint32_t)i;
+
+    if (samples_len == DICT_SAMPLES)
+      break;
+  }
+  return ncand;
+}
+
+// Function to restore the max-heap property under node i
+static inline void dict_sift(dict_cand_t *heap, size_t n, size_t i) {
+  for (;;) {
+    size_t l = 2 * i + 1, r = l + 1, m = i;
+    dict_cand_t tmp;
+
+    if (l < n && heap[l].score > heap[m].score)
+      m = l;
+    if (r < n && heap[r].score > heap[m].score)
+      m = r;
+    if (m == i)
+      return;
+    tmp = heap[i];
+    heap[i] = heap[m];
+    heap[m] = tmp;
+    i = m;
+  }
+}
+
+int main(int argc, const char **argv) {
+  static uint8_t dict[DICT_MAX];
+  dict_cand_t *heap;
+  size_t n, dict_off = DICT_MAX;
+  uint32_t stamp = (uint32_t)argc;
+  FILE *out;
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <out.dict> <sample> [sample...]\n", argv[0]);
+    return __FAILURE__;
+  }
+
+  samples = (uint8_t *)malloc(DICT_SAMPLES);
+  heap = (dict_cand_t *)malloc(sizeof(dict_cand_t) * (DICT_SAMPLES / DICT_STEP));
+  if (!samples || !heap) {
+    fprintf(stderr, "Memory allocation failed\n");
+    return __FAILURE__;
+  }
+
+  n = dict_load(argc, argv, heap);
+  if (!n) {
+    fprintf(stderr, "Samples too small to train a dictionary\n");
+    return __FAILURE__;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    heap[i].score = dict_score(heap[i].offset, ++stamp);
+  for (size_t i = n / 2; i-- > 0;)
+    dict_sift(heap, n, i);
+
+  // Lazy greedy: scores only decrease, so a rescored top that stays on top is the best segment
+  while (n && dict_off >= DICT_SEG) {
+    uint32_t score = dict_score(heap[0].offset, ++stamp);
+
+    if (!score) {   // fully covered by the segments already picked
+      heap[0] = heap[--n];
+      dict_sift(heap, n, 0);
+      continue;
+    }
+    if (score < heap[0].score) {
+      heap[0].score = score;
+      dict_sift(heap, n, 0);
+      continue;
+    }
+
+    // Best segments first, filled from the end of the dictionary
+    dict_off -= DICT_SEG;
+    memcpy(dict + dict_off, samples + heap[0].offset, DICT_SEG);
+    for (uint32_t i = 0; i + DICT_K <= DICT_SEG; i++)
+      freq[dict_hash(samples + heap[0].offset + i)] = 0;
+
+    heap[0] = heap[--n];
+    dict_sift(heap, n, 0);
+  }
+
+  if (dict_off == DICT_MAX) {
+    fprintf(stderr, "No segment worth keeping, the samples do not share any content\n");
+    return __FAILURE__;
+  }
+
+  if (!(out = fopen(argv[1], "wb")) || fwrite(dict + dict_off, 1, DICT_MAX - dict_off, out) != DICT_MAX - dict_off) {
+    fprintf(stderr, "Cannot write %s\n", argv[1]);
+    return __FAILURE__;
+  }
+  fclose(out);
+  printf("Dictionary of %zu bytes written to %s\n", (size_t)(DICT_MAX - dict_off), argv[1]);
+
+  free(samples);
+  free(heap);
+  return __SUCCESS__;
+}
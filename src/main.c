@@ -3,13 +3,7 @@
 /**
  * @brief Initialize the server and authenticate the user.
  * 
- * This function performs the following steps:
- *   1. Authenticate the user.
- *   2. Initialize cryptographic libraries.
- *   3. Verify the passphrase.
- *   4. Initialize the database connection.
- *   5. Initialize pollfds for polling.
- *   6. Delete old asymmetric keys, generate new ones, and save them.
+ * The steps are listed with the definition (init.c).
  * 
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @return __SUCCESS__ if initialization is successful, or an error code if it fails.
@@ -42,7 +36,8 @@ void run_threads(pthread_t **threads, thread_arg_t *thread_arg);
 int main(void)
 {
   // Initialize thread argument structure and status
-  thread_arg_t thread_arg;
+  // (static: the per slot contexts of every worker are megabytes, too much for the stack of the main thread)
+  static thread_arg_t thread_arg;
   errcode_t status;
   pthread_t *threads;
 
@@ -250,19 +250,24 @@ inline void net_init_clifd(pollfd_t total_cli__fds[SERVER_THREAD_NO][CLIENTS_PER
 
 
 
+/// @brief number of the last connection accepted (main thread only, 0 is never used)
+static uint32_t net_co_gen;
+
+
 /**
  * @brief Adds a new client file descriptor to a thread's list.
  * 
  * This function adds a new client file descriptor, along with its address and length, to a specific thread's list of file descriptors.
  * 
  * @param thread_cli__fds Pointer to the list of file descriptors for the thread.
+ * @param thread_cli_ctx Pointer to the list of client states for the thread.
  * @param db_connect Pointer to the MySQL database connection.
  * @param new_cli_fd New client file descriptor to add.
  * @param new_addr Address of the new client.
  * @param addr_len Length of the address.
  * @return __SUCCESS__ if the client file descriptor is added successfully, __FAILURE__ if an error occurs, or MAX_FDS_IN_THREAD if the maximum number of file descriptors per thread is reached.
  */
-static inline errcode_t net_add_clifd_to_thread(pollfd_t *thread_cli__fds, MYSQL *db_connect, sockfd_t new_cli_fd, sockaddr_t new_addr, socklen_t addr_len)
+static inline errcode_t net_add_clifd_to_thread(pollfd_t *thread_cli__fds, cli_ctx_t *thread_cli_ctx, MYSQL *db_connect, sockfd_t new_cli_fd, sockaddr_t new_addr, socklen_t addr_len)
 {
   co_t co_new;
   
@@ -270,9 +275,18 @@ static inline errcode_t net_add_clifd_to_thread(pollfd_t *thread_cli__fds, MYSQL
   for (size_t i = 0; i < CLIENTS_PER_THREAD; i++) {
     // Find an empty slot in the list of file descriptors
     if (thread_cli__fds[i].fd == FD_DISCO) {
-      // Add the new client file descriptor to the list
-      thread_cli__fds[i].fd = new_cli_fd;
+      // The slot may still hold a copy of a client moved down by cli_dc(): reset its state before the
+      // worker can see the socket, or the first frame would run with the state of that client
+      bzero((void*)&thread_cli_ctx[i], sizeof thread_cli_ctx[i]);
+      thread_cli_ctx[i].auth_status = CO_FLAG_NO_AUTH;
+      thread_cli_ctx[i].max_out = REQ_BATCH_OUT_MAX;
+      if (!++net_co_gen)
+        ++net_co_gen;
+      thread_cli_ctx[i].gen = net_co_gen;
+
+      // Add the new client file descriptor to the list (published last)
       thread_cli__fds[i].events = POLLIN | POLLPRI; // Set events to priority because the client has not authenticated yet
+      __atomic_store_n(&thread_cli__fds[i].fd, new_cli_fd, __ATOMIC_RELEASE);
       
       // Create a new connection instance
       if (net_co_create(&co_new, new_cli_fd, new_addr, addr_len) != __SUCCESS__)
@@ -305,7 +319,7 @@ static inline errcode_t net_add_clifd_to_thread(pollfd_t *thread_cli__fds, MYSQL
 static inline errcode_t net_add_clifd(thread_arg_t *thread_arg, sockfd_t new_cli_fd, sockaddr_t new_addr, socklen_t addr_len)
 {
   for (size_t i = 0; i < SERVER_THREAD_NO; i++){
-    if (net_add_clifd_to_thread(thread_arg->total_cli_fds[i], thread_arg->db_connect, new_cli_fd, new_addr, addr_len))
+    if (net_add_clifd_to_thread(thread_arg->total_cli_fds[i], thread_arg->total_cli_ctx[i], thread_arg->db_connect, new_cli_fd, new_addr, addr_len))
       // Log error if maximum number of file descriptors is reached
       return LOG(NET_LOG_PATH, MAX_FDS_IN_PROGRAM, MAX_FDS_IN_PROGRAM_M);
   }
@@ -346,6 +360,13 @@ static inline errcode_t net_accept_save_new_co(thread_arg_t *thread_arg)
     return LOG(NET_LOG_PATH, errno, strerror(errno));
   }
 
+  // Bound the kernel memory a client can fill without reading the credits it was given
+  int rcvbuf = CONN_RCVBUF;
+  if (setsockopt(new_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf) == -1) {
+    // Handle error if setting the receive buffer fails
+    return LOG(NET_LOG_PATH, errno, strerror(errno));
+  }
+
   // Add the file descriptor to the thread's poll list
   if (net_add_clifd(thread_arg, new_fd, new_addr, addr_len) == __FAILURE__) {
     // Handle error if adding file descriptor fails
@@ -415,6 +436,10 @@ static void cli_dc(thread_arg_t *thread_arg, size_t thread_index, size_t client_
   
   // Close the client file descriptor
   close(thread_arg->total_cli_fds[thread_index][client_index].fd);
+
+  // Release the chunked transfer the client left unfinished and cancel its deferred work
+  req_xfer_abort(&thread_arg->total_cli_ctx[thread_index][client_index]);
+  req_cancel(thread_arg, thread_index, client_index);
   
   // Update the connection authentication status in the database to indicate disconnection
   if (db_co_up_auth_stat_by_fd(thread_arg->db_connect, CO_FLAG_DISCO, thread_arg->total_cli_fds[thread_index][client_index].fd))
@@ -428,6 +453,8 @@ static void cli_dc(thread_arg_t *thread_arg, size_t thread_index, size_t client_
   thread_arg->total_cli_fds[thread_index][client_index].fd = thread_arg->total_cli_fds[thread_index][last_index].fd;
   thread_arg->total_cli_fds[thread_index][client_index].events = thread_arg->total_cli_fds[thread_index][last_index].events;
   thread_arg->total_cli_fds[thread_index][client_index].revents = thread_arg->total_cli_fds[thread_index][last_index].revents;
+  thread_arg->total_cli_ctx[thread_index][client_index] = thread_arg->total_cli_ctx[thread_index][last_index];
+  secu_sess_move(thread_index, client_index, last_index); // the session key follows its client, the freed slot is wiped
   thread_arg->total_cli_fds[thread_index][last_index].fd = FD_DISCO; // Set the last active client file descriptor to -1 to mark it as inactive
 }
 
@@ -580,7 +607,7 @@ static errcode_t net_handle_send_err(thread_arg_t *thread_arg, size_t thread_ind
  * @param n Length of the data buffer.
  * @return __SUCCESS__ if all data is sent successfully, otherwise E_SEND_FAILED.
  */
-static inline errcode_t sendall(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const void *buf, size_t n)
+errcode_t sendall(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const void *buf, size_t n)
 {
   ssize_t total_sent = 0;
   const char *ptr = buf;
@@ -667,45 +694,763 @@ static errcode_t net_data_available(thread_arg_t *thread_arg, size_t thread_inde
 
 
 
+//==========================================================================
+//                          FAIR SCHEDULING (DRR)
+//==========================================================================
+
+/// @brief quantum multiplier of every client class
+static const int32_t sched_weights[SCHED_CLASSES] = SCHED_WEIGHTS;
+
+/// @brief slot the next round of every thread starts from
+static size_t sched_next[SERVER_THREAD_NO];
+
+/// @brief overload controller of a thread (CoDel: a standing queue is a minimum delay above target for a whole interval)
+/// the delay measured is the length of a scheduling round: a client found ready by a poll, or becoming
+/// ready during the round, waits up to that long to be served, whatever the number of frames it sends
+typedef struct NetOvl
+{
+  uint64_t interval_end;  // end of the current measurement interval
+  uint64_t min_round_ns;  // shortest round (poll return to end of service) of the interval (UINT64_MAX if none)
+  uint8_t  level;         // REQ_SHED_* currently applied
+}net_ovl_t;
+
+static net_ovl_t net_ovl[SERVER_THREAD_NO];
+
+
+/// @brief monotonic clock in nanoseconds
+static inline uint64_t net_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+
 /**
- * @brief Iterate over client file descriptors to check which ones have incoming data.
+ * @brief Serves one client for one round of the fair scheduler.
  * 
- * This function iterates over the list of client file descriptors handled by the thread
- * to check which ones have incoming data available for reading.
+ * The client is credited with SCHED_QUANTUM times the weight of its class. What its requests still owe it
+ * is sent first if its socket is writable (req_out_pump), then frames are read and handled until the
+ * credit is spent, SCHED_MAX_FRAMES frames are handled or the socket is drained.
+ * A drained client loses what is left of its credit (it was not waiting), a client cut by its
+ * credit keeps waiting and is served again in the next round.
  * 
  * @param thread_arg Pointer to a thread_arg_t structure containing thread-specific information.
  * @param thread_index Index of the thread in the thread pool.
+ * @param client_index Index of the client file descriptor.
+ * @param now Time the round started.
  */
-static inline void net_check_clifds(thread_arg_t *thread_arg, size_t thread_index)
+static inline void net_sched_serve(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint64_t now)
 {
-  size_t client_index = 0;
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  const sockfd_t fd = thread_arg->total_cli_fds[thread_index][client_index].fd;
+  const int16_t revents = thread_arg->total_cli_fds[thread_index][client_index].revents;
+  uint64_t qdelay;
   void *buffer = NULL;
   ssize_t len_req;
-  // Iterate over client file descriptors
-  while (thread_arg->total_cli_fds[thread_index][client_index].fd != FD_DISCO)
+  size_t sent;
+  uint32_t frames = 0;
+
+  if (!ctx->ready_ns)
+    ctx->ready_ns = now;
+
+  // Queueing delay: from the wakeup that found the client ready to its first frame served
+  qdelay = net_now_ns() - ctx->ready_ns;
+  ctx->sched.qdelay_ns += qdelay;
+  if (qdelay > ctx->sched.qdelay_max_ns)
+    ctx->sched.qdelay_max_ns = qdelay;
+  ctx->sched.rounds++;
+
+  ctx->deficit += SCHED_QUANTUM * sched_weights[ctx->sched_class];
+
+  // What the requests of the client still owe it goes out of the same credit as the frames it sends
+  if (revents & POLLOUT)
   {
-    if (buffer)
-      free(buffer);
-    
-    // Check if data is available on the client's receive buffer
-    if (net_data_available(thread_arg, thread_index, client_index, &buffer, &len_req))
+    sent = req_out_pump(thread_arg, thread_index, client_index, ctx->deficit);
+    if (thread_arg->total_cli_fds[thread_index][client_index].fd != fd)
+      return;
+    ctx->deficit -= (int32_t)sent;
+    ctx->sched.bytes += (uint64_t)sent;
+    if (!(revents & (POLLIN | POLLPRI)))
     {
-      if (thread_arg->total_cli_fds[thread_index][client_index].revents & POLLPRI) // client needs to authenticate
-      {
-        // Call request module to handle priority requests (e.g., authentication)
-        req_pri_handle(buffer, len_req, thread_arg, thread_index, client_index);
-      }
-      else if (thread_arg->total_cli_fds[thread_index][client_index].revents & POLLIN) // client authenticated can perform I/O
+      ctx->deficit = 0;
+      ctx->ready_ns = 0;
+      return;
+    }
+  }
+
+  while (ctx->deficit > 0 && frames < SCHED_MAX_FRAMES)
+  {
+    if (!net_data_available(thread_arg, thread_index, client_index, &buffer, &len_req))
+    {
+      // Drained (or disconnected, the slot may hold another client now)
+      if (thread_arg->total_cli_fds[thread_index][client_index].fd == fd)
       {
-        // Call request module to parse and handle regular data reception
-        req_handle(buffer, len_req, thread_arg, thread_index, client_index);
+        ctx->deficit = 0;
+        ctx->ready_ns = 0;
       }
+      return;
+    }
+    ctx->last_seen_ns = now;
+
+    if (revents & POLLPRI) // client needs to authenticate
+    {
+      // Call request module to handle priority requests (e.g., authentication)
+      req_pri_handle(buffer, len_req, thread_arg, thread_index, client_index);
+    }
+    else // client authenticated can perform I/O
+    {
+      // Call request module to parse and handle regular data reception
+      req_handle(buffer, len_req, thread_arg, thread_index, client_index);
+    }
+    free(buffer);
+    buffer = NULL;
+
+    // The handler may have disconnected the client
+    if (thread_arg->total_cli_fds[thread_index][client_index].fd != fd)
+      return;
+
+    // or handed its handshake to the crypto pool: nothing more is read until the result is back
+    if (!thread_arg->total_cli_fds[thread_index][client_index].events)
+    {
+      ctx->deficit = 0;
+      ctx->ready_ns = 0;
+      return;
+    }
+
+    ctx->deficit -= (int32_t)len_req;
+    ctx->sched.bytes += (uint64_t)len_req;
+    ctx->sched.frames++;
+    frames++;
+  }
+
+  // Cut by its credit: still waiting for the next round
+  ctx->ready_ns = net_now_ns();
+  if (ctx->deficit > 0)
+    ctx->deficit = 0; // cut by SCHED_MAX_FRAMES, the credit does not pile up
+}
+
+
+/**
+ * @brief Updates the overload level of the thread at the end of every OVL_INTERVAL_MS interval.
+ * 
+ * Rounds longer than OVL_TARGET_US for a whole interval make the thread shed new handshakes, one more
+ * such interval makes it shed low priority requests too. The level drops back as soon as an interval
+ * saw a round under the target (or no round at all).
+ * 
+ * @param thread_index Index of the thread in the thread pool.
+ * @param now Current time.
+ */
+static inline void net_ovl_update(size_t thread_index, uint64_t now)
+{
+  net_ovl_t *ovl = &net_ovl[thread_index];
+  uint8_t level = REQ_SHED_NEVER;
+
+  if (now < ovl->interval_end)
+    return;
+
+  if (ovl->interval_end && ovl->min_round_ns != UINT64_MAX && ovl->min_round_ns > OVL_TARGET_US * 1000UL)
+    level = (ovl->level < REQ_SHED_LOW) ? ovl->level + 1 : REQ_SHED_LOW;
+
+  if (level != ovl->level)
+  {
+    ovl->level = level;
+    req_overload_set(thread_index, level);
+  }
+  ovl->min_round_ns = UINT64_MAX;
+  ovl->interval_end = now + OVL_INTERVAL_MS * 1000000UL;
+}
+
+
+/**
+ * @brief Runs one deficit round robin round over the clients of the thread.
+ * 
+ * Every ready client is served once per round (net_sched_serve), the round starts one slot further
+ * every time so that the low slots are not always served first. Clients that still have data after
+ * their turn are found ready again by the next poll.
+ * While the thread is overloaded authenticated clients are served first and clients still in the
+ * handshake get what is left of the round.
+ * 
+ * @param thread_arg Pointer to a thread_arg_t structure containing thread-specific information.
+ * @param thread_index Index of the thread in the thread pool.
+ */
+static inline void net_check_clifds(thread_arg_t *thread_arg, size_t thread_index)
+{
+  pollfd_t *fds = thread_arg->total_cli_fds[thread_index];
+  const uint64_t now = net_now_ns();
+  const size_t passes = (net_ovl[thread_index].level != REQ_SHED_NEVER) ? 2 : 1;
+  size_t n_clients = 0, client_index;
+  uint64_t round;
+
+  net_ovl_update(thread_index, now);
+
+  while (n_clients < CLIENTS_PER_THREAD && fds[n_clients].fd != FD_DISCO)
+    ++n_clients;
+  if (!n_clients)
+    return;
+
+  for (size_t pass = 0; pass < passes; pass++)
+  {
+    client_index = sched_next[thread_index] % n_clients;
+    for (size_t i = 0; i < n_clients; i++)
+    {
+      // Disconnections during the round move clients around, the round ends with the first empty slot
+      if (fds[client_index].fd == FD_DISCO)
+        break;
+
+      // Under overload the first pass only serves authenticated clients, the second one the others
+      if ((fds[client_index].revents & (POLLIN | POLLPRI | POLLOUT)) && (passes == 1 ||
+          (thread_arg->total_cli_ctx[thread_index][client_index].auth_status == CO_FLAG_AUTH) == (pass == 0)))
+        net_sched_serve(thread_arg, thread_index, client_index, now);
+
+      if (++client_index == n_clients)
+        client_index = 0;
     }
-    ++client_index;
   }
+  sched_next[thread_index] = (sched_next[thread_index] + 1) % n_clients;
+
+  // Length of the round: what a client ready at its start waited at most (overload controller)
+  round = net_now_ns() - now;
+  if (round < net_ovl[thread_index].min_round_ns)
+    net_ovl[thread_index].min_round_ns = round;
 }
 
 
+//==========================================================================
+//                               HEARTBEATS
+//==========================================================================
+
+/// @brief next liveness check of every thread
+static uint64_t hb_next[SERVER_THREAD_NO];
+
+
+/**
+ * @brief Disconnects the clients that stopped sending heartbeats (once every HB_TICK_MS).
+ * 
+ * Every client of the thread is checked in the same pass against the in memory time of its last frame:
+ * no timer per client and no database write. Only the clients that negotiated PROTO_CAP_HEARTBEAT are
+ * checked, the others keep relying on TCP keepalive.
+ * The same pass updates the keys of the clients that negotiated PROTO_CAP_REKEY once they carried
+ * REKEY_BYTES or REKEY_INTERVAL_S went by (a failed update is tried again at the next pass).
+ * 
+ * @param thread_arg Pointer to a thread_arg_t structure containing thread-specific information.
+ * @param thread_index Index of the thread in the thread pool.
+ * @param now Current time.
+ */
+static inline void net_hb_tick(thread_arg_t *thread_arg, size_t thread_index, uint64_t now)
+{
+  pollfd_t *fds = thread_arg->total_cli_fds[thread_index];
+  size_t n_clients = 0;
+
+  if (now < hb_next[thread_index])
+    return;
+  hb_next[thread_index] = now + HB_TICK_MS * 1000000UL;
+
+  while (n_clients < CLIENTS_PER_THREAD && fds[n_clients].fd != FD_DISCO)
+    ++n_clients;
+
+  // Walk backwards: a disconnection moves the last client, already checked, into the freed slot
+  for (size_t client_index = n_clients; client_index-- > 0;)
+  {
+    cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+
+    if ((ctx->caps & PROTO_CAP_REKEY) && ctx->auth_status == CO_FLAG_AUTH)
+    {
+      if (!ctx->rekey_ns)
+        ctx->rekey_ns = now;
+      else if (ctx->rekey_bytes >= REKEY_BYTES || now - ctx->rekey_ns >= REKEY_INTERVAL_S * 1000000000UL)
+        net_rekey(thread_arg, thread_index, client_index, REKEY_FLAG_REQUEST);
+    }
+
+    if (!(ctx->caps & PROTO_CAP_HEARTBEAT))
+      continue;
+    if (!ctx->last_seen_ns)
+      ctx->last_seen_ns = now;
+    else if (now - ctx->last_seen_ns > HB_TIMEOUT_MS * 1000000UL)
+    {
+      LOG(NET_LOG_PATH, E_HB_DEAD, E_HB_DEAD_M);
+      cli_dc(thread_arg, thread_index, client_index);
+    }
+  }
+}
+
+
+/**
+ * @brief Reads the fair scheduler counters of a client.
+ * 
+ * @param thread_arg Pointer to a thread_arg_t structure containing thread-specific information.
+ * @param thread_index Index of the thread in the thread pool.
+ * @param client_index Index of the client file descriptor.
+ * @param stats Output counters (approximate snapshot, the owning thread writes them without locks).
+ */
+void net_sched_stats_get(const thread_arg_t *thread_arg, size_t thread_index, size_t client_index, sched_stats_t *stats)
+{
+  *stats = thread_arg->total_cli_ctx[thread_index][client_index].sched;
+}
+
+
+/**
+ * @brief Moves a client to another weight class of the fair scheduler (class 0 on connection).
+ * 
+ * Meant for the request handlers once they know who the client is: it must run on the worker
+ * thread of the client, the weight applies from its next round.
+ * 
+ * @param thread_arg Pointer to a thread_arg_t structure containing thread-specific information.
+ * @param thread_index Index of the thread in the thread pool.
+ * @param client_index Index of the client file descriptor.
+ * @param sched_class Class of the client, index in SCHED_WEIGHTS.
+ * @return __SUCCESS__, or __FAILURE__ if the class does not exist.
+ */
+errcode_t net_sched_class_set(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint8_t sched_class)
+{
+  if (sched_class >= SCHED_CLASSES)
+    return __FAILURE__;
+  thread_arg->total_cli_ctx[thread_index][client_index].sched_class = sched_class;
+  return __SUCCESS__;
+}
+
+
+
+//==========================================================================
+//                          CRYPTO OFFLOAD POOL
+//==========================================================================
+
+//---JOBS-------| (public key operations of the handshakes)
+#define NET_JOB_BOX         0  // REQ_RECV_K: open the sealed key and nonce
+#define NET_JOB_KX          1  // REQ_KX: ephemeral key exchange
+
+/// @brief public key work of a handshake, done by a crypto thread and posted back to its worker
+typedef struct NetKeyJob
+{
+  req_pending_t pending;                        // client of the job: worker, slot, socket, connection number
+  uint8_t       kind;                           // NET_JOB_*
+  errcode_t     status;                         // result of the crypto
+  uint64_t      submit_ns;
+  uint64_t      start_ns;                       // taken by a crypto thread
+  uint64_t      done_ns;                        // crypto done
+  sec_keys_t    keys;                           // BOX: session key and nonce out (the server keypair never enters a job)
+  uint32_t      kp_id;                          // BOX: generation of the server keypair the client was sent
+                                                // KX: client key in pk, server key out in pk, keys out
+  uint8_t       key_tx[crypto_kx_SESSIONKEYBYTES]; // KX: key of the messages to the client
+  uint8_t       c_key[ENCRYPTED_KEY_SIZE];
+  uint8_t       c_nonce[ENCRYPTED_NONCE_SIZE];
+  uint32_t      answer[PROTO_ANSWER_MAX / sizeof(uint32_t)]; // KX: hello answer
+  uint32_t      answer_len;
+}net_key_job_t;
+
+/// @brief slot of a bounded lock-free queue, seq tells producers and consumers whose turn it is
+typedef struct NetCryptoCell
+{
+  size_t        seq;
+  net_key_job_t job;
+}net_crypto_cell_t;
+
+/// @brief bounded multi-producer multi-consumer ring (CRYPTO_QUEUE cells in guarded memory)
+typedef struct NetCryptoQueue
+{
+  net_crypto_cell_t *cells;
+  size_t             head;                      // next cell to take
+  size_t             tail;                      // next cell to fill
+}net_crypto_queue_t;
+
+/// @brief key frames waiting for a crypto thread, and the results waiting for every worker
+static net_crypto_queue_t net_crypto_jobs;
+static net_crypto_queue_t net_crypto_done[SERVER_THREAD_NO];
+static sem_t              net_crypto_sem;      // one unit per job queued, crypto threads sleep on it
+
+/// @brief jobs of every worker not applied yet (written by the worker only)
+static uint32_t           net_crypto_inflight[SERVER_THREAD_NO];
+static net_crypto_stats_t net_crypto_stats[SERVER_THREAD_NO];
+
+
+/**
+ * @brief Queues a job, the job is copied into the cell (callable from any thread).
+ *
+ * @param q Queue.
+ * @param job Job to copy.
+ * @return 1 if the job is queued, 0 if the queue is full.
+ */
+static flag_t net_crypto_push(net_crypto_queue_t *q, const net_key_job_t *job)
+{
+  size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  net_crypto_cell_t *cell;
+  intptr_t dif;
+
+  for (;;)
+  {
+    cell = &q->cells[pos & (CRYPTO_QUEUE - 1)];
+    dif = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+    if (!dif)
+    {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (dif < 0)
+      return 0; // the cell still holds the job of the previous lap
+    else
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  }
+
+  cell->job = *job;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+/**
+ * @brief Takes the oldest job of a queue, the cell is wiped (callable from any thread).
+ *
+ * @param q Queue.
+ * @param job Receives the job.
+ * @return 1 if a job was taken, 0 if the queue is empty (or its oldest job not published yet).
+ */
+static flag_t net_crypto_pop(net_crypto_queue_t *q, net_key_job_t *job)
+{
+  size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  net_crypto_cell_t *cell;
+  intptr_t dif;
+
+  for (;;)
+  {
+    cell = &q->cells[pos & (CRYPTO_QUEUE - 1)];
+    dif = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+    if (!dif)
+    {
+      if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (dif < 0)
+      return 0;
+    else
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  }
+
+  *job = cell->job;
+  sodium_memzero((void*)&cell->job, sizeof cell->job);
+  __atomic_store_n(&cell->seq, pos + CRYPTO_QUEUE, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+/// @brief runs the public key work of a job: opens the sealed key and nonce, or derives the kx session keys
+static void net_crypto_open(net_key_job_t *job)
+{
+  uint8_t client_pk[crypto_kx_PUBLICKEYBYTES];
+
+  job->start_ns = net_now_ns();
+  job->status = __SUCCESS__;
+  if (job->kind == NET_JOB_KX)
+  {
+    memcpy((void*)client_pk, job->keys.pk, sizeof client_pk);
+    job->status = secu_kx_server(job->keys.pk, job->keys.dec_key, job->key_tx, client_pk);
+  }
+  else if (secu_keypair_open(job->kp_id, job->keys.dec_key, job->c_key, ENCRYPTED_KEY_SIZE) ||
+           secu_keypair_open(job->kp_id, job->keys.dec_nonce, job->c_nonce, ENCRYPTED_NONCE_SIZE))
+    job->status = E_PHASE2_AUTH;
+  job->done_ns = net_now_ns();
+}
+
+
+/**
+ * @brief Crypto thread: opens the key frames of the handshakes and posts the results to their workers.
+ *
+ * Handshakes of clients already gone are not opened (req_pending_dropped), their result still goes
+ * back so that the worker keeps count of its jobs.
+ *
+ * @param args Unused.
+ * @return Never returns.
+ */
+static void *net_crypto_handler(void *args)
+{
+  net_key_job_t job;
+
+  (void)args;
+  for (;;)
+  {
+    if (sem_wait(&net_crypto_sem))
+      continue; // EINTR
+
+    // A unit means a job is queued, its cell may just not be published yet
+    while (!net_crypto_pop(&net_crypto_jobs, &job))
+      sched_yield();
+
+    if (req_pending_dropped(&job.pending))
+    {
+      job.start_ns = job.done_ns = net_now_ns();
+      job.status = E_KEY_EXCHANGE;
+      sodium_memzero((void*)&job.keys, sizeof job.keys);
+    }
+    else
+      net_crypto_open(&job);
+
+    // Never full: a worker has at most CRYPTO_QUEUE jobs out
+    while (!net_crypto_push(&net_crypto_done[job.pending.thread_index], &job))
+      sched_yield();
+    sodium_memzero((void*)&job, sizeof job);
+  }
+  return NULL;
+}
+
+
+/**
+ * @brief Allocates the crypto offload queues and starts the crypto threads (called once at startup).
+ *
+ * The cells hold the server secret key and the session keys in transit: they live in guarded,
+ * locked pages like the session key store.
+ *
+ * @return __SUCCESS__, or an error code if the queues cannot be allocated or a thread cannot start.
+ */
+errcode_t net_crypto_init(void)
+{
+  const size_t size = sizeof(net_crypto_cell_t) * CRYPTO_QUEUE;
+  net_crypto_queue_t *queues[SERVER_THREAD_NO + 1];
+  pthread_t thread;
+
+  if (!CRYPTO_THREAD_NO)
+    return __SUCCESS__;
+
+  queues[0] = &net_crypto_jobs;
+  for (size_t i = 0; i < SERVER_THREAD_NO; i++)
+    queues[i + 1] = &net_crypto_done[i];
+
+  for (size_t i = 0; i < SERVER_THREAD_NO + 1; i++)
+  {
+    if (!(queues[i]->cells = (net_crypto_cell_t *)sodium_malloc(size)))
+      return LOG(NET_LOG_PATH, EMALLOC_FAIL, EMALLOC_FAIL_M10);
+    sodium_memzero((void*)queues[i]->cells, size);
+    for (size_t j = 0; j < CRYPTO_QUEUE; j++)
+      queues[i]->cells[j].seq = j;
+  }
+
+  if (sem_init(&net_crypto_sem, 0, 0))
+    return LOG(NET_LOG_PATH, E_CRYPTO_POOL, E_CRYPTO_POOL_M);
+  for (size_t i = 0; i < CRYPTO_THREAD_NO; i++)
+  {
+    if (pthread_create(&thread, NULL, &net_crypto_handler, NULL) || pthread_detach(thread))
+      return LOG(NET_LOG_PATH, E_CRYPTO_POOL, E_CRYPTO_POOL_M);
+  }
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Hands the key frame of a handshake to the crypto threads (worker thread of the client).
+ *
+ * The client is not polled until the result is back: its next frames (the ping) need the session key.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param job Job to queue, its pending part is filled here.
+ * @return 1 if the job is queued, 0 if the worker has to open the boxes itself.
+ */
+static flag_t net_crypto_submit(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, net_key_job_t *job)
+{
+  net_crypto_stats_t *stats = &net_crypto_stats[thread_index];
+  size_t depth;
+
+  if (!CRYPTO_THREAD_NO || net_crypto_inflight[thread_index] == CRYPTO_QUEUE)
+    return 0;
+
+  job->pending.opcode = (job->kind == NET_JOB_KX) ? REQ_KX : REQ_RECV_K;
+  job->pending.thread_index = thread_index;
+  job->pending.client_index = client_index;
+  job->pending.fd = thread_arg->total_cli_fds[thread_index][client_index].fd;
+  job->pending.gen = thread_arg->total_cli_ctx[thread_index][client_index].gen;
+  job->submit_ns = net_now_ns();
+  if (!net_crypto_push(&net_crypto_jobs, job))
+    return 0;
+  sem_post(&net_crypto_sem);
+
+  net_crypto_inflight[thread_index]++;
+  thread_arg->total_cli_fds[thread_index][client_index].events = 0;
+  stats->submitted++;
+  depth = __atomic_load_n(&net_crypto_jobs.tail, __ATOMIC_RELAXED) - __atomic_load_n(&net_crypto_jobs.head, __ATOMIC_RELAXED);
+  if (depth > stats->depth_max)
+    stats->depth_max = depth;
+  return 1;
+}
+
+
+/**
+ * @brief Stores the session key opened from the key frame of a client (worker thread of the client).
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param job Opened job, its keys are wiped by the caller.
+ * @return __SUCCESS__, or E_PHASE2_AUTH if the boxes did not open or the database update failed.
+ */
+static errcode_t net_key_apply(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const net_key_job_t *job)
+{
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  const sockfd_t fd = thread_arg->total_cli_fds[thread_index][client_index].fd;
+
+  if (job->status)
+    goto __failure;
+
+  // Update connection authentication status flag
+  if (db_co_up_auth_stat_by_fd(thread_arg->db_connect, CO_FLAG_SENT_KEY, fd))
+    goto __failure;
+  ctx->auth_status = CO_FLAG_SENT_KEY;
+
+  // Keep the key in memory, the data path never reads it back from the database
+  // (both message counters restart with the key, the next frame and the ping are number 0)
+  secu_sess_set(thread_index, client_index, job->keys.dec_key, job->keys.dec_key, job->keys.dec_nonce,
+    (ctx->caps & PROTO_CAP_SEQNONCE) != 0, ctx->suite);
+  ctx->seq_rx = 0;
+  ctx->seq_tx = 0;
+#if (SESS_KEY_AUDIT)
+  if (db_co_up_key_by_fd(thread_arg->db_connect, job->keys.dec_key, job->keys.dec_nonce, fd))
+    goto __failure;
+#endif
+  return __SUCCESS__;
+__failure:
+  return LOG(NET_LOG_PATH, E_PHASE2_AUTH, E_PHASE2_AUTH_M);
+}
+
+
+/// @brief base nonce of the sessions whose keys are fresh (REQ_KX, REQ_RESUME): the counters do the rest
+static const uint8_t net_fresh_nonce[crypto_secretbox_NONCEBYTES];
+
+
+/**
+ * @brief Ends a handshake whose keys are fresh: sends the head of the answer followed by the first
+ * sealed message [MAC][sealed PING_HELLO] and authenticates the client with one database write.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param answer Head of the answer, with crypto_secretbox_MACBYTES + PING_HELLO_LEN bytes of room after it (wiped).
+ * @param head_len Length of the head.
+ * @return __SUCCESS__, or an error code if the seal, the send or the database update failed.
+ */
+static errcode_t net_fresh_auth(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint8_t *answer, size_t head_len)
+{
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  uint8_t *box = answer + head_len;
+  const size_t len = head_len + crypto_secretbox_MACBYTES + PING_HELLO_LEN;
+  errcode_t status;
+
+  status = secu_sess_seal(secu_sess_get(thread_index, client_index), ctx->seq_tx, box, (const uint8_t *)PING_HELLO, PING_HELLO_LEN);
+  if (!status)
+    status = sendall(thread_arg, thread_index, client_index, answer, len);
+  bzero((void*)answer, len);
+  if (status)
+    return status;
+  ctx->seq_tx++;
+
+  if ((status = db_co_up_auth_stat_by_fd(thread_arg->db_connect, CO_FLAG_AUTH, thread_arg->total_cli_fds[thread_index][client_index].fd)))
+    return status;
+  ctx->auth_status = CO_FLAG_AUTH;
+  thread_arg->total_cli_fds[thread_index][client_index].events = POLLIN;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Completes a one round trip handshake with the keys derived from the exchange (worker thread of the client).
+ *
+ * Sends [server ephemeral kx pk][hello answer][MAC][sealed PING_HELLO] and authenticates the client:
+ * one database write instead of the four of the legacy handshake.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param job Job of the exchange, its keys are wiped by the caller.
+ * @return __SUCCESS__, or E_KEY_EXCHANGE if the exchange, the answer or the database update failed.
+ */
+static errcode_t net_kx_apply(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const net_key_job_t *job)
+{
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  uint8_t answer[crypto_kx_PUBLICKEYBYTES + PROTO_ANSWER_MAX + crypto_secretbox_MACBYTES + PING_HELLO_LEN];
+
+  if (job->status)
+    return LOG(NET_LOG_PATH, E_KEY_EXCHANGE, E_KEY_EXCHANGE_M);
+
+  secu_sess_set(thread_index, client_index, job->keys.dec_key, job->key_tx, net_fresh_nonce, 1, ctx->suite);
+  ctx->seq_rx = 0;
+  ctx->seq_tx = 0;
+
+  memcpy((void*)answer, job->keys.pk, crypto_kx_PUBLICKEYBYTES);
+  memcpy((void*)(answer + crypto_kx_PUBLICKEYBYTES), job->answer, job->answer_len);
+  if (net_fresh_auth(thread_arg, thread_index, client_index, answer, crypto_kx_PUBLICKEYBYTES + job->answer_len))
+    return LOG(NET_LOG_PATH, E_KEY_EXCHANGE, E_KEY_EXCHANGE_M);
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Applies the handshakes opened by the crypto threads (called by the worker loop).
+ *
+ * The client is looked up by its socket and connection number (it may have moved to another slot
+ * or left), then polled again.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ */
+static void net_crypto_drain(thread_arg_t *thread_arg, size_t thread_index)
+{
+  net_crypto_stats_t *stats = &net_crypto_stats[thread_index];
+  pollfd_t *fds = thread_arg->total_cli_fds[thread_index];
+  net_key_job_t job;
+  uint64_t usec;
+  size_t ci, bucket;
+
+  while (net_crypto_inflight[thread_index] && net_crypto_pop(&net_crypto_done[thread_index], &job))
+  {
+    net_crypto_inflight[thread_index]--;
+    stats->ns_wait += job.start_ns - job.submit_ns;
+    stats->ns_run += job.done_ns - job.start_ns;
+
+    for (ci = 0; ci < CLIENTS_PER_THREAD && fds[ci].fd != FD_DISCO; ci++)
+      if (fds[ci].fd == job.pending.fd)
+        break;
+    if (ci == CLIENTS_PER_THREAD || fds[ci].fd != job.pending.fd ||
+        thread_arg->total_cli_ctx[thread_index][ci].gen != job.pending.gen)
+    {
+      stats->dropped++;
+      sodium_memzero((void*)&job, sizeof job);
+      continue;
+    }
+
+    fds[ci].events = POLLIN | POLLPRI; // still in the handshake (POLLIN alone once REQ_KX completes)
+    if ((job.kind == NET_JOB_KX) ? net_kx_apply(thread_arg, thread_index, ci, &job) : net_key_apply(thread_arg, thread_index, ci, &job))
+      stats->failed++;
+    stats->completed++;
+    for (usec = (net_now_ns() - job.submit_ns) / 1000UL, bucket = 0; usec && bucket < REQ_LAT_BUCKETS - 1; bucket++)
+      usec >>= 1;
+    stats->lat_hist[bucket]++;
+    sodium_memzero((void*)&job, sizeof job);
+  }
+}
+
+
+/**
+ * @brief Sums the crypto offload counters of all the workers (approximate snapshot).
+ *
+ * @param stats Output counters.
+ */
+void net_crypto_stats_get(net_crypto_stats_t *stats)
+{
+  bzero((void*)stats, sizeof *stats);
+  for (size_t i = 0; i < SERVER_THREAD_NO; i++)
+  {
+    stats->submitted += net_crypto_stats[i].submitted;
+    stats->inlined += net_crypto_stats[i].inlined;
+    stats->completed += net_crypto_stats[i].completed;
+    stats->dropped += net_crypto_stats[i].dropped;
+    stats->failed += net_crypto_stats[i].failed;
+    if (net_crypto_stats[i].depth_max > stats->depth_max)
+      stats->depth_max = net_crypto_stats[i].depth_max;
+    stats->ns_wait += net_crypto_stats[i].ns_wait;
+    stats->ns_run += net_crypto_stats[i].ns_run;
+    for (size_t b = 0; b < REQ_LAT_BUCKETS; b++)
+      stats->lat_hist[b] += net_crypto_stats[i].lat_hist[b];
+  }
+  stats->depth = __atomic_load_n(&net_crypto_jobs.tail, __ATOMIC_RELAXED) - __atomic_load_n(&net_crypto_jobs.head, __ATOMIC_RELAXED);
+}
+
 
 /**
  * @brief Handler for incoming client data (called by the additionally created threads).
@@ -732,8 +1477,15 @@ void *net_communication_handler(void *args)
   for (;;)
   {
     // Poll for events on client file descriptors
-    while (!(n_events = poll(thread_arg->total_cli_fds[thread_num], CLIENTS_PER_THREAD, COMM_POLL_TIMEOUT)))
-      continue;
+    // Replies completed by other threads go out between two polls
+    // (short polls while handshakes of the worker are in the crypto pool)
+    while (!(n_events = poll(thread_arg->total_cli_fds[thread_num], CLIENTS_PER_THREAD,
+                             net_crypto_inflight[thread_num] ? CRYPTO_POLL_TIMEOUT : COMM_POLL_TIMEOUT)))
+    {
+      net_crypto_drain(thread_arg, thread_num);
+      req_complete_drain(thread_arg, thread_num);
+      net_hb_tick(thread_arg, thread_num, net_now_ns());
+    }
     
     // Handle poll errors
     switch (n_events)
@@ -744,6 +1496,9 @@ void *net_communication_handler(void *args)
       continue;
     default:  // Incoming data
       net_check_clifds(thread_arg, thread_num);
+      net_crypto_drain(thread_arg, thread_num);
+      req_complete_drain(thread_arg, thread_num);
+      net_hb_tick(thread_arg, thread_num, net_now_ns());
     }
   }
   // This should never be reached, but pthread_exit is used for safety
@@ -779,166 +1534,90 @@ void *net_communication_handler(void *args)
 /**
  * @brief Sends the public key to the client. (First step of authentication)
  * 
- * This function retrieves the public key from the database and sends it to the client identified by the thread and client indices.
- * and updates the client co_auth_status from the database
+ * This function sends the public key of the newest generation held in guarded memory (secu_keypair_pk) to the client identified
+ * by the thread and client indices, followed by the hello answer if any, and updates the client co_auth_status from the database.
+ * The generation is remembered: the key frame of the client is opened with it even if the keypair rotates meanwhile.
+ * No key is read from the database.
  * 
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
  * @param client_index Index of the client.
- * @return __SUCCESS__ if the public key is sent successfully, or an error code if sending fails or retrieving the public key from the database fails.
+ * @param ext Hello answer appended to the key (NULL if none).
+ * @param ext_len Length of the hello answer.
+ * @return __SUCCESS__ if the public key is sent successfully, or an error code if sending it or recording the new status fails.
  */
-errcode_t net_send_pk(thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+errcode_t net_send_pk(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const void *ext, size_t ext_len)
 {
-  uint8_t pk[crypto_box_PUBLICKEYBYTES];
+  uint8_t pk[crypto_box_PUBLICKEYBYTES + PROTO_ANSWER_MAX];
   
-  // Retrieve the public key from the database
-  if (db_get_pk(thread_arg->db_connect, pk))
+  if (ext_len > sizeof pk - crypto_box_PUBLICKEYBYTES)
     return __FAILURE__;
+
+  // Newest generation of the keypair, followed by the hello answer
+  thread_arg->total_cli_ctx[thread_index][client_index].kp_id = secu_keypair_pk(pk);
+  if (ext_len)
+    memcpy((void*)(pk + crypto_box_PUBLICKEYBYTES), ext, ext_len);
   
   // Send the public key to the client
-  if (sendall(thread_arg, thread_index, client_index, pk, crypto_box_PUBLICKEYBYTES)){
-    bzero((void*)pk, crypto_box_PUBLICKEYBYTES);
+  if (sendall(thread_arg, thread_index, client_index, pk, crypto_box_PUBLICKEYBYTES + ext_len))
     return LOG(NET_LOG_PATH, E_SEND_PK, E_SEND_PK_M);
-  }
-
-  // Clear the public key from memory after sending
-  bzero((void*)pk, crypto_box_PUBLICKEYBYTES);
 
-  
   // Update client's connection authentication status in the database
   if (db_co_up_auth_stat_by_fd(thread_arg->db_connect, CO_FLAG_RECVD_PK, thread_arg->total_cli_fds[thread_index][client_index].fd))
     return LOG(NET_LOG_PATH, E_ALTER_CO_FLAG, E_ALTER_CO_FLAG_M);
+  thread_arg->total_cli_ctx[thread_index][client_index].auth_status = CO_FLAG_RECVD_PK;
   
   return __SUCCESS__;
 }
 
 
-/**
- * @brief Read and extract the encrypted key from a network request.
- * 
- * This function reads the length of the encrypted key from the request,
- * checks if it matches the expected size, and then extracts the encrypted key data.
- * 
- * @param req Pointer to the binary stream of data coming from the network.
- * @param keys Pointer to the `sec_keys_t` structure where the extracted key will be stored.
- * @param offset Pointer to a variable holding the current offset in the request stream.
- *               This will be updated to the new offset after processing the key.
- * @return An error code indicating success or failure of the operation.
- *         Possible error codes include EREQ_LEN if the length of the key is incorrect,
- *         and EREQ_LEN_M if there is an error reading the request.
- */
-static inline errcode_t read_enc_key(const void *req, sec_keys_t *keys, size_t *offset)
-{
-  uint32_t len_enc_key;
-  // Copy the length of the segment offset by 4 bytes that are used for the reqcode
-  if (!memcpy((void*)&len_enc_key, req + *offset, 4))
-    return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
-
-  // Check that the length of the data segment corresponds to the expected size
-  if (len_enc_key != ENCRYPTED_KEY_SIZE)
-    return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
-  
-  *offset += 4;
-
-  // Move the encrypted data offset by 8 bytes that are used for the reqcode and seglen
-  if (!memmove((void*)keys->enc_key, req + *offset, ENCRYPTED_KEY_SIZE))
-    return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
-  *offset += ENCRYPTED_KEY_SIZE;
-  return __SUCCESS__;
-}
-
-/**
- * @brief Read and extract the encrypted nonce from a network request.
- * 
- * This function reads the length of the encrypted nonce from the request,
- * checks if it matches the expected size, and then extracts the encrypted nonce data.
- * 
- * @param req Pointer to the binary stream of data coming from the network.
- * @param keys Pointer to the `sec_keys_t` structure where the extracted nonce will be stored.
- * @param offset Pointer to a variable holding the current offset in the request stream.
- *               This will be updated to the new offset after processing the nonce.
- * @return An error code indicating success or failure of the operation.
- *         Possible error codes include EREQ_LEN if the length of the nonce is incorrect,
- *         and EREQ_LEN_M if there is an error reading the request.
- */
-static inline errcode_t read_enc_nonce(const void *req, sec_keys_t *keys, size_t *offset)
-{
-  uint32_t len_enc_nonce;
-  // Copy the length of the segment going from offset 
-  if (!memcpy((void*)&len_enc_nonce, req + *offset, 4))
-    return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
-  
-  // Check that the length of the data segment corresponds to the expected size
-  if (len_enc_nonce != ENCRYPTED_NONCE_SIZE)
-    return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
-
-  *offset += 4;
-  // Move the encrypted nonce data
-  if (!memmove((void*)keys->enc_nonce, req + *offset, ENCRYPTED_NONCE_SIZE))
-    return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
-
-  *offset += ENCRYPTED_NONCE_SIZE;
-
-  return __SUCCESS__;
-}
-
-
 /**
  * @brief Receive the symmetric key generated by the client and decrypt it.
  * 
  * This function:
  *  1. Retrieves the symmetric key from the client socket.
- *  2. Decrypts it with the (pk, sk) key pair retrieved from the database.
+ *  2. Decrypts it with the generation of the (pk, sk) key pair the client was sent (secu_keypair_open), on a crypto thread
+ *     (net_crypto_submit) or right here if the pool is full or disabled.
  *  3. Updates the connection authentication status flag in the database.
- *  4. Updates the key in the database.
+ *  4. Stores the key in the session key store of the worker (and in the database if SESS_KEY_AUDIT is set).
  * 
- * @param req Binary stream of data coming from the network.
+ * Steps 3 and 4 run on the worker (net_key_apply), when the result of a crypto thread is drained.
+ * 
+ * @param frame Parsed request: seg[0] encrypted key, seg[1] encrypted nonce.
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
  * @param client_index Index of the client.
  * @return Error code indicating success or failure.
  */
-errcode_t net_recv_key(void *req, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+errcode_t net_recv_key(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
 {
-  sec_keys_t keys; // struct containing all the memory required to store the keys 
-  size_t offset = 4; // request stream offset starts allways at 4 as it is the req code provided in each data received an used by the request module
-  bzero((void*)&keys, sizeof keys);
-
-  /// parse the encrypted key from the request stream
-  if (read_enc_key(req, &keys, &offset))
-    goto __failure;
+  net_key_job_t job; // everything the opens need, copied out of the receive buffer
+  errcode_t status;
+  bzero((void*)&job, sizeof job);
 
-  /// parse the encrypted nonce from the request stream
-  if (read_enc_nonce(req, &keys, &offset))
-    goto __failure;
-
-  // Fetch asymmetric server keys from the database
-  if (db_get_pk_sk(thread_arg->db_connect, keys.pk, keys.sk))
-    goto __failure;
+  // Check that the segments correspond to the expected sizes
+  if (frame->seg[0].len != ENCRYPTED_KEY_SIZE || frame->seg[1].len != ENCRYPTED_NONCE_SIZE)
+    return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
 
-  // Decrypt the key
-  if (secu_asymmetric_decrypt(keys.pk, keys.sk, keys.dec_key, keys.enc_key, ENCRYPTED_KEY_SIZE))
-    goto __failure;
+  job.kp_id = thread_arg->total_cli_ctx[thread_index][client_index].kp_id;
+  memcpy((void*)job.c_key, frame->seg[0].ptr, ENCRYPTED_KEY_SIZE);
+  memcpy((void*)job.c_nonce, frame->seg[1].ptr, ENCRYPTED_NONCE_SIZE);
 
-  // Decrypt the nonce
-  if (secu_asymmetric_decrypt(keys.pk, keys.sk, keys.dec_nonce, keys.enc_nonce, ENCRYPTED_NONCE_SIZE))
-    goto __failure;
-
-  // Update connection authentication status flag
-  if (db_co_up_auth_stat_by_fd(thread_arg->db_connect, CO_FLAG_SENT_KEY, thread_arg->total_cli_fds[thread_index][client_index].fd))
-    goto __failure;
+  // Open the key and the nonce on a crypto thread, the worker keeps serving its other clients
+  if (net_crypto_submit(thread_arg, thread_index, client_index, &job))
+  {
+    sodium_memzero((void*)&job, sizeof job);
+    return __SUCCESS__;
+  }
 
-  // Update the key in the database
-  if (db_co_up_key_by_fd(thread_arg->db_connect, keys.dec_key, keys.dec_nonce, thread_arg->total_cli_fds[thread_index][client_index].fd))
-    goto __failure;
+  // Queue full or no crypto thread: opened right here
+  net_crypto_stats[thread_index].inlined++;
+  net_crypto_open(&job);
+  status = net_key_apply(thread_arg, thread_index, client_index, &job);
 
   // Reset all security memory to 0x0
-  bzero((void*)&keys, sizeof keys);
-  return __SUCCESS__;
-__failure:
-  // Reset all security memory to 0x0
-  bzero((void*)&keys, sizeof keys);
-  return LOG(NET_LOG_PATH, E_PHASE2_AUTH, E_PHASE2_AUTH_M);
+  sodium_memzero((void*)&job, sizeof job);
+  return status;
 }
 
 
@@ -946,8 +1625,8 @@ __failure:
  * @brief Sends an encrypted ping message to the client.
  * 
  * This function:
- *  1. Retrieves the connection object including the symmetric key from the database.
- *  2. Encrypts the ping message using the retrieved symmetric key.
+ *  1. Looks up the symmetric key in the session key store.
+ *  2. Encrypts the ping message using the symmetric key.
  *  3. Sends the encrypted ping message to the client.
  *  4. Updates the connection status in the database to indicate that the ping was sent.
  * 
@@ -958,79 +1637,192 @@ __failure:
  */
 errcode_t net_send_auth_ping(thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
 {
-  uint8_t key[crypto_secretbox_KEYBYTES];  // Encryption key retrieved from the database
-  uint8_t nonce[crypto_secretbox_NONCEBYTES];  // Nonce retrieved from the database
+  const sec_sess_t *sess;  // Session key of the client
   uint8_t c[crypto_secretbox_MACBYTES + PING_HELLO_LEN];  // Buffer for encrypted message
 
-  // Retrieve connection object including the symmetric key and nonce from the database
-  if (db_co_sel_key_by_fd(thread_arg->db_connect, key, nonce, thread_arg->total_cli_fds[thread_index][client_index].fd))
+  // Look up the symmetric key and nonce of the client
+  if (!(sess = secu_sess_get(thread_index, client_index)))
     goto __failure;
 
-  // Encrypt the ping message using the symmetric key and nonce
-  if (secu_symmetric_encrypt(key, nonce, c, PING_HELLO, PING_HELLO_LEN))
+  // Encrypt the ping message using the symmetric key and the nonce of the first sealed message
+  if (secu_sess_seal(sess, thread_arg->total_cli_ctx[thread_index][client_index].seq_tx, c, (const uint8_t *)PING_HELLO, PING_HELLO_LEN))
     goto __failure;
 
   // Send the encrypted ping message to the client
   if (sendall(thread_arg, thread_index, client_index, c, crypto_secretbox_MACBYTES + PING_HELLO_LEN))
     goto __failure;
+  thread_arg->total_cli_ctx[thread_index][client_index].seq_tx++;
 
   // Update connection status in the database to indicate that the ping was sent
   if (db_co_up_auth_stat_by_fd(thread_arg->db_connect, CO_FLAG_SENT_PING, thread_arg->total_cli_fds[thread_index][client_index].fd))
     goto __failure;
-
-  // Clear sensitive data from memory
-  bzero(key, crypto_secretbox_KEYBYTES);
-  bzero(nonce, crypto_secretbox_NONCEBYTES);
+  thread_arg->total_cli_ctx[thread_index][client_index].auth_status = CO_FLAG_SENT_PING;
 
   return __SUCCESS__;
   
 __failure:
-  // Clear sensitive data from memory in case of failure
-  bzero(key, crypto_secretbox_KEYBYTES);
-  bzero(nonce, crypto_secretbox_NONCEBYTES);
-
   // Return an error code indicating the failure
   return LOG(NET_LOG_PATH, E_SEND_PING, E_SEND_PING_M);
 }
 
 
+/**
+ * @brief One round trip handshake (REQ_KX): derives the session keys from the ephemeral key of the client
+ * and answers with the ephemeral key of the server, the hello answer and the first sealed message.
+ *
+ * The exchange runs on a crypto thread like the opens of REQ_RECV_K (or right here if the pool is
+ * full or disabled), the answer is sent by the worker (net_kx_apply).
+ *
+ * @param frame Parsed request: seg[0] ephemeral public key of the client.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param answer Hello answer sent after the key.
+ * @param answer_len Length of the hello answer.
+ * @return Error code indicating success or failure.
+ */
+errcode_t net_kx(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index,
+  const void *answer, size_t answer_len)
+{
+  net_key_job_t job;
+  errcode_t status;
+
+  if (answer_len > sizeof job.answer)
+    return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
+
+  bzero((void*)&job, sizeof job);
+  job.kind = NET_JOB_KX;
+  memcpy((void*)job.keys.pk, frame->seg[0].ptr, crypto_kx_PUBLICKEYBYTES);
+  memcpy((void*)job.answer, answer, answer_len);
+  job.answer_len = (uint32_t)answer_len;
+
+  if (net_crypto_submit(thread_arg, thread_index, client_index, &job))
+    return __SUCCESS__;
+
+  net_crypto_stats[thread_index].inlined++;
+  net_crypto_open(&job);
+  status = net_kx_apply(thread_arg, thread_index, client_index, &job);
+  sodium_memzero((void*)&job, sizeof job);
+  return status;
+}
+
+
+/**
+ * @brief Resumes a session from a ticket (REQ_RESUME): restores what the connection of the ticket
+ * agreed, derives fresh keys and answers with the random of the server and the first sealed message.
+ *
+ * Runs on the worker: a secretbox open and two hashes, nothing worth a crypto thread.
+ *
+ * @param frame Parsed request: seg[0] ticket, seg[1] random of the client.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return Error code indicating success or failure.
+ */
+errcode_t net_resume(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  uint8_t answer[SECU_RANDOM_LEN + crypto_secretbox_MACBYTES + PING_HELLO_LEN];
+  uint8_t key_rx[crypto_secretbox_KEYBYTES], key_tx[crypto_secretbox_KEYBYTES];
+  sec_ticket_t ticket;
+
+  if (secu_ticket_redeem(frame->seg[0].ptr, &ticket))
+    return E_TICKET;
+
+  // The connection picks up what the one of the ticket agreed, counter nonces included
+  ctx->proto_version = ticket.proto_version;
+  ctx->caps = ticket.caps | PROTO_CAP_SEQNONCE;
+  ctx->max_out = ticket.max_out;
+  ctx->suite = ticket.suite;
+  ctx->comp_codec = ticket.comp_codec;
+  ctx->comp_dict = ticket.comp_dict;
+
+  randombytes_buf(answer, SECU_RANDOM_LEN);
+  secu_ticket_keys(ticket.secret, frame->seg[1].ptr, answer, key_rx, key_tx);
+  secu_sess_set(thread_index, client_index, key_rx, key_tx, net_fresh_nonce, 1, ctx->suite);
+  sodium_memzero((void*)&ticket, sizeof ticket);
+  sodium_memzero((void*)key_rx, sizeof key_rx);
+  sodium_memzero((void*)key_tx, sizeof key_tx);
+  ctx->seq_rx = 0;
+  ctx->seq_tx = 0;
+
+  if (net_fresh_auth(thread_arg, thread_index, client_index, answer, SECU_RANDOM_LEN))
+    return LOG(NET_LOG_PATH, E_TICKET, E_TICKET_M);
+  return __SUCCESS__;
+}
+
+/**
+ * @brief Updates the key of the messages sent to the client (REQ_MODIF_SYMKEY), the announce is the
+ * last message sealed with the old key.
+ *
+ * Sends sealed [epoch][from][flags], from being the number of the next sealed message, then moves
+ * the key: no asymmetric crypto, no database and the connection goes on.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param flags REKEY_FLAG_REQUEST to have the client update its key too.
+ * @return Error code indicating success or failure.
+ */
+errcode_t net_rekey(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint32_t flags)
+{
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  const sec_sess_t *sess = secu_sess_get(thread_index, client_index);
+  uint8_t msg[REKEY_MSG_LEN];
+  const uint64_t from = ctx->seq_tx + 1;
+  uint32_t epoch;
+  resp_t resp;
+  errcode_t status;
+
+  if (!sess)
+    return E_SESS_KEY;
+
+  epoch = sess->epoch_tx + 1;
+  memcpy((void*)msg, &epoch, sizeof epoch);
+  memcpy((void*)(msg + 4), &from, sizeof from);
+  memcpy((void*)(msg + 12), &flags, sizeof flags);
+
+  if ((status = resp_begin(&resp, thread_arg, thread_index, client_index, REQ_MODIF_SYMKEY)))
+    return status;
+  if ((status = resp_append_raw(&resp, msg, sizeof msg)))
+  {
+    resp_abort(&resp);
+    return status;
+  }
+  if (resp_finalize(&resp))
+    return LOG(NET_LOG_PATH, E_REKEY, E_REKEY_M);
+
+  secu_sess_rekey_tx(thread_index, client_index);
+  ctx->rekey_bytes = 0;
+  ctx->rekey_ns = net_now_ns();
+  return __SUCCESS__;
+}
+
 
 /**
  * @brief Receives and processes an encrypted ping message.
  * 
  * This function:
  *  1. Receives a ping message from the network.
- *  2. Decrypts the message using the key retrieved from the connection table in the database.
+ *  2. Decrypts the message using the key of the session key store.
  *  3. Updates the connection authentication status flag in the database.
- *  4. Frees the data.
  * 
- * @param req Binary stream of data coming from the network.
+ * @param frame Parsed request: seg[0] encrypted ping (seglen covers the MAC).
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
  * @param client_index Index of the client.
  * @return Error code indicating success or failure.
  */
-errcode_t net_recv_auth_ping(void *req, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+errcode_t net_recv_auth_ping(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
 {
-  uint8_t key[crypto_secretbox_KEYBYTES];   // Encryption key retrieved from the database
-  uint8_t nonce[crypto_secretbox_NONCEBYTES];  // Nonce retrieved from the database
-  uint8_t m[PING_HELLO_LEN];   // Buffer for decrypted message
-  uint32_t seglen;   // Length of data segment
+  const uint8_t *m = frame->seg[0].ptr + crypto_secretbox_MACBYTES;   // decrypted in place, inside the receive buffer
  
-  // Check length of data segment: offset by 4 for reqcode
-  if (!memcpy((void*)&seglen, req + 4, 4))
-    return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
-  
-  // Ensure that the length of the data segment matches the expected length for a ping message
-  if (seglen != PING_HELLO_LEN)
+  // Ensure that the length of the data segment matches the expected length for an encrypted ping message
+  if (frame->seg[0].len != PING_HELLO_LEN + crypto_secretbox_MACBYTES)
     return LOG(NET_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
 
-  // Retrieve the encryption key and nonce associated with the client's file descriptor from the database
-  if (db_co_sel_key_by_fd(thread_arg->db_connect, key, nonce, thread_arg->total_cli_fds[thread_index][client_index].fd))
-    goto __failure;
-  
-  // Decrypt the received ping message
-  if (secu_symmetric_decrypt(key, nonce, m, req + 8, PING_HELLO_LEN + crypto_secretbox_MACBYTES))
+  // Decrypt the received ping message with the session key of the client
+  if (req_open(thread_index, client_index, frame->seg[0].ptr, PING_HELLO_LEN + crypto_secretbox_MACBYTES))
     goto __failure;
 
   // Check if the decrypted message matches the correct ping message
@@ -1040,6 +1832,7 @@ errcode_t net_recv_auth_ping(void *req, thread_arg_t *thread_arg, size_t thread_
   // Change connection authentication status in the database to indicate that the client is authenticated
   if (db_co_up_auth_stat_by_fd(thread_arg->db_connect, CO_FLAG_AUTH, thread_arg->total_cli_fds[thread_index][client_index].fd))
     goto __failure;
+  thread_arg->total_cli_ctx[thread_index][client_index].auth_status = CO_FLAG_AUTH;
 
   // Change the events for the client's file descriptor to POLLIN, indicating that the client is fully authenticated
   thread_arg->total_cli_fds[thread_index][client_index].events = POLLIN;
@@ -1048,9 +1841,6 @@ errcode_t net_recv_auth_ping(void *req, thread_arg_t *thread_arg, size_t thread_
 
 // Handling failure cases and cleanup
 __failure:
-  // Zero out sensitive information before returning if an error occurs during the process
-  bzero(key, crypto_secretbox_KEYBYTES);
-  bzero(nonce, crypto_secretbox_NONCEBYTES);
   // Return an error code indicating the failure
   return LOG(NET_LOG_PATH, E_INVALID_PING, E_INVALID_PING_M);
 }
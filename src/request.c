@@ -1,131 +1,741 @@
 #include "../include/request.h"
 
 //==========================================================================
-//                                NORMAL REQUESTS
+//                              DISPATCH TABLE
 //==========================================================================
 
+/// @brief dense dispatch table indexed by opcode (handler == NULL means unregistered)
+static req_entry_t req_table[REQ_TABLE_SIZE];
+
+/// @brief per thread statistics, every thread only writes its own row
+static req_stats_t req_stats[SERVER_THREAD_NO][REQ_TABLE_SIZE];
+
+/// @brief overload level of every thread (REQ_SHED_*)
+static uint8_t req_overload[SERVER_THREAD_NO];
+
+/// @brief reasons the dispatcher refuses a request (second index of the error templates)
+#define REQ_REJ_LEN         0
+#define REQ_REJ_NSEG        1
+#define REQ_REJ_AUTH        2
+#define REQ_REJ_CAPS        3
+#define REQ_REJ_INFLIGHT    4
+#define REQ_REJ_STREAM      5
+#define REQ_REJ_WINDOW      6
+#define REQ_REJ_REASONS     7
+
+/// @brief constant replies of the dispatcher, serialized once by req_init()
+static resp_tmpl_t req_tmpl_retry[REQ_TABLE_SIZE];                  // [REQ_RETRY][8][opcode][OVL_RETRY_MS]
+static resp_tmpl_t req_tmpl_error[REQ_TABLE_SIZE][REQ_REJ_REASONS]; // [REQ_ERROR][8][opcode][errcode]
+static resp_tmpl_t req_tmpl_heartbeat;                              // [REQ_HEARTBEAT][0]
+
+/// @brief request every thread is running (saved and restored around the handlers, envelopes nest)
+typedef struct ReqCurrent
+{
+  uint32_t flags;           // REQ_FLAG_* of the request
+  uint32_t id;
+  uint32_t stream;
+  flag_t   deferred;        // the handler called req_defer()
+  uint32_t opcode;
+  uint64_t deadline_ns;     // CLOCK_MONOTONIC deadline (inherited by the sub-requests), 0 if none
+  uint64_t seq;             // number of the top level frame since the session key (counter nonces)
+  uint32_t sub;             // index of the sub-request in its envelope + 1, 0 for the top level frame (not sealed on its own)
+}req_current_t;
+
+static req_current_t req_current[SERVER_THREAD_NO];
+
+/// @brief frame every thread received from the network, its bytes go back to the window of the
+/// connection once it completes (len is moved to the pending request if it is deferred)
+typedef struct ReqTop
+{
+  const uint8_t *raw;
+  uint32_t       len;
+}req_top_t;
+
+static req_top_t req_top[SERVER_THREAD_NO];
+
+/// @brief connections every worker lost recently (gen % REQ_CANCEL_SLOTS), read by any thread
+static uint32_t req_cancelled[SERVER_THREAD_NO][REQ_CANCEL_SLOTS];
+
+
+/**
+ * @brief Registers a request handler in the dispatch table.
+ *
+ * @param entry Registration entry (copied into the table).
+ * @return __SUCCESS__ if the entry is registered, EREQ_REGISTER if the opcode is out of range,
+ *         already taken or the entry is malformed.
+ */
+errcode_t req_register(const req_entry_t *entry)
+{
+  if (!entry || !entry->handler || entry->opcode >= REQ_TABLE_SIZE)
+    return LOG(REQ_LOG_PATH, EREQ_REGISTER, EREQ_REGISTER_M);
+
+  // The req code itself is always part of the request
+  if (entry->min_len < REQ_CODE_LEN || entry->max_len < entry->min_len)
+    return LOG(REQ_LOG_PATH, EREQ_REGISTER, EREQ_REGISTER_M);
+
+  if (entry->max_segs > REQ_MAX_SEGS || entry->max_segs < entry->min_segs || entry->shed_at > REQ_SHED_LOW)
+    return LOG(REQ_LOG_PATH, EREQ_REGISTER, EREQ_REGISTER_M);
+
+  if (req_table[entry->opcode].handler)
+    return LOG(REQ_LOG_PATH, EREQ_REGISTER, EREQ_REGISTER_M);
+
+  req_table[entry->opcode] = *entry;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Sums the statistics of an opcode across all the threads.
+ *
+ * The counters are written without locks by their owning thread so the snapshot is approximate.
+ *
+ * @param opcode Request code.
+ * @param stats Output statistics.
+ * @return __SUCCESS__, or EUNDEF_REQ_CODE if the opcode is out of range.
+ */
+errcode_t req_stats_get(uint32_t opcode, req_stats_t *stats)
+{
+  if (opcode >= REQ_TABLE_SIZE)
+    return EUNDEF_REQ_CODE;
+
+  bzero((void*)stats, sizeof *stats);
+  for (size_t i = 0; i < SERVER_THREAD_NO; i++)
+  {
+    stats->count    += req_stats[i][opcode].count;
+    stats->errors   += req_stats[i][opcode].errors;
+    stats->rejected += req_stats[i][opcode].rejected;
+    stats->shed     += req_stats[i][opcode].shed;
+    stats->expired  += req_stats[i][opcode].expired;
+    stats->cancelled += req_stats[i][opcode].cancelled;
+    stats->bytes    += req_stats[i][opcode].bytes;
+    for (size_t j = 0; j < REQ_LAT_BUCKETS; j++)
+      stats->lat_hist[j] += req_stats[i][opcode].lat_hist[j];
+  }
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Sets the overload level of a thread (called by the network module once per interval).
+ *
+ * @param thread_index Index of the thread.
+ * @param level REQ_SHED_NEVER when the thread keeps up, otherwise the highest class to shed.
+ */
+void req_overload_set(size_t thread_index, uint8_t level)
+{
+  req_overload[thread_index] = level;
+}
+
+
+/// @brief monotonic clock in nanoseconds
+static inline uint64_t req_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+
+/**
+ * @brief Tells whether the request the thread is running is past its deadline, and counts it if so.
+ *
+ * @param thread_index Index of the thread.
+ * @return 1 if the request is past its deadline, 0 otherwise.
+ */
+static inline flag_t req_expired(size_t thread_index)
+{
+  const req_current_t *cur = &req_current[thread_index];
+
+  if (!cur->deadline_ns || req_now_ns() < cur->deadline_ns)
+    return 0;
+  req_stats[thread_index][cur->opcode].expired++;
+  return 1;
+}
+
+
+/**
+ * @brief Get the histogram bucket of a latency.
+ *
+ * @param start Time before the handler ran.
+ * @param end Time after the handler ran.
+ * @return Index of the bucket (log2 of the latency in microseconds).
+ */
+static inline size_t req_lat_bucket(const struct timespec *start, const struct timespec *end)
+{
+  // tv_nsec wraps at every second: the difference is signed until the seconds are added back
+  const int64_t nsec = (int64_t)(end->tv_sec - start->tv_sec) * 1000000000L + (int64_t)(end->tv_nsec - start->tv_nsec);
+  uint64_t usec = (nsec > 0) ? (uint64_t)nsec / 1000UL : 0;
+  size_t bucket = 0;
+
+  while (usec && bucket < REQ_LAT_BUCKETS - 1)
+  {
+    usec >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+
+//==========================================================================
+//                            STREAMS & CREDITS
+//==========================================================================
+
+/**
+ * @brief Finds a stream of the connection.
+ *
+ * @param ctx State of the client.
+ * @param id Stream id (0 is not a stream).
+ * @param open Takes a free slot for the stream if it is not open yet.
+ * @return The stream, or NULL if it is not open (or if every slot is taken).
+ */
+static cli_stream_t *req_stream_get(cli_ctx_t *ctx, uint32_t id, flag_t open)
+{
+  cli_stream_t *free_slot = NULL;
+
+  if (!id)
+    return NULL;
+
+  for (size_t i = 0; i < STREAMS_PER_CONN; i++)
+  {
+    if (ctx->streams[i].id == id)
+      return &ctx->streams[i];
+    if (!ctx->streams[i].id && !free_slot)
+      free_slot = &ctx->streams[i];
+  }
+
+  if (!open || !free_slot)
+    return NULL;
+  free_slot->id = id;
+  return free_slot;
+}
+
+
 /**
- * @brief Sends the stream to the correct parsing function for the request code.
- * 
- * This function determines the type of request based on the request code and sends the stream to the corresponding parsing function.
- * 
- * @param req Binary stream of data coming from the network.
- * @param reqcode Code of the request.
+ * @brief Encrypts a payload with the session key and sends it on its own, tagged with the header fields of tag.
+ *
+ * Used for the messages sent outside the request they answer (completions, stream windows, the source):
+ * they never go into a response envelope the thread may be gathering for another request.
+ *
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
  * @param client_index Index of the client.
- * @return __SUCCESS__ if the request is processed successfully, or an error code if an undefined request code is encountered.
+ * @param tag Header fields of the message (REQ_FLAG_ID and REQ_FLAG_STREAM).
+ * @param code Code of the message.
+ * @param data Payload of the message.
+ * @param len Length of the payload (within the max frame the client announced).
+ * @return __SUCCESS__ if the message is sent, or an error code otherwise.
  */
-static inline errcode_t req_run(void *req, uint32_t reqcode, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+static errcode_t req_send_direct(thread_arg_t *thread_arg, size_t thread_index, size_t client_index,
+  const req_current_t *tag, uint32_t code, const void *data, uint32_t len)
 {
-  switch (reqcode)
+  resp_t resp;
+  errcode_t status;
+
+  if (!(status = resp_begin(&resp, thread_arg, thread_index, client_index, code)))
   {
-    // Add cases for specific request codes and call corresponding parsing functions
-    // case REQ_CODE_1:
-    //   return parse_req_code_1(req, thread_arg, thread_index, client_index);
-    // case REQ_CODE_2:
-    //   return parse_req_code_2(req, thread_arg, thread_index, client_index);
-    // Add more cases as needed
-    
-    default:
-      // Log an error for undefined request code
-      return LOG(REQ_LOG_PATH, EUNDEF_REQ_CODE, EUNDEF_REQ_CODE_M);
+    if (tag->flags & REQ_FLAG_ID)
+      resp_tag(&resp, tag->id);
+    if (tag->flags & REQ_FLAG_STREAM)
+      resp_stream(&resp, tag->stream);
+    if ((status = resp_append_raw(&resp, data, len)))
+      resp_abort(&resp);
+    else
+      status = resp_finalize(&resp);
   }
-  
-  return __SUCCESS__;
+  return status;
 }
 
 
+/**
+ * @brief Gives the bytes of a completed request back to the window of its stream.
+ *
+ * The client is told once half a window is given back, a closed stream is freed once
+ * its last request completes.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param id Stream id.
+ * @param len Bytes of the request.
+ */
+static void req_stream_credit(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint32_t id, uint32_t len)
+{
+  cli_stream_t *stream = req_stream_get(&thread_arg->total_cli_ctx[thread_index][client_index], id, 0);
+  const req_current_t tag = {REQ_FLAG_STREAM, 0, id, 0};
+  uint32_t increment;
+
+  if (!stream)
+    return;
+
+  stream->used -= len;
+  if (stream->closing)
+  {
+    if (!stream->used)
+      bzero((void*)stream, sizeof *stream);
+    return;
+  }
+
+  stream->unacked += len;
+  if (stream->unacked < STREAM_WINDOW / 2)
+    return;
+
+  increment = stream->unacked;
+  stream->unacked = 0;
+  req_send_direct(thread_arg, thread_index, client_index, &tag, REQ_STREAM_WINDOW, &increment, sizeof increment);
+}
+
 
 /**
- * @brief Handles the incoming stream of data from the socket.
- * 
- * This function processes the incoming stream of data received from the network module's recv() function.
- * 
- * @param req Stream of data coming from the network module recv().
+ * @brief Gives the bytes of a completed frame back to the window of the connection.
+ *
+ * Clients that negotiated PROTO_CAP_CREDIT are told once half a window is given back
+ * (as soon as they are authenticated, the message is sealed with the session key).
+ *
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
  * @param client_index Index of the client.
- * @return __SUCCESS__ if the request is handled successfully, EREQ_FAIL if an error occurs.
+ * @param len Bytes of the frame.
  */
-errcode_t req_handle(void *req, ssize_t len_req, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+static void req_conn_credit(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint32_t len)
 {
-  uint32_t reqcode;
-  if (len_req < 4)
-    return __FAILURE__;
-  memcpy((void*)&reqcode, req, 4); // Get request code
-  
-  // Run the request
-  if (req_run(req, reqcode, thread_arg, thread_index, client_index))
-    return EREQ_FAIL;
-  
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  const req_current_t tag = {0, 0, 0, 0};
+  uint32_t increment;
+
+  ctx->win_used -= len;
+  if (!(ctx->caps & PROTO_CAP_CREDIT))
+    return;
+
+  ctx->win_unacked += len;
+  if (ctx->win_unacked < CONN_WINDOW / 2 || ctx->auth_status != CO_FLAG_AUTH)
+    return;
+
+  increment = ctx->win_unacked;
+  ctx->win_unacked = 0;
+  req_send_direct(thread_arg, thread_index, client_index, &tag, REQ_STREAM_WINDOW, &increment, sizeof increment);
+}
+
+
+/**
+ * @brief Closes the stream of the header (REQ_STREAM_CLOSE).
+ *
+ * The stream is freed once its last request completes (this one included), later requests on it are refused.
+ *
+ * @param frame Parsed request: no segment.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__, or EREQ_STREAM if the request is not sent on a stream.
+ */
+static errcode_t req_stream_close(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  cli_stream_t *stream = req_stream_get(&thread_arg->total_cli_ctx[thread_index][client_index], frame->stream, 0);
+
+  if (!stream)
+    return LOG(REQ_LOG_PATH, EREQ_STREAM, EREQ_STREAM_M);
+  stream->closing = 1;
   return __SUCCESS__;
 }
 
 
 //==========================================================================
-//                            PRIORITY REQUESTS
+//                            RESPONSE ENVELOPES
+//==========================================================================
+
+/// @brief response envelope gathered by a thread while it runs the sub-requests of an envelope
+typedef struct ReqBatchOut
+{
+  resp_t  resp;                               // [REQ_BATCH][len1][reply1][len2][reply2]...
+  flag_t  active;
+}req_batch_out_t;
+
+static req_batch_out_t req_batch_out[SERVER_THREAD_NO];
+
+
+/**
+ * @brief Starts the response envelope of the thread with the REQ_BATCH code at its head.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__, or an error code if no buffer is available.
+ */
+static errcode_t req_batch_open(thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  req_batch_out_t *out = &req_batch_out[thread_index];
+  const uint32_t code = REQ_BATCH;
+  errcode_t status;
+
+  if ((status = resp_begin(&out->resp, thread_arg, thread_index, client_index, REQ_BATCH)))
+    return status;
+  return resp_append_raw(&out->resp, &code, REQ_CODE_LEN);
+}
+
+
+/**
+ * @brief Sends the response envelope gathered by the thread (if it holds any reply) and empties it.
+ *
+ * While the sub-requests are still running a new envelope is started right away.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__ if the envelope is sent or empty, or an error code otherwise.
+ */
+static errcode_t req_batch_flush(thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  req_batch_out_t *out = &req_batch_out[thread_index];
+  errcode_t status = __SUCCESS__;
+
+  if (out->resp.len > REQ_CODE_LEN)
+    status = resp_finalize(&out->resp);
+  else
+    resp_abort(&out->resp);
+
+  if (out->active && req_batch_open(thread_arg, thread_index, client_index) && !status)
+    status = ERESP_POOL;
+  return status;
+}
+
+
+/**
+ * @brief Appends a reply [code][id][stream][len][data] to the response envelope of the thread, flushed first if it is full.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param tag Header fields of the reply (REQ_FLAG_ID and REQ_FLAG_STREAM).
+ * @param code Code of the reply.
+ * @param data Payload of the reply.
+ * @param len Length of the payload.
+ * @return __SUCCESS__ if the reply is gathered, or an error code otherwise.
+ */
+static errcode_t req_batch_append(thread_arg_t *thread_arg, size_t thread_index, size_t client_index,
+  const req_current_t *tag, uint32_t code, const void *data, uint32_t len)
+{
+  req_batch_out_t *out = &req_batch_out[thread_index];
+  const uint32_t tagged = tag->flags & (REQ_FLAG_ID | REQ_FLAG_STREAM);
+  const uint32_t subcode = code | tagged;
+  uint32_t sublen = REQ_CODE_LEN + ((tagged & REQ_FLAG_ID) ? REQ_ID_LEN : 0) +
+                    ((tagged & REQ_FLAG_STREAM) ? REQ_STREAM_LEN : 0) + REQ_SEGLEN_LEN + len;
+  errcode_t status;
+
+  if (!out->resp.buf)
+    return ERESP_POOL;
+
+  // Flush the envelope if the reply does not fit anymore
+  if (out->resp.len + REQ_SEGLEN_LEN + sublen > out->resp.limit &&
+      (status = req_batch_flush(thread_arg, thread_index, client_index)))
+    return status;
+
+  resp_append_raw(&out->resp, &sublen, REQ_SEGLEN_LEN);
+  resp_append_raw(&out->resp, &subcode, REQ_CODE_LEN);
+  if (tagged & REQ_FLAG_ID)
+    resp_append_raw(&out->resp, &tag->id, REQ_ID_LEN);
+  if (tagged & REQ_FLAG_STREAM)
+    resp_append_raw(&out->resp, &tag->stream, REQ_STREAM_LEN);
+  return resp_append(&out->resp, data, len);
+}
+
+
+
+//==========================================================================
+//                                DISPATCHER
 //==========================================================================
 
 /**
- * @brief Sends the stream to the correct parsing function for the request code.
- * 
- * This function determines the type of request based on the request code and sends the stream to the corresponding parsing function.
- * 
- * @param req Binary stream of data coming from the network.
- * @param reqcode Code of the request.
+ * @brief Serializes the constant replies of the dispatcher (REQ_RETRY and REQ_ERROR of every opcode, REQ_HEARTBEAT).
+ */
+static void req_tmpl_init(void)
+{
+  static const errcode_t reject_err[REQ_REJ_REASONS] = {EREQ_LEN, EREQ_NSEG, EREQ_AUTH_STATE, EREQ_CAPS, EREQ_INFLIGHT, EREQ_STREAM, EREQ_WINDOW};
+  uint32_t payload[2];
+
+  resp_tmpl_build(&req_tmpl_heartbeat, REQ_HEARTBEAT, payload, 0);
+  for (uint32_t opcode = 0; opcode < REQ_TABLE_SIZE; opcode++)
+  {
+    payload[0] = opcode;
+    payload[1] = OVL_RETRY_MS;
+    resp_tmpl_build(&req_tmpl_retry[opcode], REQ_RETRY, payload, sizeof payload);
+
+    for (size_t reason = 0; reason < REQ_REJ_REASONS; reason++)
+    {
+      payload[1] = (uint32_t)reject_err[reason];
+      resp_tmpl_build(&req_tmpl_error[opcode][reason], REQ_ERROR, payload, sizeof payload);
+    }
+  }
+}
+
+
+/**
+ * @brief Answers a shed request with REQ_RETRY instead of running it.
+ *
+ * The reply is a template sent in clear: it costs one send() and no formatting, crypto or database work.
+ * It carries the id and the stream of the request if it has them.
+ *
+ * @param frame Request shed.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return EREQ_SHED, or the error of sendall().
+ */
+static errcode_t req_shed(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  const resp_tmpl_t *tmpl = &req_tmpl_retry[frame->reqcode];
+  errcode_t status;
+
+  req_stats[thread_index][frame->reqcode].shed++;
+  if (frame->flags & (REQ_FLAG_ID | REQ_FLAG_STREAM))
+    status = resp_tmpl_send_tagged(thread_arg, thread_index, client_index, tmpl, frame->flags, frame->id, frame->stream);
+  else
+    status = resp_tmpl_send(thread_arg, thread_index, client_index, tmpl);
+  if (status)
+    return status;
+  return EREQ_SHED;
+}
+
+
+/**
+ * @brief Answers a request refused by the dispatcher with REQ_ERROR and logs it.
+ *
+ * A sub-request of an envelope gets its REQ_ERROR in the response envelope, in order with the
+ * replies of the other sub-requests. Other requests get the template sent in clear, tagged with
+ * the id and the stream of the request if it carries them. Clients that
+ * sent no hello (version 0) keep the original format: nothing is sent to them.
+ *
+ * @param frame Request refused.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param reason REQ_REJ_* reason.
+ * @param err Error code logged.
+ * @param msg Error message logged.
+ * @return err.
+ */
+static errcode_t req_reject(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index,
+  size_t reason, errcode_t err, const char *msg)
+{
+  const resp_tmpl_t *tmpl = &req_tmpl_error[frame->reqcode][reason];
+  const req_current_t tag = {frame->flags, frame->id, frame->stream, 0};
+
+  req_stats[thread_index][frame->reqcode].rejected++;
+  if (!thread_arg->total_cli_ctx[thread_index][client_index].proto_version)
+    return LOG(REQ_LOG_PATH, err, msg);
+
+  if (req_batch_out[thread_index].active)
+    req_batch_append(thread_arg, thread_index, client_index, &tag, REQ_ERROR, tmpl->buf + REQ_CODE_LEN + REQ_SEGLEN_LEN,
+                     tmpl->len - REQ_CODE_LEN - REQ_SEGLEN_LEN);
+  else if (frame->flags & (REQ_FLAG_ID | REQ_FLAG_STREAM))
+    resp_tmpl_send_tagged(thread_arg, thread_index, client_index, tmpl, frame->flags, frame->id, frame->stream);
+  else
+    resp_tmpl_send(thread_arg, thread_index, client_index, tmpl);
+  return LOG(REQ_LOG_PATH, err, msg);
+}
+
+
+/**
+ * @brief Checks a request against its registration entry before it runs.
+ *
+ * Drops the request if it is past its deadline, checks the length, the number of segments, the authentication
+ * status and the capabilities of the client, then takes a place in flight for a request carrying an id. While the thread is overloaded
+ * the requests of the classes being shed get REQ_RETRY instead, refused requests get a REQ_ERROR
+ * telling the client why.
+ *
+ * @param frame Parsed request.
+ * @param entry Registration entry of the request.
+ * @param len Length of the request (header fields excluded).
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
  * @param client_index Index of the client.
- * @return __SUCCESS__ if the request is processed successfully, or an error code if an undefined request code is encountered.
+ * @return __SUCCESS__ if the request may run, or the error it was refused with.
  */
-static inline errcode_t req_pri_run(void *req, uint32_t reqcode, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+static inline errcode_t req_admit(const req_frame_t *frame, const req_entry_t *entry, size_t len,
+  thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
 {
-  switch (reqcode)
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+
+  // Nobody waits for the answer anymore: drop before any other work, without a reply
+  if (req_expired(thread_index))
+    return EREQ_DEADLINE;
+
+  // Shed before any other work
+  if (entry->shed_at != REQ_SHED_NEVER && entry->shed_at <= req_overload[thread_index])
+    return req_shed(frame, thread_arg, thread_index, client_index);
+
+  // Check the length of the whole request
+  if (len < entry->min_len || len > entry->max_len)
+    return req_reject(frame, thread_arg, thread_index, client_index, REQ_REJ_LEN, EREQ_LEN, EREQ_LEN_M);
+
+  // Check the number of segments
+  if (frame->nseg < entry->min_segs || frame->nseg > entry->max_segs)
+    return req_reject(frame, thread_arg, thread_index, client_index, REQ_REJ_NSEG, EREQ_NSEG, EREQ_NSEG_M);
+
+  // Check that the client is in the right authentication step
+  if (ctx->auth_status != entry->auth_state)
+    return req_reject(frame, thread_arg, thread_index, client_index, REQ_REJ_AUTH, EREQ_AUTH_STATE, EREQ_AUTH_STATE_M);
+
+  // Check that the client negotiated what the request needs
+  if ((entry->caps | ((frame->flags & REQ_FLAG_ID) ? PROTO_CAP_REQID : 0) |
+      ((frame->flags & REQ_FLAG_DEADLINE) ? PROTO_CAP_DEADLINE : 0)) & ~ctx->caps)
+    return req_reject(frame, thread_arg, thread_index, client_index, REQ_REJ_CAPS, EREQ_CAPS, EREQ_CAPS_M);
+
+  if (frame->flags & REQ_FLAG_ID)
   {
-    case REQ_SEND_ASYMKEY: 
-      // Send the public key to the client as a response to REQ_SEND_ASYMKEY request
-      net_send_pk(thread_arg, thread_index, client_index);
-      // Free the memory allocated for the request stream
-      free(req);
-      break;
-    case REQ_RECV_K:
-      // Receive and process the symmetric key from the client as a response to REQ_RECV_K request
-      net_recv_key(req, thread_arg, thread_index, client_index);
-      // Free the memory allocated for the request stream
-      free(req);
-      break;
-    case REQ_SEND_PING:
-      // Send a ping message to the client as a response to REQ_SEND_PING request
-      net_send_auth_ping(thread_arg, thread_index, client_index);
-      // Free the memory allocated for the request stream
-      free(req);
-      break;
-    case REQ_RECV_PING:
-      // Receive and process a ping message from the client as a response to REQ_RECV_PING request
-      net_recv_auth_ping(req, thread_arg, thread_index, client_index);
-      // Free the memory allocated for the request stream
-      free(req);
-      break;
-    case REQ_MODIF_SYMKEY:
-      // Currently no implementation for modifying the symmetric key
-      break;
-    default:
-      // Log an error for encountering an undefined request code
-      return LOG(REQ_LOG_PATH, EUNDEF_REQ_CODE, EUNDEF_REQ_CODE_M);
+    if (ctx->inflight >= REQ_INFLIGHT_MAX)
+      return req_reject(frame, thread_arg, thread_index, client_index, REQ_REJ_INFLIGHT, EREQ_INFLIGHT, EREQ_INFLIGHT_M);
+    ctx->inflight++;
   }
-  
   return __SUCCESS__;
 }
 
 
+/**
+ * @brief Sends the parsed frame to the handler registered for the request code.
+ *
+ * The request is checked first (req_admit) and the handler runs while the opcode statistics are gathered.
+ * A request carrying an id stays in flight until its handler returns, or until req_complete() if it was deferred,
+ * a request on a stream holds its bytes in the window of the stream for as long (refused requests give
+ * them back right away).
+ *
+ * @param frame Parsed request.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__ if the request is processed successfully, or an error code otherwise.
+ */
+static inline errcode_t req_run(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  const uint32_t reqcode = frame->reqcode;
+  const size_t len = frame->len - (frame->hdr_len - REQ_CODE_LEN);  // header fields do not count
+  const sockfd_t fd = thread_arg->total_cli_fds[thread_index][client_index].fd;
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  const req_entry_t *entry;
+  cli_stream_t *stream = NULL;
+  req_current_t saved;
+  req_stats_t *stats;
+  struct timespec start, end;
+  errcode_t status;
+  uint64_t deadline;
+  flag_t admitted;
+
+  if (reqcode >= REQ_TABLE_SIZE || !req_table[reqcode].handler)
+    // Log an error for undefined request code
+    return LOG(REQ_LOG_PATH, EUNDEF_REQ_CODE, EUNDEF_REQ_CODE_M);
+
+  entry = &req_table[reqcode];
+  stats = &req_stats[thread_index][reqcode];
+
+  // The request takes its bytes from the window of its stream (opened by its first request)
+  if (frame->flags & REQ_FLAG_STREAM)
+  {
+    if (!(ctx->caps & PROTO_CAP_STREAMS))
+      return req_reject(frame, thread_arg, thread_index, client_index, REQ_REJ_CAPS, EREQ_CAPS, EREQ_CAPS_M);
+    if (!(stream = req_stream_get(ctx, frame->stream, 1)) || stream->closing)
+      return req_reject(frame, thread_arg, thread_index, client_index, REQ_REJ_STREAM, EREQ_STREAM, EREQ_STREAM_M);
+    if (stream->used + stream->unacked + len > STREAM_WINDOW)
+      return req_reject(frame, thread_arg, thread_index, client_index, REQ_REJ_WINDOW, EREQ_WINDOW, EREQ_WINDOW_M);
+    stream->used += (uint32_t)len;
+  }
+
+  saved = req_current[thread_index];
+  req_current[thread_index].flags = frame->flags;
+  req_current[thread_index].id = frame->id;
+  req_current[thread_index].stream = frame->stream;
+  req_current[thread_index].deferred = 0;
+  req_current[thread_index].opcode = reqcode;
+  if ((frame->flags & REQ_FLAG_DEADLINE) && (ctx->caps & PROTO_CAP_DEADLINE))
+  {
+    // The budget runs from the moment the client was found ready, the tightest deadline wins
+    deadline = (ctx->ready_ns ? ctx->ready_ns : req_now_ns()) + (uint64_t)frame->budget_ms * 1000000UL;
+    if (!saved.deadline_ns || deadline < saved.deadline_ns)
+      req_current[thread_index].deadline_ns = deadline;
+  }
+
+  if ((admitted = !(status = req_admit(frame, entry, len, thread_arg, thread_index, client_index))))
+  {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = entry->handler(frame, thread_arg, thread_index, client_index);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    stats->count++;
+    stats->bytes += len;
+    stats->lat_hist[req_lat_bucket(&start, &end)]++;
+    if (status)
+      stats->errors++;
+  }
+
+  // The slot holds another client if this one left while the handler ran
+  if (!req_current[thread_index].deferred && thread_arg->total_cli_fds[thread_index][client_index].fd == fd)
+  {
+    if (admitted && (frame->flags & REQ_FLAG_ID) && ctx->inflight)
+      ctx->inflight--;
+    if (stream)
+      req_stream_credit(thread_arg, thread_index, client_index, frame->stream, (uint32_t)len);
+  }
+  req_current[thread_index] = saved;
+  return status;
+}
+
+
+/**
+ * @brief Handles the incoming stream of data from the socket.
+ *
+ * This function processes the incoming stream of data received from the network module's recv() function.
+ * The stream is parsed once into segment views that point inside the receive buffer.
+ * Its bytes are taken from the window of the connection until the request completes, a client
+ * sending past its window gets the frame dropped.
+ *
+ * @param req Stream of data coming from the network module recv().
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__ if the request is handled successfully, EREQ_FAIL if an error occurs.
+ */
+errcode_t req_handle(void *req, ssize_t len_req, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  const sockfd_t fd = thread_arg->total_cli_fds[thread_index][client_index].fd;
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  req_top_t *top = &req_top[thread_index];
+  req_frame_t frame;
+  errcode_t status;
+  if (len_req < REQ_CODE_LEN)
+    return __FAILURE__;
+
+  // Every frame takes the next nonce of the client, refused or not
+  req_current[thread_index].seq = ctx->seq_rx++;
+  req_current[thread_index].sub = 0;
+  ctx->rekey_bytes += (uint64_t)len_req;
+
+  if ((size_t)ctx->win_used + ctx->win_unacked + (size_t)len_req > CONN_WINDOW)
+    return LOG(REQ_LOG_PATH, EREQ_WINDOW, EREQ_WINDOW_M);
+  ctx->win_used += (uint32_t)len_req;
+  top->raw = (const uint8_t *)req;
+  top->len = (uint32_t)len_req;
+
+  // Parse the request code and the segments, then run the request
+  if ((status = req_parse(req, (size_t)len_req, &frame)))
+  {
+    LOG(REQ_LOG_PATH, status, (status == EREQ_NSEG) ? EREQ_NSEG_M : (status == EREQ_FLAGS) ? EREQ_FLAGS_M : EREQ_LEN_M);
+  }
+  else if (req_run(&frame, thread_arg, thread_index, client_index))
+    status = EREQ_FAIL;
+
+  // Give the bytes back unless the request was deferred (or the client left)
+  if (top->len && thread_arg->total_cli_fds[thread_index][client_index].fd == fd)
+    req_conn_credit(thread_arg, thread_index, client_index, top->len);
+  top->raw = NULL;
+  top->len = 0;
+  return status;
+}
 
 
 /**
  * @brief Handles priority data for client authentication.
- * 
+ *
  * This function processes priority data received from the network module's recv().
- * 
+ * Priority and normal requests share the dispatch table, the authentication status
+ * registered with each opcode decides which ones a client may send.
+ *
  * @param req Stream of data coming from the network module recv().
  * @param thread_arg Pointer to the thread_arg_t structure.
  * @param thread_index Index of the thread.
@@ -134,14 +744,1131 @@ static inline errcode_t req_pri_run(void *req, uint32_t reqcode, thread_arg_t *t
  */
 errcode_t req_pri_handle(void *req, ssize_t len_req, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
 {
-  uint32_t reqcode;
-  if (len_req < 4)
-    return __FAILURE__;
-  memcpy((void*)&reqcode, req, 4); // Get request code
-  
-  // Run the request
-  if (req_pri_run(req, reqcode, thread_arg, thread_index, client_index))
+  return req_handle(req, len_req, thread_arg, thread_index, client_index);
+}
+
+
+//==========================================================================
+//                          REPLIES & ENVELOPES
+//==========================================================================
+
+/**
+ * @brief Decrypts in place a sealed segment of the request being run with the session key of the client.
+ *
+ * The plaintext overwrites the cipher inside the receive buffer, right after the MAC
+ * (seg + crypto_secretbox_MACBYTES, len - crypto_secretbox_MACBYTES bytes): the handler wipes it once done.
+ * The nonce is the one of the frame when the client negotiated PROTO_CAP_SEQNONCE. The segments of a
+ * sub-request are not sealed on their own, the envelope is: they come as [unused MAC slot][plaintext].
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param seg Sealed segment [MAC][cipher].
+ * @param len Length of the segment (>= crypto_secretbox_MACBYTES).
+ * @return __SUCCESS__, EREQ_FAIL if the client has no session key, or E_SYMM_DECRYPT.
+ */
+errcode_t req_open(size_t thread_index, size_t client_index, uint8_t *seg, size_t len)
+{
+  const sec_sess_t *sess;
+
+  // Inside an envelope the segment was sealed with the whole inner frame: already plaintext
+  if (req_current[thread_index].sub)
+    return __SUCCESS__;
+
+  if (!(sess = secu_sess_get(thread_index, client_index)))
     return EREQ_FAIL;
-  
+  if (secu_sess_open(sess, req_current[thread_index].seq, 0, seg, len))
+    return E_SYMM_DECRYPT;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Encrypts a payload and sends it as [code][seglen][secretbox(payload)].
+ *
+ * The payload is compressed first when the connection negotiated a codec, the message carries the
+ * id and the stream of the request being run if it has them.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param code Code of the message.
+ * @param m Plaintext payload.
+ * @param mlen Length of the payload (within the max frame the client announced).
+ * @return __SUCCESS__ if the message is sent, or an error code otherwise.
+ */
+static errcode_t req_send_sealed(thread_arg_t *thread_arg, size_t thread_index, size_t client_index,
+  uint32_t code, const void *m, uint32_t mlen)
+{
+  resp_t resp;
+  errcode_t status;
+
+  if ((status = resp_begin(&resp, thread_arg, thread_index, client_index, code)))
+    return status;
+  if (req_current[thread_index].flags & REQ_FLAG_ID)
+    resp_tag(&resp, req_current[thread_index].id);
+  if (req_current[thread_index].flags & REQ_FLAG_STREAM)
+    resp_stream(&resp, req_current[thread_index].stream);
+
+  if ((status = resp_append_raw(&resp, m, mlen)))
+  {
+    resp_abort(&resp);
+    return status;
+  }
+  return resp_finalize(&resp);
+}
+
+
+/**
+ * @brief Sends a reply to an authenticated client.
+ *
+ * While a request envelope is being processed the reply [code][len][data] is appended to the
+ * response envelope of the thread (flushed when full and once all the sub-requests ran),
+ * otherwise it is encrypted with the session key and sent as [code][len][secretbox(data)].
+ * Replies to a request carrying an id or sent on a stream carry them too: [code | flags][id][stream][len][data].
+ * The reply of a request past its deadline is dropped.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param code Code of the reply.
+ * @param data Payload of the reply.
+ * @param len Length of the payload (<= REQ_REPLY_MAX and within the max frame the client announced).
+ * @return __SUCCESS__ if the reply is queued or sent, EREQ_DEADLINE if it is dropped, or an error code otherwise.
+ */
+errcode_t req_reply(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint32_t code, const void *data, uint32_t len)
+{
+  const uint32_t max_out = thread_arg->total_cli_ctx[thread_index][client_index].max_out;
+  const req_current_t *cur = &req_current[thread_index];
+  const uint32_t tagged = cur->flags & (REQ_FLAG_ID | REQ_FLAG_STREAM);
+  const uint32_t sublen = REQ_CODE_LEN + ((tagged & REQ_FLAG_ID) ? REQ_ID_LEN : 0) +
+                          ((tagged & REQ_FLAG_STREAM) ? REQ_STREAM_LEN : 0) + REQ_SEGLEN_LEN + len;
+
+  // Past the deadline the session key is not looked up and nothing is encrypted
+  if (req_expired(thread_index))
+    return EREQ_DEADLINE;
+
+  // The reply must fit in an envelope the client accepts (max frame of its hello)
+  if (len > REQ_REPLY_MAX || REQ_CODE_LEN + REQ_SEGLEN_LEN + sublen > max_out)
+    return LOG(REQ_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
+
+  if (req_batch_out[thread_index].active)
+    return req_batch_append(thread_arg, thread_index, client_index, cur, code, data, len);
+
+  return req_send_sealed(thread_arg, thread_index, client_index, code, data, len);
+}
+
+
+/**
+ * @brief Runs the sub-requests carried by a request envelope (REQ_BATCH).
+ *
+ * This function:
+ *  1. Decrypts (and decompresses) the inner frame and parses the sub-requests out of it.
+ *  2. Runs every sub-request through the normal dispatcher (a failing sub-request does not stop the others).
+ *  3. Sends the gathered replies back as one encrypted response envelope.
+ *
+ * @param frame Parsed request: seg[0] encrypted inner frame.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__ if the envelope is processed, or an error code otherwise.
+ */
+static errcode_t req_batch(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  req_batch_out_t *out = &req_batch_out[thread_index];
+  uint8_t *m = frame->seg[0].ptr + crypto_secretbox_MACBYTES;  // decrypted in place
+  uint8_t plain[REQ_PLAIN_MAX];
+  const uint8_t *inner_ptr = m;
+  size_t inner_len = frame->seg[0].len - crypto_secretbox_MACBYTES;
+  const size_t mlen = inner_len;
+  const cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  req_frame_t inner, sub;
+  errcode_t status = __SUCCESS__;
+
+  if (frame->seg[0].len < crypto_secretbox_MACBYTES + REQ_CODE_LEN)
+    return LOG(REQ_LOG_PATH, EREQ_BATCH, EREQ_BATCH_M);
+
+  if ((status = req_open(thread_index, client_index, frame->seg[0].ptr, frame->seg[0].len)))
+    goto __cleanup;
+
+  if (ctx->comp_codec != COMP_NONE &&
+      comp_unpack(ctx, thread_index, m, inner_len, plain, sizeof plain, &inner_ptr, &inner_len))
+  {
+    status = LOG(REQ_LOG_PATH, ECOMP_DATA, ECOMP_DATA_M);
+    goto __cleanup;
+  }
+
+  if (req_parse((void *)inner_ptr, inner_len, &inner) || inner.reqcode != REQ_BATCH)
+  {
+    status = LOG(REQ_LOG_PATH, EREQ_BATCH, EREQ_BATCH_M);
+    goto __cleanup;
+  }
+
+  if ((status = req_batch_open(thread_arg, thread_index, client_index)))
+    goto __cleanup;
+  out->active = 1;
+
+  for (uint32_t i = 0; i < inner.nseg; i++)
+  {
+    if (req_parse(inner.seg[i].ptr, inner.seg[i].len, &sub) || sub.reqcode == REQ_BATCH)
+    {
+      LOG(REQ_LOG_PATH, EREQ_BATCH, EREQ_BATCH_M);
+      continue;
+    }
+    req_current[thread_index].sub = i + 1;  // its segments are plaintext (req_open)
+    req_run(&sub, thread_arg, thread_index, client_index);
+  }
+
+  out->active = 0;
+  status = req_batch_flush(thread_arg, thread_index, client_index);
+
+__cleanup:
+  out->active = 0;
+  resp_abort(&out->resp);
+  bzero((void*)m, mlen);
+  bzero((void*)plain, sizeof plain);
+  return status;
+}
+
+
+//==========================================================================
+//                         OUT OF ORDER COMPLETION
+//==========================================================================
+
+/// @brief reply posted to a worker by another thread
+typedef struct ReqCompletion
+{
+  req_pending_t pending;
+  uint32_t      code;
+  uint32_t      len;
+  uint8_t       data[REQ_REPLY_MAX];
+}req_completion_t;
+
+/// @brief completions waiting for their worker (ring protected by the mutex of the worker)
+typedef struct ReqCompleteQueue
+{
+  pthread_mutex_t  lock;
+  size_t           head;
+  size_t           count;     // written under the lock with atomic stores, peeked at without it by the worker
+  req_completion_t ring[REQ_COMPLETE_QUEUE];
+}req_complete_queue_t;
+
+static req_complete_queue_t req_complete_queue[SERVER_THREAD_NO];
+
+
+/**
+ * @brief Marks the running request as completing later, out of order.
+ *
+ * Called by a handler that cannot answer right away: the request stays in flight and the
+ * next requests of the connection run without waiting for it.
+ *
+ * @param frame Request being run.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param pending Filled with what req_complete needs.
+ * @return __SUCCESS__, or EREQ_DEFER if the request carries no id.
+ */
+errcode_t req_defer(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index, req_pending_t *pending)
+{
+  if (!(frame->flags & REQ_FLAG_ID))
+    return LOG(REQ_LOG_PATH, EREQ_DEFER, EREQ_DEFER_M);
+
+  req_current[thread_index].deferred = 1;
+  pending->id = frame->id;
+  pending->opcode = frame->reqcode;
+  pending->stream = frame->stream;
+  pending->len = (uint32_t)(frame->len - (frame->hdr_len - REQ_CODE_LEN));
+  pending->conn_len = 0;
+  if (frame->raw == req_top[thread_index].raw)
+  {
+    // The frame received from the network keeps holding the window of the connection
+    pending->conn_len = req_top[thread_index].len;
+    req_top[thread_index].len = 0;
+  }
+  pending->thread_index = thread_index;
+  pending->client_index = client_index;
+  pending->fd = thread_arg->total_cli_fds[thread_index][client_index].fd;
+  pending->gen = thread_arg->total_cli_ctx[thread_index][client_index].gen;
+  pending->deadline_ns = req_current[thread_index].deadline_ns;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Sends the reply of a deferred request tagged with its id (worker thread of the client only).
+ *
+ * The client may have moved to another slot of the worker since (disconnections compact the
+ * slots), it is looked up by its socket. The reply is dropped if the client left or if the request
+ * is past its deadline (both counted). The bytes of the request go back to the windows of its stream
+ * and of the connection. Code 0 completes the request without a reply (counted as expired past its
+ * deadline, cancelled otherwise).
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param pending Request completed.
+ * @param code Code of the reply.
+ * @param data Payload of the reply.
+ * @param len Length of the payload.
+ * @return __SUCCESS__ if the reply is sent or the client left, EREQ_DEADLINE if it is dropped, or an error code otherwise.
+ */
+errcode_t req_complete(thread_arg_t *thread_arg, const req_pending_t *pending, uint32_t code, const void *data, uint32_t len)
+{
+  const size_t ti = pending->thread_index;
+  size_t ci = pending->client_index;
+  const req_current_t tag = {REQ_FLAG_ID | (pending->stream ? REQ_FLAG_STREAM : 0), pending->id, pending->stream, 0};
+  cli_ctx_t *ctx;
+
+  if (thread_arg->total_cli_fds[ti][ci].fd != pending->fd)
+  {
+    for (ci = 0; ci < CLIENTS_PER_THREAD && thread_arg->total_cli_fds[ti][ci].fd != FD_DISCO; ci++)
+      if (thread_arg->total_cli_fds[ti][ci].fd == pending->fd)
+        break;
+    if (ci == CLIENTS_PER_THREAD || thread_arg->total_cli_fds[ti][ci].fd != pending->fd)
+      ci = CLIENTS_PER_THREAD;
+  }
+
+  // Gone, or its socket number reused by a later connection
+  if (ci == CLIENTS_PER_THREAD || thread_arg->total_cli_ctx[ti][ci].gen != pending->gen)
+  {
+    req_stats[ti][pending->opcode].cancelled++;
+    return __SUCCESS__;
+  }
+
+  ctx = &thread_arg->total_cli_ctx[ti][ci];
+  if (ctx->inflight)
+    ctx->inflight--;
+  if (pending->stream)
+    req_stream_credit(thread_arg, ti, ci, pending->stream, pending->len);
+  if (pending->conn_len)
+    req_conn_credit(thread_arg, ti, ci, pending->conn_len);
+
+  // Deferred work found dropped (req_pending_dropped) completes without a reply, counted by the reason it was dropped
+  if (!code)
+  {
+    if (pending->deadline_ns && req_now_ns() >= pending->deadline_ns)
+      req_stats[ti][pending->opcode].expired++;
+    else
+      req_stats[ti][pending->opcode].cancelled++;
+    return __SUCCESS__;
+  }
+
+  if (pending->deadline_ns && req_now_ns() >= pending->deadline_ns)
+  {
+    req_stats[ti][pending->opcode].expired++;
+    return EREQ_DEADLINE;
+  }
+
+  return req_send_direct(thread_arg, ti, ci, &tag, code, data, len);
+}
+
+
+/**
+ * @brief Hands the reply of a deferred request to its worker thread (callable from any thread).
+ *
+ * @param pending Request completed.
+ * @param code Code of the reply.
+ * @param data Payload of the reply.
+ * @param len Length of the payload (<= REQ_REPLY_MAX).
+ * @return __SUCCESS__, or EREQ_INFLIGHT if the completion queue of the worker is full.
+ */
+errcode_t req_complete_post(const req_pending_t *pending, uint32_t code, const void *data, uint32_t len)
+{
+  req_complete_queue_t *queue = &req_complete_queue[pending->thread_index];
+  req_completion_t *slot;
+
+  if (len > REQ_REPLY_MAX)
+    return LOG(REQ_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count == REQ_COMPLETE_QUEUE)
+  {
+    pthread_mutex_unlock(&queue->lock);
+    return LOG(REQ_LOG_PATH, EREQ_INFLIGHT, EREQ_INFLIGHT_M);
+  }
+  slot = &queue->ring[(queue->head + queue->count) % REQ_COMPLETE_QUEUE];
+  slot->pending = *pending;
+  slot->code = code;
+  slot->len = len;
+  if (len)
+    memcpy((void*)slot->data, data, len);
+  __atomic_store_n(&queue->count, queue->count + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&queue->lock);
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Sends the replies posted to the worker by other threads (called by the worker loop).
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ */
+void req_complete_drain(thread_arg_t *thread_arg, size_t thread_index)
+{
+  req_complete_queue_t *queue = &req_complete_queue[thread_index];
+  req_completion_t done;
+
+  // Unlocked peek: a completion posted meanwhile is picked up on the next call
+  while (__atomic_load_n(&queue->count, __ATOMIC_ACQUIRE))
+  {
+    pthread_mutex_lock(&queue->lock);
+    done = queue->ring[queue->head];
+    queue->head = (queue->head + 1) % REQ_COMPLETE_QUEUE;
+    __atomic_store_n(&queue->count, queue->count - 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&queue->lock);
+
+    req_complete(thread_arg, &done.pending, done.code, done.data, done.len);
+    bzero((void*)done.data, done.len);
+  }
+}
+
+
+/**
+ * @brief Tells deferred work whether it is still worth running (callable from any thread).
+ *
+ * Work found dropped is completed without a reply: req_complete_post(pending, 0, NULL, 0).
+ *
+ * @param pending Deferred request.
+ * @return 1 if the request is past its deadline or its client left, 0 otherwise.
+ */
+flag_t req_pending_dropped(const req_pending_t *pending)
+{
+  if (__atomic_load_n(&req_cancelled[pending->thread_index][pending->gen % REQ_CANCEL_SLOTS], __ATOMIC_RELAXED) == pending->gen)
+    return 1;
+  return pending->deadline_ns && req_now_ns() >= pending->deadline_ns;
+}
+
+
+/**
+ * @brief Cancels the deferred work of a client (called on disconnection, worker thread of the client).
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ */
+void req_cancel(thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  const uint32_t gen = thread_arg->total_cli_ctx[thread_index][client_index].gen;
+
+  __atomic_store_n(&req_cancelled[thread_index][gen % REQ_CANCEL_SLOTS], gen, __ATOMIC_RELAXED);
+}
+
+
+//==========================================================================
+//                           CHUNKED TRANSFERS
+//==========================================================================
+
+/// @brief state of a chunked transfer, allocated between REQ_XFER_OPEN and REQ_XFER_END (holds no secret)
+typedef struct ReqXfer
+{
+  const req_xfer_ops_t *ops;
+  void     *priv;                              // consumer's own state
+  uint64_t  size;                              // announced size of the payload
+  uint64_t  recvd;                             // bytes handed to the consumer so far
+  uint32_t  seq;                               // next expected chunk
+}req_xfer_t;
+
+static const req_xfer_ops_t *req_xfer_types[REQ_XFER_TYPES];
+
+
+/**
+ * @brief Registers the consumer of a chunked transfer type (called at startup before the threads run).
+ *
+ * @param type Transfer type sent by the client in REQ_XFER_OPEN.
+ * @param ops Consumer callbacks (must stay valid while the server runs).
+ * @return __SUCCESS__, or EREQ_REGISTER if the type is out of range or already taken.
+ */
+errcode_t req_xfer_register(uint32_t type, const req_xfer_ops_t *ops)
+{
+  if (type >= REQ_XFER_TYPES || !ops || !ops->on_chunk || req_xfer_types[type])
+    return LOG(REQ_LOG_PATH, EREQ_REGISTER, EREQ_REGISTER_M);
+
+  req_xfer_types[type] = ops;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Ends the chunked transfer of a client and releases its state.
+ *
+ * @param ctx State of the client.
+ * @param complete 1 if the whole payload was received, 0 if the transfer is aborted.
+ */
+static void req_xfer_close(cli_ctx_t *ctx, flag_t complete)
+{
+  req_xfer_t *xfer = (req_xfer_t *)ctx->xfer;
+
+  if (!xfer)
+    return;
+  if (xfer->ops->on_end)
+    xfer->ops->on_end(xfer->priv, complete);
+  free(xfer);
+  ctx->xfer = NULL;
+}
+
+
+/**
+ * @brief Aborts the chunked transfer of a client if one is in progress (called on disconnection).
+ *
+ * @param ctx State of the client.
+ */
+void req_xfer_abort(cli_ctx_t *ctx)
+{
+  req_xfer_close(ctx, 0);
+}
+
+
+/**
+ * @brief Starts a chunked transfer (REQ_XFER_OPEN).
+ *
+ * @param frame Parsed request: seg[0] transfer type (4 bytes), seg[1] total size (8 bytes).
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__ if the transfer is open, or an error code otherwise.
+ */
+static errcode_t req_xfer_open(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  req_xfer_t *xfer;
+  uint32_t type;
+
+  if (ctx->xfer || frame->seg[0].len != sizeof type || frame->seg[1].len != sizeof xfer->size)
+    return LOG(REQ_LOG_PATH, EREQ_XFER, EREQ_XFER_M);
+
+  memcpy((void*)&type, frame->seg[0].ptr, sizeof type);
+  if (type >= REQ_XFER_TYPES || !req_xfer_types[type])
+    return LOG(REQ_LOG_PATH, EREQ_XFER, EREQ_XFER_M);
+
+  if (!(xfer = (req_xfer_t *)malloc(sizeof *xfer)))
+    return LOG(REQ_LOG_PATH, EMALLOC_FAIL, EMALLOC_FAIL_M6);
+
+  bzero((void*)xfer, sizeof *xfer);
+  xfer->ops = req_xfer_types[type];
+  memcpy((void*)&xfer->size, frame->seg[1].ptr, sizeof xfer->size);
+
+
+  if (xfer->ops->on_open && xfer->ops->on_open(&xfer->priv, xfer->size, thread_arg, thread_index, client_index))
+  {
+    free(xfer);
+    return LOG(REQ_LOG_PATH, EREQ_XFER, EREQ_XFER_M);
+  }
+
+  ctx->xfer = (void *)xfer;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Decrypts a chunk of the transfer and pushes it to the consumer (REQ_XFER_CHUNK).
+ *
+ * Chunks must arrive in order and must not exceed the announced size (counted after decompression),
+ * any violation aborts the transfer.
+ * Every XFER_WINDOW chunks the server acks the last one so that the client can send the next window.
+ *
+ * @param frame Parsed request: seg[0] chunk sequence number (4 bytes), seg[1] encrypted chunk.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__ if the chunk is consumed, or an error code otherwise.
+ */
+static errcode_t req_xfer_chunk(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  req_xfer_t *xfer = (req_xfer_t *)ctx->xfer;
+  uint8_t *m = NULL;   // decrypted in place, inside the receive buffer
+  uint8_t plain[REQ_PLAIN_MAX];
+  const uint8_t *chunk;
+  size_t clen = 0, mlen;
+  uint32_t seq;
+
+  if (!xfer || frame->seg[0].len != sizeof seq ||
+      frame->seg[1].len <= crypto_secretbox_MACBYTES || frame->seg[1].len - crypto_secretbox_MACBYTES > REQ_XFER_CHUNK_MAX)
+    goto __abort;
+
+  memcpy((void*)&seq, frame->seg[0].ptr, sizeof seq);
+  if (seq != xfer->seq)
+    goto __abort;
+
+  if (req_open(thread_index, client_index, frame->seg[1].ptr, frame->seg[1].len))
+    goto __abort;
+  chunk = m = frame->seg[1].ptr + crypto_secretbox_MACBYTES;
+  mlen = clen = frame->seg[1].len - crypto_secretbox_MACBYTES;
+
+  if (ctx->comp_codec != COMP_NONE &&
+      comp_unpack(ctx, thread_index, m, mlen, plain, sizeof plain, &chunk, &mlen))
+    goto __abort;
+
+  if (xfer->recvd + mlen > xfer->size || xfer->ops->on_chunk(xfer->priv, chunk, (uint32_t)mlen))
+    goto __abort;
+
+  bzero((void*)m, clen);
+  if (chunk == plain)
+    bzero((void*)plain, mlen);
+  xfer->recvd += mlen;
+  xfer->seq++;
+
+  // Open the next window
+  if (!(xfer->seq % XFER_WINDOW))
+    return req_send_sealed(thread_arg, thread_index, client_index, REQ_XFER_CHUNK, &seq, sizeof seq);
+
+  return __SUCCESS__;
+
+__abort:
+  if (m)
+    bzero((void*)m, clen);
+  bzero((void*)plain, sizeof plain);
+  req_xfer_close(ctx, 0);
+  return LOG(REQ_LOG_PATH, EREQ_XFER, EREQ_XFER_M);
+}
+
+
+/**
+ * @brief Ends a chunked transfer (REQ_XFER_END) and acks it with the number of bytes received.
+ *
+ * @param frame Parsed request (no segments).
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__ if the whole payload was received, or an error code otherwise.
+ */
+static errcode_t req_xfer_end(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  req_xfer_t *xfer = (req_xfer_t *)ctx->xfer;
+  uint64_t recvd;
+  errcode_t status;
+
+  if (!xfer)
+    return LOG(REQ_LOG_PATH, EREQ_XFER, EREQ_XFER_M);
+
+  recvd = xfer->recvd;
+  status = req_send_sealed(thread_arg, thread_index, client_index, REQ_XFER_END, &recvd, sizeof recvd);
+
+  if (recvd != xfer->size)
+  {
+    req_xfer_close(ctx, 0);
+    return LOG(REQ_LOG_PATH, EREQ_XFER, EREQ_XFER_M);
+  }
+  req_xfer_close(ctx, 1);
+  return status;
+}
+
+
+//==========================================================================
+//                           BENCHMARK REQUESTS
+//==========================================================================
+#if (BENCH_OPCODES)
+
+/// @brief random payload of the source, filled once by req_init() (random so that compression does not help)
+static uint8_t req_bench_data[RESP_PLAIN_MAX];
+
+
+/**
+ * @brief Decrypts in place (and decompresses) the payload of a benchmark request.
+ *
+ * @param frame Parsed request: seg[0] encrypted payload.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param plain Buffer of REQ_PLAIN_MAX bytes receiving the decompressed payload.
+ * @param res Set to the payload.
+ * @param reslen Set to the length of the payload.
+ * @return __SUCCESS__, or an error code if the payload cannot be opened.
+ */
+static errcode_t req_bench_open(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index,
+  uint8_t *plain, const uint8_t **res, size_t *reslen)
+{
+  const cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  errcode_t status;
+
+  if (frame->seg[0].len < crypto_secretbox_MACBYTES)
+    return LOG(REQ_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
+
+  if ((status = req_open(thread_index, client_index, frame->seg[0].ptr, frame->seg[0].len)))
+    return status;
+
+  *res = frame->seg[0].ptr + crypto_secretbox_MACBYTES;
+  *reslen = frame->seg[0].len - crypto_secretbox_MACBYTES;
+  if (ctx->comp_codec != COMP_NONE &&
+      comp_unpack(ctx, thread_index, *res, *reslen, plain, REQ_PLAIN_MAX, res, reslen))
+    return LOG(REQ_LOG_PATH, ECOMP_DATA, ECOMP_DATA_M);
+  return __SUCCESS__;
+}
+
+
+/// @brief Sends the payload back encrypted (REQ_BENCH_ECHO)
+static errcode_t req_bench_echo(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  uint8_t plain[REQ_PLAIN_MAX];
+  const uint8_t *payload;
+  size_t len;
+  errcode_t status;
+
+  if (!(status = req_bench_open(frame, thread_arg, thread_index, client_index, plain, &payload, &len)))
+  {
+    // Inside an envelope the echo is gathered with the other replies
+    if (req_batch_out[thread_index].active)
+      status = req_reply(thread_arg, thread_index, client_index, REQ_BENCH_ECHO, payload, (uint32_t)len);
+    else
+      status = req_send_sealed(thread_arg, thread_index, client_index, REQ_BENCH_ECHO, payload, (uint32_t)len);
+  }
+
+  bzero((void*)frame->seg[0].ptr, frame->seg[0].len);
+  bzero((void*)plain, sizeof plain);
+  return status;
+}
+
+
+/// @brief Decrypts the payload and drops it (REQ_BENCH_SINK)
+static errcode_t req_bench_sink(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  uint8_t plain[REQ_PLAIN_MAX];
+  const uint8_t *payload;
+  size_t len;
+  errcode_t status;
+
+  status = req_bench_open(frame, thread_arg, thread_index, client_index, plain, &payload, &len);
+
+  bzero((void*)frame->seg[0].ptr, frame->seg[0].len);
+  bzero((void*)plain, sizeof plain);
+  return status;
+}
+
+
+/**
+ * @brief Starts streaming n random bytes to the client in sealed messages of its max frame (REQ_BENCH_SOURCE).
+ *
+ * Nothing is sent here: the client is polled for POLLOUT and every scheduling round sends what its
+ * credit allows (req_out_pump), like the frames it reads. One source at a time per client.
+ */
+static errcode_t req_bench_source(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  cli_source_t *src = &thread_arg->total_cli_ctx[thread_index][client_index].source;
+  const req_current_t *cur = &req_current[thread_index];
+  uint32_t n;
+
+  memcpy((void*)&n, frame->seg[0].ptr, sizeof n);
+  if (n > REQ_BENCH_SOURCE_MAX)
+    return LOG(REQ_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
+  if (src->left)
+    return LOG(REQ_LOG_PATH, EREQ_INFLIGHT, EREQ_INFLIGHT_M);
+  if (!n)
+    return __SUCCESS__;
+
+  src->left = n;
+  src->flags = cur->flags & (REQ_FLAG_ID | REQ_FLAG_STREAM);
+  src->id = cur->id;
+  src->stream = cur->stream;
+  src->deadline_ns = cur->deadline_ns;
+  thread_arg->total_cli_fds[thread_index][client_index].events |= POLLOUT;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Ends the source of a client: nothing more is owed, POLLOUT is not polled anymore.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ */
+static void req_source_close(thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  bzero((void*)&thread_arg->total_cli_ctx[thread_index][client_index].source, sizeof(cli_source_t));
+  thread_arg->total_cli_fds[thread_index][client_index].events &= (int16_t)~POLLOUT;
+}
+
+
+#endif
+
+
+/**
+ * @brief Sends what the requests of a client still owe it, out of its credit of the round (called by the scheduler).
+ *
+ * Only the benchmark source streams this way. Messages go out until the budget is spent or the socket
+ * buffer is full: the socket is never waited on, the next poll tells when it drained. The source is
+ * cut when its deadline passes, and shed with REQ_RETRY while the thread sheds low priority requests.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param budget Bytes the client may still use in the round.
+ * @return Bytes sent.
+ */
+size_t req_out_pump(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, int32_t budget)
+{
+#if (BENCH_OPCODES)
+  cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  cli_source_t *src = &ctx->source;
+  const req_current_t tag = {src->flags, src->id, src->stream, 0};
+  const uint32_t chunk = (ctx->max_out < RESP_PLAIN_MAX) ? ctx->max_out : RESP_PLAIN_MAX;
+  pollfd_t wr = {thread_arg->total_cli_fds[thread_index][client_index].fd, POLLOUT, 0};
+  flag_t end = 0;
+  size_t sent = 0;
+  uint32_t len;
+
+  if (src->left && req_overload[thread_index] >= REQ_SHED_LOW)
+  {
+    req_stats[thread_index][REQ_BENCH_SOURCE].shed++;
+    resp_tmpl_send_tagged(thread_arg, thread_index, client_index, &req_tmpl_retry[REQ_BENCH_SOURCE], src->flags, src->id, src->stream);
+    end = 1;
+  }
+
+  while (!end && src->left && (int64_t)sent < budget)
+  {
+    if (src->deadline_ns && req_now_ns() >= src->deadline_ns)
+    {
+      req_stats[thread_index][REQ_BENCH_SOURCE].expired++;
+      end = 1;
+      break;
+    }
+
+    // Never spin on a full socket buffer (the first message was found writable by the poll of the round)
+    if (sent && (poll(&wr, 1, 0) != 1 || !(wr.revents & POLLOUT)))
+      return sent;
+
+    len = (src->left < chunk) ? src->left : chunk;
+    if (req_send_direct(thread_arg, thread_index, client_index, &tag, REQ_BENCH_SOURCE, req_bench_data, len))
+      end = 1;
+    else
+    {
+      src->left -= len;
+      sent += len;
+    }
+  }
+
+  // Done, cut or failed (a failure may have disconnected the client: its slot holds another one then)
+  if ((end || !src->left) && thread_arg->total_cli_fds[thread_index][client_index].fd == wr.fd)
+    req_source_close(thread_arg, thread_index, client_index);
+  return sent;
+#else
+  (void)thread_arg;
+  (void)thread_index;
+  (void)client_index;
+  (void)budget;
+  return 0;
+#endif
+}
+
+
+#if (BENCH_OPCODES)
+
+/// @brief benchmark requests, a single encrypted segment or a 4 bytes count
+static const req_entry_t req_bench_entries[] = {
+  {REQ_BENCH_ECHO, REQ_CODE_LEN + REQ_SEGLEN_LEN + crypto_secretbox_MACBYTES, RECV_VAL1, 1, 1, CO_FLAG_AUTH, &req_bench_echo, REQ_SHED_LOW},
+  {REQ_BENCH_SINK, REQ_CODE_LEN + REQ_SEGLEN_LEN + crypto_secretbox_MACBYTES, RECV_VAL1, 1, 1, CO_FLAG_AUTH, &req_bench_sink, REQ_SHED_LOW},
+  {REQ_BENCH_SOURCE, REQ_CODE_LEN + REQ_SEGLEN_LEN + 4, REQ_CODE_LEN + REQ_SEGLEN_LEN + 4, 1, 1, CO_FLAG_AUTH, &req_bench_source, REQ_SHED_LOW},
+};
+
+#endif
+
+
+//==========================================================================
+//                            PRIORITY REQUESTS
+//==========================================================================
+
+/**
+ * @brief Agrees on the version, capabilities, size limit, codec and cipher suite of the connection
+ * and stores them in its state.
+ *
+ * @param ctx State of the client.
+ * @param seg Hello of the client (PROTO_HELLO_LEN bytes).
+ * @param caps Capabilities granted whatever the client asked (PROTO_CAP_SEQNONCE for REQ_KX).
+ * @param hello Receives the answer [version][caps][max frame][codec][dict]([conn window][stream window]).
+ * @param answer_len Receives the length of the answer.
+ * @return __SUCCESS__, or EREQ_HELLO if the hello is malformed.
+ */
+static errcode_t req_hello(cli_ctx_t *ctx, const uint8_t *seg, uint32_t caps, uint32_t *hello, size_t *answer_len)
+{
+  memcpy((void*)hello, seg, PROTO_HELLO_LEN);
+  if (!hello[0] || hello[2] < PROTO_FRAME_MIN)
+    return LOG(REQ_LOG_PATH, EREQ_HELLO, EREQ_HELLO_M);
+
+  hello[0] = (hello[0] < PROTO_VERSION) ? hello[0] : PROTO_VERSION;
+  hello[1] = (hello[1] | caps) & PROTO_CAPS;
+  if (hello[1] & PROTO_CAP_COMP)
+    comp_negotiate(&hello[3], &hello[4]);
+  else
+    hello[3] = hello[4] = COMP_NONE;
+  if (hello[3] == COMP_NONE)
+    hello[1] &= ~PROTO_CAP_COMP;
+
+  // Cipher suite: one at most, and only with counter nonces (a fixed nonce under GCM leaks the key)
+  if (!(hello[1] & PROTO_CAP_SEQNONCE) || !secu_suite_get(SECU_SUITE_AESGCM))
+    hello[1] &= ~PROTO_CAP_AESGCM;
+  if (!(hello[1] & PROTO_CAP_SEQNONCE) || (hello[1] & PROTO_CAP_AESGCM))
+    hello[1] &= ~PROTO_CAP_XCHACHA;
+  ctx->suite = (hello[1] & PROTO_CAP_AESGCM) ? SECU_SUITE_AESGCM :
+               (hello[1] & PROTO_CAP_XCHACHA) ? SECU_SUITE_XCHACHA : SECU_SUITE_SECRETBOX;
+
+  // Key updates tell the frames of the old key by their number: counter nonces only
+  if (!(hello[1] & PROTO_CAP_SEQNONCE))
+    hello[1] &= ~PROTO_CAP_REKEY;
+
+  ctx->proto_version = (uint8_t)hello[0];
+  ctx->caps = hello[1];
+  ctx->max_out = (hello[2] - REQ_SEALED_OVERHEAD < REQ_BATCH_OUT_MAX) ? hello[2] - REQ_SEALED_OVERHEAD : REQ_BATCH_OUT_MAX;
+  ctx->comp_codec = (uint8_t)hello[3];
+  ctx->comp_dict = (uint8_t)hello[4];
+
+  hello[2] = RECV_VAL1;
+  *answer_len = PROTO_HELLO_LEN;
+  if (hello[1] & PROTO_CAP_CREDIT)
+  {
+    hello[5] = CONN_WINDOW;
+    hello[6] = STREAM_WINDOW;
+    *answer_len = PROTO_ANSWER_MAX;
+  }
+  return __SUCCESS__;
+}
+
+/**
+ * @brief Send the public key to the client as a response to REQ_SEND_ASYMKEY request.
+ *
+ * If the client sent a hello (seg[0]) the connection is agreed on here once (req_hello),
+ * the answer follows the public key (with the windows of the connection and of its streams
+ * for PROTO_CAP_CREDIT).
+ */
+static errcode_t req_send_asymkey(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  uint32_t hello[PROTO_ANSWER_MAX / sizeof(uint32_t)]; // [version][caps][max frame][codec][dict]([conn window][stream window])
+  size_t answer_len;
+
+  if (!frame->nseg)
+    return net_send_pk(thread_arg, thread_index, client_index, NULL, 0);
+
+  if (frame->seg[0].len != PROTO_HELLO_LEN)
+    return LOG(REQ_LOG_PATH, EREQ_HELLO, EREQ_HELLO_M);
+
+  if (req_hello(&thread_arg->total_cli_ctx[thread_index][client_index], frame->seg[0].ptr, 0, hello, &answer_len))
+    return EREQ_HELLO;
+  return net_send_pk(thread_arg, thread_index, client_index, hello, answer_len);
+}
+
+/**
+ * @brief One round trip handshake as a response to REQ_KX request.
+ *
+ * The hello (seg[1]) is mandatory, counter nonces are granted whatever the client asked:
+ * the keys of crypto_kx come with no nonce.
+ */
+static errcode_t req_kx(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  uint32_t hello[PROTO_ANSWER_MAX / sizeof(uint32_t)];
+  size_t answer_len;
+
+  if (frame->seg[0].len != crypto_kx_PUBLICKEYBYTES || frame->seg[1].len != PROTO_HELLO_LEN)
+    return LOG(REQ_LOG_PATH, EREQ_HELLO, EREQ_HELLO_M);
+
+  if (req_hello(&thread_arg->total_cli_ctx[thread_index][client_index], frame->seg[1].ptr, PROTO_CAP_SEQNONCE, hello, &answer_len))
+    return EREQ_HELLO;
+  return net_kx(frame, thread_arg, thread_index, client_index, hello, answer_len);
+}
+
+/**
+ * @brief Resumes a session from a ticket as a response to REQ_RESUME request.
+ *
+ * No hello: the ticket carries what the connection it was issued on agreed.
+ */
+static errcode_t req_resume(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  if (frame->seg[0].len != SECU_TICKET_LEN || frame->seg[1].len != SECU_RANDOM_LEN)
+    return LOG(REQ_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
+  return net_resume(frame, thread_arg, thread_index, client_index);
+}
+
+/// @brief Receive and process the symmetric key from the client as a response to REQ_RECV_K request
+static errcode_t req_recv_k(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  return net_recv_key(frame, thread_arg, thread_index, client_index);
+}
+
+/// @brief Send a ping message to the client as a response to REQ_SEND_PING request
+static errcode_t req_send_ping(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  return net_send_auth_ping(thread_arg, thread_index, client_index);
+}
+
+/// @brief Receive and process a ping message from the client as a response to REQ_RECV_PING request
+static errcode_t req_recv_ping(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  return net_recv_auth_ping(frame, thread_arg, thread_index, client_index);
+}
+
+/**
+ * @brief Key update of the client as a response to REQ_MODIF_SYMKEY request.
+ *
+ * Its frames from 'from' on are opened with the next key, the ones before with the current key.
+ * The announce must be sealed with the current key (the previous overlap is over) and 'from' at
+ * most REKEY_OVERLAP frames ahead. The server updates its own key too when the client asks for it.
+ *
+ * @param frame Parsed request: seg[0] sealed [epoch][from][flags].
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__, or an error code if the update is refused.
+ */
+static errcode_t req_modif_symkey(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  const cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  const sec_sess_t *sess = secu_sess_get(thread_index, client_index);
+  const uint64_t seq = req_current[thread_index].seq;
+  uint8_t *m = frame->seg[0].ptr + crypto_secretbox_MACBYTES;  // decrypted in place
+  const size_t mlen = frame->seg[0].len - crypto_secretbox_MACBYTES;
+  uint8_t plain[REQ_PLAIN_MAX];
+  const uint8_t *msg = m;
+  size_t len = mlen;
+  uint32_t epoch = 0, flags = 0;
+  uint64_t from = 0;
+  errcode_t status;
+
+  if (!sess)
+    return EREQ_FAIL;
+
+  if ((status = req_open(thread_index, client_index, frame->seg[0].ptr, frame->seg[0].len)))
+    goto __cleanup;
+
+  if (ctx->comp_codec != COMP_NONE &&
+      comp_unpack(ctx, thread_index, m, mlen, plain, sizeof plain, &msg, &len))
+  {
+    status = LOG(REQ_LOG_PATH, ECOMP_DATA, ECOMP_DATA_M);
+    goto __cleanup;
+  }
+  if (len != REKEY_MSG_LEN)
+  {
+    status = LOG(REQ_LOG_PATH, EREQ_LEN, EREQ_LEN_M);
+    goto __cleanup;
+  }
+  memcpy(&epoch, msg, sizeof epoch);
+  memcpy(&from, msg + 4, sizeof from);
+  memcpy(&flags, msg + 12, sizeof flags);
+
+  if (seq < sess->rx_from || from <= seq || from - seq > 1 + REKEY_OVERLAP)
+  {
+    status = LOG(REQ_LOG_PATH, E_REKEY, E_REKEY_M);
+    goto __cleanup;
+  }
+  if ((status = secu_sess_rekey_rx(thread_index, client_index, epoch, from)))
+    goto __cleanup;
+
+  if (flags & REKEY_FLAG_REQUEST)
+    status = net_rekey(thread_arg, thread_index, client_index, 0);
+
+__cleanup:
+  bzero((void*)m, mlen);
+  bzero((void*)plain, sizeof plain);
+  return status;
+}
+
+
+/// @brief authentication requests
+static const req_entry_t req_pri_entries[] = {
+  {REQ_SEND_ASYMKEY, REQ_CODE_LEN, REQ_CODE_LEN + REQ_SEGLEN_LEN + PROTO_HELLO_LEN, 0, 1, CO_FLAG_NO_AUTH, &req_send_asymkey, REQ_SHED_HANDSHAKE},
+  {REQ_RECV_K, REQ_CODE_LEN + 2 * REQ_SEGLEN_LEN + ENCRYPTED_AUTH_SIZE,
+               REQ_CODE_LEN + 2 * REQ_SEGLEN_LEN + ENCRYPTED_AUTH_SIZE, 2, 2, CO_FLAG_RECVD_PK, &req_recv_k},
+  {REQ_SEND_PING, REQ_CODE_LEN, REQ_CODE_LEN, 0, 0, CO_FLAG_SENT_KEY, &req_send_ping},
+  {REQ_RECV_PING, REQ_CODE_LEN + REQ_SEGLEN_LEN + PING_HELLO_LEN + crypto_secretbox_MACBYTES,
+                  REQ_CODE_LEN + REQ_SEGLEN_LEN + PING_HELLO_LEN + crypto_secretbox_MACBYTES, 1, 1, CO_FLAG_SENT_PING, &req_recv_ping},
+  {REQ_KX, REQ_CODE_LEN + 2 * REQ_SEGLEN_LEN + crypto_kx_PUBLICKEYBYTES + PROTO_HELLO_LEN,
+           REQ_CODE_LEN + 2 * REQ_SEGLEN_LEN + crypto_kx_PUBLICKEYBYTES + PROTO_HELLO_LEN, 2, 2, CO_FLAG_NO_AUTH, &req_kx, REQ_SHED_HANDSHAKE},
+  {REQ_RESUME, REQ_CODE_LEN + 2 * REQ_SEGLEN_LEN + SECU_TICKET_LEN + SECU_RANDOM_LEN,
+               REQ_CODE_LEN + 2 * REQ_SEGLEN_LEN + SECU_TICKET_LEN + SECU_RANDOM_LEN, 2, 2, CO_FLAG_NO_AUTH, &req_resume, REQ_SHED_HANDSHAKE},
+  {REQ_MODIF_SYMKEY, REQ_CODE_LEN + REQ_SEGLEN_LEN + crypto_secretbox_MACBYTES + REKEY_MSG_LEN, RECV_VAL1, 1, 1, CO_FLAG_AUTH, &req_modif_symkey,
+                     REQ_SHED_NEVER, PROTO_CAP_REKEY},
+};
+
+
+/**
+ * @brief Answers a heartbeat (REQ_HEARTBEAT) with a template, the time of the frame is already recorded.
+ *
+ * @param frame Parsed request: no segment.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__ if the answer is sent, or the error of sendall().
+ */
+static errcode_t req_heartbeat(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  return resp_tmpl_send(thread_arg, thread_index, client_index, &req_tmpl_heartbeat);
+}
+
+
+/**
+ * @brief Issues a resumption ticket (REQ_TICKET) for what the connection agreed in its hello.
+ *
+ * Answered sealed [lifetime s 4][ticket][secret]: the secret only ever travels under the session key.
+ *
+ * @param frame Parsed request: no segment.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return __SUCCESS__ if the ticket is sent, or an error code otherwise.
+ */
+static errcode_t req_ticket(const req_frame_t *frame, thread_arg_t *thread_arg, size_t thread_index, size_t client_index)
+{
+  const cli_ctx_t *ctx = &thread_arg->total_cli_ctx[thread_index][client_index];
+  const uint32_t lifetime = TICKET_LIFETIME_S;
+  uint8_t out[sizeof lifetime + SECU_TICKET_LEN + SECU_TICKET_SECRET];
+  sec_ticket_t ticket;
+  errcode_t status;
+
+  bzero((void*)&ticket, sizeof ticket);
+  ticket.caps = ctx->caps;
+  ticket.max_out = ctx->max_out;
+  ticket.proto_version = ctx->proto_version;
+  ticket.suite = ctx->suite;
+  ticket.comp_codec = ctx->comp_codec;
+  ticket.comp_dict = ctx->comp_dict;
+
+  status = secu_ticket_issue(&ticket, out + sizeof lifetime);
+  if (!status)
+  {
+    memcpy((void*)out, &lifetime, sizeof lifetime);
+    memcpy((void*)(out + sizeof lifetime + SECU_TICKET_LEN), ticket.secret, SECU_TICKET_SECRET);
+    status = req_send_sealed(thread_arg, thread_index, client_index, REQ_TICKET, out, sizeof out);
+  }
+  sodium_memzero((void*)&ticket, sizeof ticket);
+  sodium_memzero((void*)out, sizeof out);
+  return status;
+}
+
+
+/// @brief framework requests
+static const req_entry_t req_frw_entries[] = {
+  {REQ_BATCH, REQ_CODE_LEN + REQ_SEGLEN_LEN + crypto_secretbox_MACBYTES + REQ_CODE_LEN, RECV_VAL1, 1, 1, CO_FLAG_AUTH, &req_batch, REQ_SHED_NEVER, PROTO_CAP_BATCH},
+  {REQ_XFER_OPEN, REQ_CODE_LEN + 2 * REQ_SEGLEN_LEN + 12, REQ_CODE_LEN + 2 * REQ_SEGLEN_LEN + 12, 2, 2, CO_FLAG_AUTH, &req_xfer_open, REQ_SHED_LOW, PROTO_CAP_XFER},
+  {REQ_XFER_CHUNK, REQ_CODE_LEN + 2 * REQ_SEGLEN_LEN + 4 + crypto_secretbox_MACBYTES, RECV_VAL1, 2, 2, CO_FLAG_AUTH, &req_xfer_chunk, REQ_SHED_NEVER, PROTO_CAP_XFER},
+  {REQ_XFER_END, REQ_CODE_LEN, REQ_CODE_LEN, 0, 0, CO_FLAG_AUTH, &req_xfer_end, REQ_SHED_NEVER, PROTO_CAP_XFER},
+  {REQ_STREAM_CLOSE, REQ_CODE_LEN, REQ_CODE_LEN, 0, 0, CO_FLAG_AUTH, &req_stream_close, REQ_SHED_NEVER, PROTO_CAP_STREAMS},
+  {REQ_HEARTBEAT, REQ_CODE_LEN, REQ_CODE_LEN, 0, 0, CO_FLAG_AUTH, &req_heartbeat, REQ_SHED_NEVER, PROTO_CAP_HEARTBEAT},
+  {REQ_TICKET, REQ_CODE_LEN, REQ_CODE_LEN, 0, 0, CO_FLAG_AUTH, &req_ticket, REQ_SHED_LOW, PROTO_CAP_SEQNONCE},
+};
+
+
+/**
+ * @brief Registers every request handler of the server (called once at startup before the threads run).
+ *
+ * @return __SUCCESS__ if all the handlers are registered, or an error code otherwise.
+ */
+errcode_t req_init(void)
+{
+  for (size_t i = 0; i < sizeof req_pri_entries / sizeof req_pri_entries[0]; i++)
+    if (req_register(&req_pri_entries[i]))
+      return EREQ_REGISTER;
+
+  for (size_t i = 0; i < sizeof req_frw_entries / sizeof req_frw_entries[0]; i++)
+    if (req_register(&req_frw_entries[i]))
+      return EREQ_REGISTER;
+
+  #if (BENCH_OPCODES)
+    for (size_t i = 0; i < sizeof req_bench_entries / sizeof req_bench_entries[0]; i++)
+      if (req_register(&req_bench_entries[i]))
+        return EREQ_REGISTER;
+    randombytes_buf(req_bench_data, sizeof req_bench_data);
+  #endif
+
+  for (size_t i = 0; i < SERVER_THREAD_NO; i++)
+    pthread_mutex_init(&req_complete_queue[i].lock, NULL);
+
+  req_tmpl_init();
   return __SUCCESS__;
 }
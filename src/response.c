@@ -0,0 +1,305 @@
+#include "../include/response.h"
+
+//==========================================================================
+//                              BUFFER POOLS
+//==========================================================================
+
+#define RESP_SCRATCH_SIZE   (COMP_HDR_LEN + RESP_PLAIN_MAX)
+
+/// @brief free buffers of every worker (stack), every thread only touches its own row
+static uint8_t *resp_pool[SERVER_THREAD_NO][RESP_POOL_SIZE];
+static size_t   resp_pool_free[SERVER_THREAD_NO];
+
+/// @brief compression output of every worker (compression cannot run in place)
+static uint8_t *resp_scratch[SERVER_THREAD_NO];
+
+
+/**
+ * @brief Allocates the buffer pools of the workers (called once at startup before the threads run).
+ *
+ * @return __SUCCESS__, or an error code if the allocation fails.
+ */
+errcode_t resp_init(void)
+{
+  const size_t per_thread = RESP_POOL_SIZE * RESP_BUF_SIZE + RESP_SCRATCH_SIZE;
+  uint8_t *block = (uint8_t *)malloc(SERVER_THREAD_NO * per_thread);
+
+  if (!block)
+    return LOG(REQ_LOG_PATH, EMALLOC_FAIL, EMALLOC_FAIL_M8);
+
+  for (size_t i = 0; i < SERVER_THREAD_NO; i++, block += per_thread)
+  {
+    for (size_t j = 0; j < RESP_POOL_SIZE; j++)
+      resp_pool[i][j] = block + j * RESP_BUF_SIZE;
+    resp_pool_free[i] = RESP_POOL_SIZE;
+    resp_scratch[i] = block + RESP_POOL_SIZE * RESP_BUF_SIZE;
+  }
+  return __SUCCESS__;
+}
+
+
+/// @brief gives a buffer back to the pool of its worker
+static inline void resp_release(resp_t *resp)
+{
+  resp_pool[resp->thread_index][resp_pool_free[resp->thread_index]++] = resp->buf;
+  resp->buf = NULL;
+}
+
+
+//==========================================================================
+//                                 BUILDER
+//==========================================================================
+
+/**
+ * @brief Starts a message, its buffer is taken from the pool of the worker.
+ *
+ * @param resp Message to start.
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param code Code of the message.
+ * @return __SUCCESS__, or ERESP_POOL if every buffer of the worker is in use.
+ */
+errcode_t resp_begin(resp_t *resp, thread_arg_t *thread_arg, size_t thread_index, size_t client_index, uint32_t code)
+{
+  const size_t max_out = thread_arg->total_cli_ctx[thread_index][client_index].max_out;
+
+  if (!resp_pool_free[thread_index])
+    return LOG(REQ_LOG_PATH, ERESP_POOL, ERESP_POOL_M);
+
+  resp->buf = resp_pool[thread_index][--resp_pool_free[thread_index]];
+  resp->len = 0;
+  resp->limit = (max_out < RESP_PLAIN_MAX) ? max_out : RESP_PLAIN_MAX;
+  resp->code = code;
+  resp->flags = 0;
+  resp->thread_arg = thread_arg;
+  resp->thread_index = thread_index;
+  resp->client_index = client_index;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Tags the message with the id of the request it answers.
+ *
+ * @param resp Message being built.
+ * @param id Request id.
+ */
+void resp_tag(resp_t *resp, uint32_t id)
+{
+  resp->flags |= REQ_FLAG_ID;
+  resp->id = id;
+}
+
+
+/**
+ * @brief Sends the message on a logical stream.
+ *
+ * @param resp Message being built.
+ * @param stream Stream id.
+ */
+void resp_stream(resp_t *resp, uint32_t stream)
+{
+  resp->flags |= REQ_FLAG_STREAM;
+  resp->stream = stream;
+}
+
+
+/**
+ * @brief Appends raw bytes to the payload.
+ *
+ * @param resp Message being built.
+ * @param data Bytes to append.
+ * @param len Number of bytes.
+ * @return __SUCCESS__, or EREQ_LEN if the payload would exceed what the client accepts.
+ */
+errcode_t resp_append_raw(resp_t *resp, const void *data, uint32_t len)
+{
+  if (len > resp->limit - resp->len)
+    return EREQ_LEN;
+
+  memcpy((void*)(resp->buf + RESP_HDR_LEN + resp->len), data, len);
+  resp->len += len;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Appends a [len][seg] segment to the payload.
+ *
+ * @param resp Message being built.
+ * @param seg Segment to append.
+ * @param len Length of the segment.
+ * @return __SUCCESS__, or EREQ_LEN if the payload would exceed what the client accepts.
+ */
+errcode_t resp_append(resp_t *resp, const void *seg, uint32_t len)
+{
+  if (REQ_SEGLEN_LEN + (size_t)len > resp->limit - resp->len)
+    return EREQ_LEN;
+
+  memcpy((void*)(resp->buf + RESP_HDR_LEN + resp->len), &len, REQ_SEGLEN_LEN);
+  memcpy((void*)(resp->buf + RESP_HDR_LEN + resp->len + REQ_SEGLEN_LEN), seg, len);
+  resp->len += REQ_SEGLEN_LEN + len;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Compresses, encrypts in place and sends the message, then gives its buffer back to the pool.
+ *
+ * Without compression the secretbox is written over the payload itself (the MAC goes in the space
+ * reserved in front of it), with compression it is written from the worker's scratch buffer.
+ * The session key is taken from the store of the worker, the nonce from the count of sealed messages.
+ *
+ * @param resp Message to send.
+ * @return __SUCCESS__ if the message is sent, or an error code otherwise.
+ */
+errcode_t resp_finalize(resp_t *resp)
+{
+  cli_ctx_t *ctx = &resp->thread_arg->total_cli_ctx[resp->thread_index][resp->client_index];
+  const sec_sess_t *sess = secu_sess_get(resp->thread_index, resp->client_index);
+  const uint32_t code = resp->code | resp->flags;
+  uint8_t *m = resp->buf + RESP_HDR_LEN;
+  uint8_t *c = m - crypto_secretbox_MACBYTES;
+  uint8_t *frame;
+  size_t mlen = resp->len;
+  uint32_t seglen;
+  errcode_t status;
+
+  if (!sess)
+  {
+    resp_abort(resp);
+    return E_SESS_KEY;
+  }
+
+  if (ctx->comp_codec != COMP_NONE)
+  {
+    mlen = comp_pack(ctx, resp->thread_index, m, mlen, resp_scratch[resp->thread_index]);
+    bzero((void*)m, resp->len);
+    m = resp_scratch[resp->thread_index];
+    c -= COMP_HDR_LEN;
+  }
+
+  // Header written backwards from the secretbox: [code][id][stream][seglen]
+  seglen = (uint32_t)(mlen + crypto_secretbox_MACBYTES);
+  frame = c - REQ_SEGLEN_LEN;
+  memcpy((void*)frame, &seglen, REQ_SEGLEN_LEN);
+  if (resp->flags & REQ_FLAG_STREAM)
+  {
+    frame -= REQ_STREAM_LEN;
+    memcpy((void*)frame, &resp->stream, REQ_STREAM_LEN);
+  }
+  if (resp->flags & REQ_FLAG_ID)
+  {
+    frame -= REQ_ID_LEN;
+    memcpy((void*)frame, &resp->id, REQ_ID_LEN);
+  }
+  frame -= REQ_CODE_LEN;
+  memcpy((void*)frame, &code, REQ_CODE_LEN);
+
+  status = secu_sess_seal(sess, ctx->seq_tx, c, m, mlen);
+  if (m == resp_scratch[resp->thread_index])
+    bzero((void*)m, mlen);
+
+  if (!status && !(status = sendall(resp->thread_arg, resp->thread_index, resp->client_index, frame, (size_t)(c - frame) + seglen)))
+  {
+    ctx->seq_tx++;
+    ctx->rekey_bytes += seglen;
+  }
+
+  resp_release(resp);
+  return status;
+}
+
+
+/**
+ * @brief Gives the buffer of a message back to the pool without sending it.
+ *
+ * @param resp Message to drop.
+ */
+void resp_abort(resp_t *resp)
+{
+  if (!resp->buf)
+    return;
+  bzero((void*)(resp->buf + RESP_HDR_LEN), resp->len);
+  resp_release(resp);
+}
+
+
+//==========================================================================
+//                                TEMPLATES
+//==========================================================================
+
+/**
+ * @brief Serializes a constant plain message [code][len][payload] into a template.
+ *
+ * @param tmpl Template to fill.
+ * @param code Code of the message.
+ * @param payload Payload of the message.
+ * @param len Length of the payload (<= RESP_TMPL_MAX - 8).
+ * @return __SUCCESS__, or EREQ_LEN if the message does not fit in a template.
+ */
+errcode_t resp_tmpl_build(resp_tmpl_t *tmpl, uint32_t code, const void *payload, uint32_t len)
+{
+  if (len > RESP_TMPL_MAX - REQ_CODE_LEN - REQ_SEGLEN_LEN)
+    return EREQ_LEN;
+
+  memcpy((void*)tmpl->buf, &code, REQ_CODE_LEN);
+  memcpy((void*)(tmpl->buf + REQ_CODE_LEN), &len, REQ_SEGLEN_LEN);
+  memcpy((void*)(tmpl->buf + REQ_CODE_LEN + REQ_SEGLEN_LEN), payload, len);
+  tmpl->len = REQ_CODE_LEN + REQ_SEGLEN_LEN + len;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Sends a template.
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param tmpl Template to send.
+ * @return __SUCCESS__ if the message is sent, or an error code otherwise.
+ */
+errcode_t resp_tmpl_send(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const resp_tmpl_t *tmpl)
+{
+  return sendall(thread_arg, thread_index, client_index, tmpl->buf, tmpl->len);
+}
+
+
+/**
+ * @brief Sends a template carrying the id and the stream of the request it answers, [code | flags][id][stream][len][payload].
+ *
+ * @param thread_arg Pointer to the thread_arg_t structure.
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param tmpl Template to send.
+ * @param flags REQ_FLAG_ID / REQ_FLAG_STREAM header fields to carry (others are ignored).
+ * @param id Request id.
+ * @param stream Stream id.
+ * @return __SUCCESS__ if the message is sent, or an error code otherwise.
+ */
+errcode_t resp_tmpl_send_tagged(thread_arg_t *thread_arg, size_t thread_index, size_t client_index, const resp_tmpl_t *tmpl,
+  uint32_t flags, uint32_t id, uint32_t stream)
+{
+  uint8_t buf[RESP_TMPL_MAX + REQ_ID_LEN + REQ_STREAM_LEN];
+  uint32_t code;
+  size_t len = REQ_CODE_LEN;
+
+  memcpy((void*)&code, tmpl->buf, REQ_CODE_LEN);
+  flags &= REQ_FLAG_ID | REQ_FLAG_STREAM;
+  code |= flags;
+  memcpy((void*)buf, &code, REQ_CODE_LEN);
+  if (flags & REQ_FLAG_ID)
+  {
+    memcpy((void*)(buf + len), &id, REQ_ID_LEN);
+    len += REQ_ID_LEN;
+  }
+  if (flags & REQ_FLAG_STREAM)
+  {
+    memcpy((void*)(buf + len), &stream, REQ_STREAM_LEN);
+    len += REQ_STREAM_LEN;
+  }
+  memcpy((void*)(buf + len), tmpl->buf + REQ_CODE_LEN, tmpl->len - REQ_CODE_LEN);
+  return sendall(thread_arg, thread_index, client_index, buf, len + tmpl->len - REQ_CODE_LEN);
+}
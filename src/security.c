@@ -69,40 +69,228 @@ errcode_t secu_check_init_cred(const uint8_t *pass)
 //      ASYMMETRIC KEY GENERATION
 //===============================================
 
+/// @brief generation of the keypair of the server, id n lives in slot (n - 1) % KEYPAIR_GENERATIONS
+typedef struct sec_keypair
+{
+  uint32_t id;              // 0: empty slot
+  uint8_t  pk[crypto_box_PUBLICKEYBYTES];
+  uint8_t  sk[crypto_box_SECRETKEYBYTES];
+}sec_keypair_t;
+
+/// @brief the generations still open handshakes (guarded pages, read only between two rotations)
+static sec_keypair_t   *secu_keypairs;
+static uint32_t         secu_keypair_id;     // newest generation, the one sent to new clients
+static pthread_rwlock_t secu_keypairs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static sem_t            secu_rotate_sem;     // posted to rotate now (secu_keypair_rotate_request)
+
+
 /**
  * @brief Generate asymmetric keypair and write it to the database.
  * 
  * This function generates an asymmetric keypair, consisting of a public key and a secret key,
- * and writes them to the database.
+ * and writes them to the database as generation 1. The keypair is generated right into the guarded memory
+ * the handshakes read it from: the KeyPairs table is only written, never read back while the server runs.
+ * The rows of a previous run are deleted, no handshake outlives the process.
  * 
  * @param db_connect MYSQL database connection.
  * @return Error code indicating the success or failure of the key generation and saving process.
  */
 errcode_t secu_init_keys(MYSQL *db_connect)
 {
+  const size_t size = KEYPAIR_GENERATIONS * sizeof(sec_keypair_t);
+  errcode_t status = __SUCCESS__;
+
+  if (!(secu_keypairs = (sec_keypair_t *)sodium_malloc(size)))
+    return LOG(SECU_LOG_PATH, EMALLOC_FAIL, EMALLOC_FAIL_M12);
+  sodium_memzero((void*)secu_keypairs, size);
+
+  if (crypto_box_keypair(secu_keypairs[0].pk, secu_keypairs[0].sk))
+  {
+    status = LOG(SECU_LOG_PATH, EKEYPAIR_GEN, EKEYPAIR_GEN_M);
+  }
+  else if (secu_key_del(db_connect))
+  {
+    status = LOG(SECU_LOG_PATH, EKEYPAIR_DEL, EKEYPAIR_DEL_M);
+  }
+  else if (secu_key_save(1, secu_keypairs[0].pk, secu_keypairs[0].sk, db_connect))
+  {
+    status = LOG(SECU_LOG_PATH, EKEYPAIR_SAVE, EKEYPAIR_SAVE_M);
+  }
+
+  if (status)
+    sodium_memzero((void*)secu_keypairs, size);
+  else
+    secu_keypairs[0].id = secu_keypair_id = 1;
+  sodium_mprotect_readonly((void*)secu_keypairs);
+  return status;
+}
+
+
+/**
+ * @brief Copies the public key of the newest generation, the one a new handshake is sent.
+ *
+ * @param pk Buffer of crypto_box_PUBLICKEYBYTES bytes receiving the key.
+ * @return The id of the generation, the client's key frame is opened with it (secu_keypair_open).
+ */
+uint32_t secu_keypair_pk(uint8_t *pk)
+{
+  uint32_t id;
+
+  pthread_rwlock_rdlock(&secu_keypairs_lock);
+  id = secu_keypair_id;
+  memcpy((void*)pk, secu_keypairs[(id - 1) % KEYPAIR_GENERATIONS].pk, crypto_box_PUBLICKEYBYTES);
+  pthread_rwlock_unlock(&secu_keypairs_lock);
+  return id;
+}
+
+
+/**
+ * @brief Opens a sealed box of a handshake with the generation whose public key the client was sent.
+ *
+ * The keys are copied to the stack under the read lock and wiped once the box is open: the lock is
+ * never held across the X25519 operation, so a rotation waits for a few copies at most (the read locks
+ * favour readers, a storm of handshakes could otherwise keep it out). The opens never wait for the database.
+ *
+ * @param id Generation sent to the client.
+ * @param m Buffer to store the decrypted message.
+ * @param c Sealed box.
+ * @param clen Length of the sealed box.
+ * @return __SUCCESS__, E_KEYPAIR_GONE if the generation was retired, or the error of the decryption.
+ */
+errcode_t secu_keypair_open(uint32_t id, void *m, const uint8_t *c, size_t clen)
+{
+  const sec_keypair_t *kp = &secu_keypairs[(id - 1) % KEYPAIR_GENERATIONS];
+  uint8_t pk[crypto_box_PUBLICKEYBYTES], sk[crypto_box_SECRETKEYBYTES];
+  errcode_t status = E_KEYPAIR_GONE;
+
+  pthread_rwlock_rdlock(&secu_keypairs_lock);
+  if (id && kp->id == id)
+  {
+    memcpy((void*)pk, kp->pk, sizeof pk);
+    memcpy((void*)sk, kp->sk, sizeof sk);
+    status = __SUCCESS__;
+  }
+  pthread_rwlock_unlock(&secu_keypairs_lock);
+
+  if (!status)
+    status = secu_asymmetric_decrypt(pk, sk, m, c, clen);
+  sodium_memzero((void*)sk, sizeof sk);
+
+  if (status == E_KEYPAIR_GONE)
+    return LOG(SECU_LOG_PATH, E_KEYPAIR_GONE, E_KEYPAIR_GONE_M);
+  return status;
+}
+
+
+/**
+ * @brief Adds a generation of the keypair of the server, the oldest one in memory is dropped.
+ *
+ * The keypair is generated and saved to the database before the lock is taken: the handshakes only
+ * wait for a copy into the guarded pages. The clients being sent the previous generations can still
+ * complete their handshake with it, the sessions already keyed are not touched.
+ *
+ * @param db_connect MYSQL database connection of the caller (the rotation thread).
+ * @return __SUCCESS__, or an error code if the keypair cannot be generated or saved (the newest stays).
+ */
+errcode_t secu_keypair_rotate(MYSQL *db_connect)
+{
+  const uint32_t id = secu_keypair_id + 1;  // only the rotation thread writes it
+  sec_keypair_t *kp = &secu_keypairs[(id - 1) % KEYPAIR_GENERATIONS];
   uint8_t pk[crypto_box_PUBLICKEYBYTES];
   uint8_t sk[crypto_box_SECRETKEYBYTES];
+  errcode_t status = __SUCCESS__;
 
   if (crypto_box_keypair(pk, sk))
   {
-    bzero(pk, crypto_box_PUBLICKEYBYTES);
-    bzero(sk, crypto_box_SECRETKEYBYTES);
-    return LOG(SECU_LOG_PATH, EKEYPAIR_GEN, EKEYPAIR_GEN_M);
+    status = LOG(SECU_LOG_PATH, EKEYPAIR_GEN, EKEYPAIR_GEN_M);
   }
-  if (secu_key_del(db_connect))
+  else if (secu_key_save(id, pk, sk, db_connect))
   {
-    bzero(pk, crypto_box_PUBLICKEYBYTES);
-    bzero(sk, crypto_box_SECRETKEYBYTES);
-    return LOG(SECU_LOG_PATH, EKEYPAIR_DEL, EKEYPAIR_DEL_M);
+    status = LOG(SECU_LOG_PATH, EKEYPAIR_SAVE, EKEYPAIR_SAVE_M);
   }
-  if (secu_key_save(pk, sk, db_connect))
+  else
+  {
+    pthread_rwlock_wrlock(&secu_keypairs_lock);
+    sodium_mprotect_readwrite((void*)secu_keypairs);
+    kp->id = id;
+    memcpy((void*)kp->pk, pk, sizeof pk);
+    memcpy((void*)kp->sk, sk, sizeof sk);
+    sodium_mprotect_readonly((void*)secu_keypairs);
+    secu_keypair_id = id;
+    pthread_rwlock_unlock(&secu_keypairs_lock);
+
+    // The generation dropped from memory goes from the database too (logged, not fatal)
+    if (id > KEYPAIR_GENERATIONS)
+      secu_key_retire(id - KEYPAIR_GENERATIONS, db_connect);
+  }
+  sodium_memzero((void*)pk, sizeof pk);
+  sodium_memzero((void*)sk, sizeof sk);
+  return status;
+}
+
+
+/// @brief SIGHUP: rotates the keypair now (async signal safe)
+static void secu_keypair_sighup(int sig)
+{
+  (void)sig;
+  sem_post(&secu_rotate_sem);
+}
+
+
+/**
+ * @brief Rotation thread: adds a generation every KEYPAIR_ROTATE_S or when asked to.
+ *
+ * @param args Its own database connection (MYSQL *).
+ * @return Never returns.
+ */
+static void *secu_keypair_handler(void *args)
+{
+  MYSQL *db_connect = (MYSQL *)args;
+  struct timespec ts;
+  int rc;
+
+  for (;;)
   {
-    bzero(pk, crypto_box_PUBLICKEYBYTES);
-    bzero(sk, crypto_box_SECRETKEYBYTES);
-    return LOG(SECU_LOG_PATH, EKEYPAIR_SAVE, EKEYPAIR_SAVE_M);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += KEYPAIR_ROTATE_S;
+    do
+      rc = KEYPAIR_ROTATE_S ? sem_timedwait(&secu_rotate_sem, &ts) : sem_wait(&secu_rotate_sem);
+    while (rc && errno == EINTR);
+    secu_keypair_rotate(db_connect);
   }
-  bzero(pk, crypto_box_PUBLICKEYBYTES);
-  bzero(sk, crypto_box_SECRETKEYBYTES);
+  return NULL;
+}
+
+
+/**
+ * @brief Asks the rotation thread to add a generation now (async signal safe, also bound to SIGHUP).
+ */
+void secu_keypair_rotate_request(void)
+{
+  sem_post(&secu_rotate_sem);
+}
+
+
+/**
+ * @brief Starts the rotation thread of the keypair of the server, called once at startup after secu_init_keys().
+ *
+ * @param db_connect Database connection given to the thread (not shared with the workers).
+ * @return __SUCCESS__, or E_KEYPAIR_ROTATE if the thread cannot be started.
+ */
+errcode_t secu_keypair_start(MYSQL *db_connect)
+{
+  struct sigaction sa;
+  pthread_t thread;
+
+  bzero((void*)&sa, sizeof sa);
+  sa.sa_handler = &secu_keypair_sighup;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+
+  if (sem_init(&secu_rotate_sem, 0, 0) ||
+      pthread_create(&thread, NULL, &secu_keypair_handler, (void *)db_connect) || pthread_detach(thread) ||
+      sigaction(SIGHUP, &sa, NULL))
+    return LOG(SECU_LOG_PATH, E_KEYPAIR_ROTATE, E_KEYPAIR_ROTATE_M);
   return __SUCCESS__;
 }
 
@@ -189,3 +377,567 @@ errcode_t secu_symmetric_decrypt(const uint8_t *key, const uint8_t *n, void *m,
     return LOG(SECU_LOG_PATH, E_SYMM_DECRYPT, E_SYMM_DECRYPT_M);
   return __SUCCESS__;
 }
+
+/**
+ * @brief Encrypts a message 'm' of length 'mlen' into 'c' and writes its MAC apart in 'mac'.
+ *
+ * 'c' may be 'm': the message is then encrypted in place, in the buffer it will be sent from.
+ *
+ * @param key Symmetric key specific to this connection.
+ * @param n Nonce of the message.
+ * @param mac Buffer of crypto_secretbox_MACBYTES bytes receiving the MAC.
+ * @param c Buffer to contain the cipher (mlen bytes).
+ * @param m Message to encrypt.
+ * @param mlen Length of the message to encrypt.
+ * @return Error code indicating the success or failure of the encryption process.
+ */
+errcode_t secu_symmetric_encrypt_detached(const uint8_t *key, const uint8_t *n, uint8_t *mac, uint8_t *c, const uint8_t *m, size_t mlen)
+{
+  if (crypto_secretbox_detached(c, mac, m, mlen, n, key))
+    return LOG(SECU_LOG_PATH, E_SYMM_ENCRYPT, E_SYMM_ENCRYPT_M);
+  return __SUCCESS__;
+}
+
+/**
+ * @brief Checks the MAC 'mac' of a cipher 'c' of length 'clen' and decrypts it into 'm'.
+ *
+ * 'm' may be 'c': the cipher is then decrypted in place, in the buffer it was received in.
+ * Nothing is written if the MAC does not match.
+ *
+ * @param key Symmetric key specific to this connection.
+ * @param n Nonce of the message.
+ * @param m Buffer to store the decrypted message (clen bytes).
+ * @param mac MAC of the cipher.
+ * @param c Cipher to decrypt.
+ * @param clen Length of the cipher to decrypt.
+ * @return Error code indicating the success or failure of the decryption process.
+ */
+errcode_t secu_symmetric_decrypt_detached(const uint8_t *key, const uint8_t *n, uint8_t *m, const uint8_t *mac, const uint8_t *c, size_t clen)
+{
+  if (crypto_secretbox_open_detached(m, c, mac, clen, n, key))
+    return LOG(SECU_LOG_PATH, E_SYMM_DECRYPT, E_SYMM_DECRYPT_M);
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Server side of an ephemeral key exchange (REQ_KX): generates a keypair used for this exchange
+ * only and derives the session keys of both directions from it and the ephemeral key of the client.
+ *
+ * The secret key never leaves this function, both ends forget it once the keys are derived.
+ *
+ * @param pk Receives the ephemeral public key of the server (crypto_kx_PUBLICKEYBYTES).
+ * @param rx Receives the key of the messages from the client (crypto_kx_SESSIONKEYBYTES).
+ * @param tx Receives the key of the messages to the client (crypto_kx_SESSIONKEYBYTES).
+ * @param client_pk Ephemeral public key of the client.
+ * @return __SUCCESS__, or E_KEY_EXCHANGE if the key of the client is not acceptable.
+ */
+errcode_t secu_kx_server(uint8_t *pk, uint8_t *rx, uint8_t *tx, const uint8_t *client_pk)
+{
+  uint8_t sk[crypto_kx_SECRETKEYBYTES];
+  errcode_t status = __SUCCESS__;
+
+  if (crypto_kx_keypair(pk, sk) || crypto_kx_server_session_keys(rx, tx, pk, sk, client_pk))
+    status = LOG(SECU_LOG_PATH, E_KEY_EXCHANGE, E_KEY_EXCHANGE_M);
+  sodium_memzero((void*)sk, sizeof sk);
+  return status;
+}
+
+
+//===========================================================================================================
+//                SECURITY: CIPHER SUITES
+//===========================================================================================================
+
+/// @brief AES-256-GCM encryption with the MAC apart, in place like secu_symmetric_encrypt_detached()
+static errcode_t secu_aesgcm_seal(const uint8_t *key, const uint8_t *n, uint8_t *mac, uint8_t *c, const uint8_t *m, size_t mlen)
+{
+  if (crypto_aead_aes256gcm_encrypt_detached(c, mac, NULL, m, mlen, NULL, 0, NULL, n, key))
+    return LOG(SECU_LOG_PATH, E_SYMM_ENCRYPT, E_SYMM_ENCRYPT_M);
+  return __SUCCESS__;
+}
+
+/// @brief AES-256-GCM decryption with the MAC apart, in place like secu_symmetric_decrypt_detached()
+static errcode_t secu_aesgcm_open(const uint8_t *key, const uint8_t *n, uint8_t *m, const uint8_t *mac, const uint8_t *c, size_t clen)
+{
+  if (crypto_aead_aes256gcm_decrypt_detached(m, NULL, c, clen, mac, NULL, 0, n, key))
+    return LOG(SECU_LOG_PATH, E_SYMM_DECRYPT, E_SYMM_DECRYPT_M);
+  return __SUCCESS__;
+}
+
+/// @brief XChaCha20-Poly1305-IETF encryption with the MAC apart, in place like secu_symmetric_encrypt_detached()
+static errcode_t secu_xchacha_seal(const uint8_t *key, const uint8_t *n, uint8_t *mac, uint8_t *c, const uint8_t *m, size_t mlen)
+{
+  if (crypto_aead_xchacha20poly1305_ietf_encrypt_detached(c, mac, NULL, m, mlen, NULL, 0, NULL, n, key))
+    return LOG(SECU_LOG_PATH, E_SYMM_ENCRYPT, E_SYMM_ENCRYPT_M);
+  return __SUCCESS__;
+}
+
+/// @brief XChaCha20-Poly1305-IETF decryption with the MAC apart, in place like secu_symmetric_decrypt_detached()
+static errcode_t secu_xchacha_open(const uint8_t *key, const uint8_t *n, uint8_t *m, const uint8_t *mac, const uint8_t *c, size_t clen)
+{
+  if (crypto_aead_xchacha20poly1305_ietf_decrypt_detached(m, NULL, c, clen, mac, NULL, 0, n, key))
+    return LOG(SECU_LOG_PATH, E_SYMM_DECRYPT, E_SYMM_DECRYPT_M);
+  return __SUCCESS__;
+}
+
+/// @brief cipher suites, indexed by SECU_SUITE_*
+static const sec_suite_t secu_suites[SECU_SUITES] = {
+  {SECU_SUITE_SECRETBOX, &secu_symmetric_encrypt_detached, &secu_symmetric_decrypt_detached},
+  {SECU_SUITE_XCHACHA, &secu_xchacha_seal, &secu_xchacha_open},
+  {SECU_SUITE_AESGCM, &secu_aesgcm_seal, &secu_aesgcm_open},  // 12 bytes nonce
+};
+
+/// @brief set at startup if the CPU runs AES-256-GCM (libsodium only implements it with AES-NI)
+static flag_t secu_aesgcm_ok;
+
+
+/**
+ * @brief Looks up a cipher suite.
+ *
+ * @param id Suite (SECU_SUITE_*).
+ * @return The suite, or NULL if it is unknown or this host cannot run it (AES-256-GCM without AES-NI).
+ */
+const sec_suite_t *secu_suite_get(uint32_t id)
+{
+  if (id >= SECU_SUITES || (id == SECU_SUITE_AESGCM && !secu_aesgcm_ok))
+    return NULL;
+  return &secu_suites[id];
+}
+
+
+//===========================================================================================================
+//                SECURITY: SESSION KEY STORE
+//===========================================================================================================
+
+/// @brief session keys of every worker, indexed like total_cli_fds (every thread only touches its own row)
+static sec_sess_t *secu_sess;
+
+
+/**
+ * @brief Allocates the session key store (guarded, locked pages), called once at startup before the threads run.
+ *
+ * The keys never leave this memory: the hot path encrypts and decrypts with them in place,
+ * the database only gets a copy when SESS_KEY_AUDIT is set.
+ *
+ * @return __SUCCESS__, or an error code if the allocation fails.
+ */
+errcode_t secu_sess_init(void)
+{
+  const size_t size = sizeof(sec_sess_t) * SERVER_THREAD_NO * SERVER_BACKLOG;
+
+  if (!(secu_sess = (sec_sess_t *)sodium_malloc(size)))
+    return LOG(SECU_LOG_PATH, EMALLOC_FAIL, EMALLOC_FAIL_M9);
+  sodium_memzero((void*)secu_sess, size);
+  secu_aesgcm_ok = (crypto_aead_aes256gcm_is_available() == 1);
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Stores the session key of a client.
+ *
+ * The suite is resolved here once: sealing and opening call it without looking at the id again.
+ * A suite this host cannot run falls back to the secretbox (the hello never agrees on one).
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param key_rx Symmetric key of the messages from the client.
+ * @param key_tx Symmetric key of the messages to the client.
+ * @param nonce Base nonce.
+ * @param counters Derive a nonce per message from the base nonce (SECU_DIR_*).
+ * @param suite Cipher suite agreed in the hello (SECU_SUITE_*).
+ */
+void secu_sess_set(size_t thread_index, size_t client_index, const uint8_t *key_rx, const uint8_t *key_tx,
+  const uint8_t *nonce, flag_t counters, uint32_t suite)
+{
+  sec_sess_t *sess = &secu_sess[thread_index * SERVER_BACKLOG + client_index];
+
+  memcpy((void*)sess->key_rx, key_rx, crypto_secretbox_KEYBYTES);
+  memcpy((void*)sess->key_tx, key_tx, crypto_secretbox_KEYBYTES);
+  memcpy((void*)sess->nonce, nonce, crypto_secretbox_NONCEBYTES);
+  sodium_memzero((void*)sess->key_prev, sizeof sess->key_prev);
+  sess->rx_from = 0;
+  sess->epoch_rx = 0;
+  sess->epoch_tx = 0;
+  sess->set = 1;
+  sess->counters = counters;
+  if (!(sess->suite = secu_suite_get(suite)))
+    sess->suite = &secu_suites[SECU_SUITE_SECRETBOX];
+}
+
+
+/**
+ * @brief Looks up the session key of a client.
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return The session key, or NULL if the client has not sent one yet.
+ */
+const sec_sess_t *secu_sess_get(size_t thread_index, size_t client_index)
+{
+  const sec_sess_t *sess = &secu_sess[thread_index * SERVER_BACKLOG + client_index];
+
+  if (!sess->set)
+  {
+    LOG(SECU_LOG_PATH, E_SESS_KEY, E_SESS_KEY_M);
+    return NULL;
+  }
+  return sess;
+}
+
+
+/**
+ * @brief Derives the nonce of a message from the base nonce of the session.
+ *
+ * The base nonce is random, xoring it with a different (seq, sub, dir) for every message never
+ * gives the same nonce twice under one key. Sessions without counters keep the base nonce.
+ * The counters only touch the first 12 bytes, the suites with a shorter nonce read only those.
+ *
+ * @param sess Session key.
+ * @param dir Direction of the message (SECU_DIR_*).
+ * @param seq Sequence number of the message.
+ * @param sub Second counter of the nonce (0 for now).
+ * @param n Buffer of crypto_secretbox_NONCEBYTES bytes receiving the nonce.
+ */
+static inline void secu_sess_nonce(const sec_sess_t *sess, uint8_t dir, uint64_t seq, uint32_t sub, uint8_t *n)
+{
+  memcpy((void*)n, sess->nonce, crypto_secretbox_NONCEBYTES);
+  if (!sess->counters)
+    return;
+
+  for (size_t i = 0; i < 8; i++)
+    n[i] ^= (uint8_t)(seq >> (8 * i));
+  sub |= (uint32_t)dir << 31;
+  for (size_t i = 0; i < 4; i++)
+    n[8 + i] ^= (uint8_t)(sub >> (8 * i));
+}
+
+
+/**
+ * @brief Seals a message sent to the client with the nonce of its sequence number.
+ *
+ * The box has the wire layout of a sealed segment [MAC][cipher]. The message may already sit
+ * right after the MAC (m == box + crypto_secretbox_MACBYTES), it is then encrypted in place.
+ *
+ * @param sess Session key.
+ * @param seq Number of the sealed message since the session key was set.
+ * @param box Buffer of mlen + crypto_secretbox_MACBYTES bytes receiving [MAC][cipher].
+ * @param m Message to encrypt.
+ * @param mlen Length of the message to encrypt.
+ * @return Error code indicating the success or failure of the encryption process.
+ */
+errcode_t secu_sess_seal(const sec_sess_t *sess, uint64_t seq, uint8_t *box, const uint8_t *m, size_t mlen)
+{
+  uint8_t n[crypto_secretbox_NONCEBYTES];
+
+  secu_sess_nonce(sess, SECU_DIR_TX, seq, 0, n);
+  return sess->suite->seal(sess->key_tx, n, box, box + crypto_secretbox_MACBYTES, m, mlen);
+}
+
+
+/**
+ * @brief Opens in place a sealed segment [MAC][cipher] received from the client with the nonce of its frame.
+ *
+ * The frames sent before the switch point of the last key update of the client are opened with
+ * the previous key: the key is picked by the number of the frame, never by trial.
+ *
+ * @param sess Session key.
+ * @param seq Number of the frame since the session key was set.
+ * @param sub Second counter of the nonce, 0 for the frames of the request module (envelopes are sealed whole).
+ * @param box Sealed segment, the plaintext overwrites the cipher right after the MAC.
+ * @param blen Length of the segment (>= crypto_secretbox_MACBYTES).
+ * @return Error code indicating the success or failure of the decryption process.
+ */
+errcode_t secu_sess_open(const sec_sess_t *sess, uint64_t seq, uint32_t sub, uint8_t *box, size_t blen)
+{
+  uint8_t n[crypto_secretbox_NONCEBYTES];
+
+  secu_sess_nonce(sess, SECU_DIR_RX, seq, sub, n);
+  return sess->suite->open((seq < sess->rx_from) ? sess->key_prev : sess->key_rx, n, box + crypto_secretbox_MACBYTES, box,
+    box + crypto_secretbox_MACBYTES, blen - crypto_secretbox_MACBYTES);
+}
+
+
+/**
+ * @brief Moves the messages sent to the client to the next key (key update of the server).
+ *
+ * The old key is overwritten: the message announcing the update is the last one it sealed.
+ * The counters go on, the nonces stay unique across the keys.
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @return The epoch of the new key.
+ */
+uint32_t secu_sess_rekey_tx(size_t thread_index, size_t client_index)
+{
+  sec_sess_t *sess = &secu_sess[thread_index * SERVER_BACKLOG + client_index];
+  uint8_t key[crypto_secretbox_KEYBYTES];
+
+  crypto_kdf_derive_from_key(key, sizeof key, ++sess->epoch_tx, SECU_KDF_CTX_TX, sess->key_tx);
+  memcpy((void*)sess->key_tx, key, sizeof key);
+  sodium_memzero((void*)key, sizeof key);
+  return sess->epoch_tx;
+}
+
+
+/**
+ * @brief Moves the frames of the client to the next key from frame 'from' on (key update of the client),
+ * the current key keeps opening the frames before.
+ *
+ * The overlap lets the frames the client sealed before it switched drain under the old key,
+ * the key before the old one is wiped.
+ *
+ * @param thread_index Index of the thread.
+ * @param client_index Index of the client.
+ * @param epoch Epoch announced by the client, must be the next one.
+ * @param from First frame sealed with the new key.
+ * @return __SUCCESS__, or E_REKEY if the epoch is not the next one.
+ */
+errcode_t secu_sess_rekey_rx(size_t thread_index, size_t client_index, uint32_t epoch, uint64_t from)
+{
+  sec_sess_t *sess = &secu_sess[thread_index * SERVER_BACKLOG + client_index];
+
+  if (epoch != sess->epoch_rx + 1)
+    return LOG(SECU_LOG_PATH, E_REKEY, E_REKEY_M);
+
+  memcpy((void*)sess->key_prev, sess->key_rx, sizeof sess->key_prev);
+  crypto_kdf_derive_from_key(sess->key_rx, sizeof sess->key_rx, epoch, SECU_KDF_CTX_RX, sess->key_prev);
+  sess->epoch_rx = epoch;
+  sess->rx_from = from;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Moves the session key of a client to another slot (cli_dc() compaction) and wipes the old slot.
+ *
+ * @param thread_index Index of the thread.
+ * @param dst Slot receiving the key (wiped only if it is src).
+ * @param src Slot of the key.
+ */
+void secu_sess_move(size_t thread_index, size_t dst, size_t src)
+{
+  sec_sess_t *row = &secu_sess[thread_index * SERVER_BACKLOG];
+
+  if (dst != src)
+    row[dst] = row[src];
+  sodium_memzero((void*)&row[src], sizeof row[src]);
+}
+
+
+//===========================================================================================================
+//                SECURITY: RESUMPTION TICKETS
+//===========================================================================================================
+
+/// @brief key sealing the tickets, ids start at 1 (0 never matches a ticket)
+typedef struct sec_ticket_key
+{
+  uint32_t id;
+  uint8_t  key[crypto_secretbox_KEYBYTES];
+}sec_ticket_key_t;
+
+/// @brief ticket redeemed and not expired yet
+typedef struct sec_replay
+{
+  uint8_t  tag[16];         // first bytes of the random nonce of the ticket
+  uint64_t expiry;          // 0 = free slot
+}sec_replay_t;
+
+/// @brief [0] the current ticket key, [1] the previous one (still opens the tickets it sealed)
+static sec_ticket_key_t *secu_tkeys;
+static pthread_rwlock_t  secu_tkeys_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t          secu_tkeys_next;   // rotation time of the current key, read without the lock
+
+static sec_replay_t      secu_replay[TICKET_REPLAY_SLOTS];
+static pthread_mutex_t   secu_replay_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/// @brief seconds of the monotonic clock
+static inline uint64_t secu_now_s(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec;
+}
+
+
+/**
+ * @brief Allocates the ticket keys (guarded, locked pages) and draws the first one, called once at startup.
+ *
+ * @return __SUCCESS__, or an error code if the allocation fails.
+ */
+errcode_t secu_ticket_init(void)
+{
+  if (!(secu_tkeys = (sec_ticket_key_t *)sodium_allocarray(2, sizeof(sec_ticket_key_t))))
+    return LOG(SECU_LOG_PATH, EMALLOC_FAIL, EMALLOC_FAIL_M11);
+  sodium_memzero((void*)secu_tkeys, 2 * sizeof(sec_ticket_key_t));
+  secu_tkeys[0].id = 1;
+  randombytes_buf(secu_tkeys[0].key, sizeof secu_tkeys[0].key);
+  secu_tkeys_next = secu_now_s() + TICKET_ROTATE_S;
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Draws a new ticket key once the current one is TICKET_ROTATE_S old, the current one becomes the previous.
+ *
+ * A ticket lives at most TICKET_ROTATE_S so nothing sealed under the key dropped is still valid.
+ * Called by issue only: the workers do not rotate keys nobody uses.
+ *
+ * @param now Seconds of the monotonic clock.
+ */
+static void secu_ticket_rotate(uint64_t now)
+{
+  pthread_rwlock_wrlock(&secu_tkeys_lock);
+  if (now >= secu_tkeys_next)
+  {
+    secu_tkeys[1] = secu_tkeys[0];
+    secu_tkeys[0].id++;
+    randombytes_buf(secu_tkeys[0].key, sizeof secu_tkeys[0].key);
+    __atomic_store_n(&secu_tkeys_next, now + TICKET_ROTATE_S, __ATOMIC_RELEASE);
+  }
+  pthread_rwlock_unlock(&secu_tkeys_lock);
+}
+
+
+/**
+ * @brief Draws the resumption secret and the expiry of a ticket and seals it under the current ticket key.
+ *
+ * @param ticket Content of the ticket, the caller fills what the connection agreed.
+ * @param out Buffer of SECU_TICKET_LEN bytes receiving the ticket [key id][nonce][MAC][cipher].
+ * @return __SUCCESS__, or an error code if the ticket cannot be sealed.
+ */
+errcode_t secu_ticket_issue(sec_ticket_t *ticket, uint8_t *out)
+{
+  uint8_t *n = out + SECU_TICKET_ID_LEN;
+  uint8_t *mac = n + crypto_secretbox_NONCEBYTES;
+  const uint64_t now = secu_now_s();
+  errcode_t status;
+
+  if (now >= __atomic_load_n(&secu_tkeys_next, __ATOMIC_ACQUIRE))
+    secu_ticket_rotate(now);
+
+  randombytes_buf(ticket->secret, sizeof ticket->secret);
+  ticket->expiry = now + TICKET_LIFETIME_S;
+  randombytes_buf(n, crypto_secretbox_NONCEBYTES);
+
+  pthread_rwlock_rdlock(&secu_tkeys_lock);
+  memcpy((void*)out, &secu_tkeys[0].id, SECU_TICKET_ID_LEN);
+  status = secu_symmetric_encrypt_detached(secu_tkeys[0].key, n, mac, mac + crypto_secretbox_MACBYTES,
+                                           (const uint8_t *)ticket, sizeof *ticket);
+  pthread_rwlock_unlock(&secu_tkeys_lock);
+  return status;
+}
+
+
+/**
+ * @brief Remembers a ticket until it expires, refuses it if it is already remembered.
+ *
+ * Expired entries on the probe path are reused. A ticket whose probe path is full of live entries
+ * is refused as well: the client falls back to a full handshake, a replay never gets through.
+ *
+ * @param tag First bytes of the nonce of the ticket (random, unique per ticket).
+ * @param expiry Expiry of the ticket.
+ * @param now Seconds of the monotonic clock.
+ * @return __SUCCESS__, or E_TICKET if the ticket was seen or the table has no room for it.
+ */
+static errcode_t secu_replay_check(const uint8_t *tag, uint64_t expiry, uint64_t now)
+{
+  uint32_t h;
+  sec_replay_t *slot = NULL;
+  errcode_t status = __SUCCESS__;
+
+  memcpy(&h, tag, sizeof h);
+  pthread_mutex_lock(&secu_replay_lock);
+  for (uint32_t i = 0; i < TICKET_REPLAY_PROBE; i++)
+  {
+    sec_replay_t *e = &secu_replay[(h + i) & (TICKET_REPLAY_SLOTS - 1)];
+
+    if (e->expiry > now && !memcmp(e->tag, tag, sizeof e->tag))
+    {
+      status = E_TICKET;
+      break;
+    }
+    if (!slot && e->expiry <= now)
+      slot = e;
+  }
+  if (!status && !slot)
+    status = E_TICKET;
+  if (!status)
+  {
+    memcpy((void*)slot->tag, tag, sizeof slot->tag);
+    slot->expiry = expiry;
+  }
+  pthread_mutex_unlock(&secu_replay_lock);
+  return status;
+}
+
+
+/**
+ * @brief Opens a ticket presented by a client, it is accepted once only.
+ *
+ * No asymmetric crypto and no database: one secretbox open under a key held in memory.
+ *
+ * @param in Ticket (SECU_TICKET_LEN bytes).
+ * @param ticket Receives the content of the ticket.
+ * @return __SUCCESS__, or E_TICKET if the key is gone, the ticket is forged, expired or replayed.
+ */
+errcode_t secu_ticket_redeem(const uint8_t *in, sec_ticket_t *ticket)
+{
+  const uint8_t *n = in + SECU_TICKET_ID_LEN;
+  const uint8_t *mac = n + crypto_secretbox_NONCEBYTES;
+  const uint64_t now = secu_now_s();
+  errcode_t status = E_TICKET;
+  uint32_t id;
+
+  memcpy(&id, in, SECU_TICKET_ID_LEN);
+  pthread_rwlock_rdlock(&secu_tkeys_lock);
+  for (size_t k = 0; k < 2; k++)
+  {
+    if (id && id == secu_tkeys[k].id)
+    {
+      status = (crypto_secretbox_open_detached((uint8_t *)ticket, mac + crypto_secretbox_MACBYTES, mac,
+                                               sizeof *ticket, n, secu_tkeys[k].key) == 0) ? __SUCCESS__ : E_TICKET;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&secu_tkeys_lock);
+
+  if (!status && ticket->expiry <= now)
+    status = E_TICKET;
+  if (!status)
+    status = secu_replay_check(n, ticket->expiry, now);
+  if (status)
+  {
+    sodium_memzero((void*)ticket, sizeof *ticket);
+    return LOG(SECU_LOG_PATH, E_TICKET, E_TICKET_M);
+  }
+  return __SUCCESS__;
+}
+
+
+/**
+ * @brief Derives the keys of a resumed session from the secret of its ticket and the randoms of both ends.
+ *
+ * key = BLAKE2b keyed with the secret over (direction || client random || server random): the randoms
+ * make the keys of every resumption fresh, even if a client presented its ticket twice.
+ *
+ * @param secret Resumption secret of the ticket.
+ * @param client_random Random sent by the client with its ticket.
+ * @param server_random Random sent back by the server.
+ * @param rx Receives the key of the messages from the client ('c').
+ * @param tx Receives the key of the messages to the client ('s').
+ */
+void secu_ticket_keys(const uint8_t *secret, const uint8_t *client_random, const uint8_t *server_random,
+  uint8_t *rx, uint8_t *tx)
+{
+  uint8_t in[1 + 2 * SECU_RANDOM_LEN];
+
+  memcpy((void*)(in + 1), client_random, SECU_RANDOM_LEN);
+  memcpy((void*)(in + 1 + SECU_RANDOM_LEN), server_random, SECU_RANDOM_LEN);
+  in[0] = 'c';
+  crypto_generichash(rx, crypto_secretbox_KEYBYTES, in, sizeof in, secret, SECU_TICKET_SECRET);
+  in[0] = 's';
+  crypto_generichash(tx, crypto_secretbox_KEYBYTES, in, sizeof in, secret, SECU_TICKET_SECRET);
+}
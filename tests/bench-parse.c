@@ -0,0 +1,90 @@
+#include "../include/frame.h"
+#include <time.h>
+
+// make bench-parse && ./bin/bench-parse [iterations]
+// Measures frames/sec of req_parse() against copying every segment out of the frame
+// (what the handlers did before the parser existed).
+
+#define BENCH_ITER      10000000UL
+#define BENCH_FRAME_MAX 1023U   // RECV_VAL1
+
+static double elapsed(const struct timespec *start, const struct timespec *end)
+{
+  return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// builds [reqcode][seglen][seg]... with nseg segments of seglen bytes
+static size_t build_frame(uint8_t *buf, uint32_t nseg, uint32_t seglen)
+{
+  uint32_t reqcode = 1;
+  size_t offset = REQ_CODE_LEN;
+
+  memcpy(buf, &reqcode, REQ_CODE_LEN);
+  for (uint32_t i = 0; i < nseg; i++)
+  {
+    memcpy(buf + offset, &seglen, REQ_SEGLEN_LEN);
+    offset += REQ_SEGLEN_LEN;
+    memset(buf + offset, (int)i, seglen);
+    offset += seglen;
+  }
+  return offset;
+}
+
+static void bench(uint32_t nseg, uint32_t seglen, unsigned long iter)
+{
+  uint8_t buf[BENCH_FRAME_MAX];
+  uint8_t copy[BENCH_FRAME_MAX];
+  req_frame_t frame;
+  struct timespec start, end;
+  volatile uint32_t sink = 0;
+  size_t len = build_frame(buf, nseg, seglen);
+  double t_parse, t_copy;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned long i = 0; i < iter; i++)
+  {
+    if (req_parse(buf, len, &frame))
+    {
+      printf("parse failed\n");
+      return;
+    }
+    sink += frame.seg[frame.nseg - 1].len;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  t_parse = elapsed(&start, &end);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned long i = 0; i < iter; i++)
+  {
+    size_t offset = REQ_CODE_LEN, out = 0;
+    uint32_t l;
+    while (offset < len)
+    {
+      memcpy(&l, buf + offset, REQ_SEGLEN_LEN);
+      offset += REQ_SEGLEN_LEN;
+      memmove(copy + out, buf + offset, l);
+      out += l;
+      offset += l;
+    }
+    sink += copy[out - 1];
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  t_copy = elapsed(&start, &end);
+
+  printf("%2u segs x %4u bytes (%4zu byte frame): parse %12.0f frames/s (%6.1f ns) | copy %12.0f frames/s (%6.1f ns)\n",
+         nseg, seglen, len, iter / t_parse, t_parse * 1e9 / iter, iter / t_copy, t_copy * 1e9 / iter);
+  (void)sink;
+}
+
+int main(int argc, const char **argv)
+{
+  unsigned long iter = (argc > 1) ? strtoul(argv[1], NULL, 10) : BENCH_ITER;
+
+  bench(1, 21, iter);     // REQ_RECV_PING
+  bench(2, 72, iter);     // REQ_RECV_K
+  bench(4, 32, iter);
+  bench(8, 64, iter);
+  bench(16, 16, iter);
+  bench(2, 500, iter);
+  return 0;
+}